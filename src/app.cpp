@@ -3,6 +3,8 @@
 #include "scene/mesh_render.h"
 #include "scene/util.h"
 #include "platform/platform.h"
+#include "platform/prof.h"
+#include "lib/jobs.h"
 
 #include <SDL2/SDL.h>
 #include <imgui/imgui.h>
@@ -17,14 +19,44 @@ App::App(Platform& plt) :
 
 	GL::global_params();
 	Renderer::setup(window_dim);
+
+	// Pick up where a crashed session left off
+	if(char* pref = SDL_GetPrefPath("s4d", "s4d")) {
+		bool recovered = false;
+		std::string err = journal.open(std::string(pref), scene, undo, recovered);
+		SDL_free(pref);
+		if(!err.empty()) gui.set_error(err);
+		else if(recovered) gui.set_error("Restored unsaved changes from the previous session.");
+	} else {
+		warn("Failed to find a directory for the session journal: %s", SDL_GetError());
+	}
 }
 
 App::~App() {
 	Renderer::shutdown();
 }
 
+void App::invalidate() {
+	redraw_frames = settle_frames;
+}
+
+bool App::needs_redraw() {
+
+	if(gui.check_redraw()) invalidate();
+	if(Renderer::check_redraw()) invalidate();
+
+	return Renderer::continuous() ||
+		   redraw_frames > 0 ||
+		   gui_capture ||
+		   scene.loading() ||
+		   Jobs::main_pending() ||
+		   cam_mode != Camera_Control::none;
+}
+
 void App::event(SDL_Event e) {
 
+	invalidate();
+
 	ImGuiIO& IO = ImGui::GetIO();
 	IO.DisplayFramebufferScale = plt.scale_mouse({1.0f, 1.0f});
 
@@ -147,7 +179,7 @@ void App::render_selected(Scene_Object& obj) {
 		Renderer::outline(viewproj, view, obj);
 
 		float scl = (camera.pos() - obj.pose.pos).norm() / 5.5f;
-		gui.render_widgets(viewproj, view, obj.pose.pos, scl);
+		gui.render_widgets(view, obj.pose.pos, scl);
 
 	} else if(gui.mode() == Gui::Mode::model) {
 		
@@ -160,7 +192,7 @@ void App::render_selected(Scene_Object& obj) {
 			Vec3 pos = Halfedge_Mesh::center_of(e);
 			if(!std::holds_alternative<Halfedge_Mesh::HalfedgeRef>(e)) {
  				float scl = (camera.pos() - pos).norm() / 5.5f;
-				gui.render_widgets(viewproj, view, pos, scl);
+				gui.render_widgets(view, pos, scl);
 			}
 		}
 
@@ -171,18 +203,22 @@ void App::render_selected(Scene_Object& obj) {
 
 void App::render() {
 
+	if(redraw_frames > 0) redraw_frames--;
+
+	Jobs::run_main();
+
 	proj = camera.proj();
 	view = camera.view();	
-	viewproj = proj * view;
-	iviewproj = Mat4::inverse(viewproj);
+	viewproj = camera.viewproj();
+	iviewproj = camera.iviewproj();
 
 	Renderer::begin();
-	Renderer::proj(proj);
+	Renderer::frame(proj, viewproj);
 	
 	if(gui.mode() == Gui::Mode::scene) {
         scene.render_objs(view, gui.selected_id());
 	}
-	gui.render_base(viewproj);
+	gui.render_base();
 
 	auto selected = scene.get(gui.selected_id());
 	if(selected.has_value()) {
@@ -191,10 +227,14 @@ void App::render() {
 	Renderer::complete();
 
 	// GUI
+	PROF_ZONE("GUI");
 	float height = gui.menu(scene, undo, settings_open);
 	gui.objs(scene, undo, height);
 	gui.error();
+	gui.loading(scene, undo);
 	if(settings_open) Renderer::settings_gui(&settings_open);
+
+	journal.update(scene);
 }
 
 Vec3 App::screen_to_world(Vec2 mouse) {
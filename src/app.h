@@ -11,6 +11,7 @@
 #include "scene/scene.h"
 
 #include "gui.h"
+#include "journal.h"
 #include "undo.h"
 
 class Platform;
@@ -23,6 +24,12 @@ public:
 	void event(SDL_Event e);
 	void settings();
 
+	/// Request that the next few frames be drawn
+	void invalidate();
+	/// Whether the app has pending visual changes; if not, the platform
+	/// may block until the next event arrives.
+	bool needs_redraw();
+
 private:
 	Scene_Object::ID read_id(Vec2 pos);
 	void apply_window_dim(Vec2 new_dim);
@@ -46,7 +53,12 @@ private:
 	Scene scene;
 	Gui gui;
 	Undo undo;
+	Journal journal;
 
 	bool gui_capture = false;
 	bool settings_open = false;
+
+	// ImGui needs a couple frames to settle after input (hover, popups, resizing)
+	static const int settle_frames = 3;
+	int redraw_frames = settle_frames;
 };
@@ -0,0 +1,218 @@
+
+// Benchmarks for the mesh editing hot paths. Loads every data/*.dae through
+// Scene::load and reports per-operation timing and allocation statistics
+// as JSON, so results can be diffed between builds.
+//
+// Usage: s4d_bench [--data dir] [--samples n] [--seed n] [--workers n] [--out bench.json]
+
+#include "common.h"
+#include "../scene/scene.h"
+#include "../undo.h"
+#include "../lib/jobs.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <random>
+
+// Count every heap allocation so each operation can report how much it
+// churns the allocator, not just how long it takes.
+static std::atomic<size_t> n_allocs = 0;
+
+void* operator new(size_t size) {
+	n_allocs.fetch_add(1, std::memory_order_relaxed);
+	if(void* p = std::malloc(size ? size : 1)) return p;
+	throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept {
+	std::free(p);
+}
+void operator delete(void* p, size_t) noexcept {
+	std::free(p);
+}
+
+struct Result {
+	std::string name;
+	Bench::Stats time_ms, allocs;
+};
+
+/// Runs setup (untimed) then op (timed) for each sample
+static Result measure(std::string name, int samples, std::function<void()> setup, std::function<void()> op) {
+	Result r;
+	r.name = name;
+	for(int i = 0; i < samples; i++) {
+		if(setup) setup();
+		size_t a = n_allocs.load(std::memory_order_relaxed);
+		double t = Bench::now_ms();
+		op();
+		double dt = Bench::now_ms() - t;
+		r.time_ms.add(dt);
+		r.allocs.add((double)(n_allocs.load(std::memory_order_relaxed) - a));
+	}
+	return r;
+}
+
+template<typename T>
+static std::vector<T> gather(T begin, T end) {
+	std::vector<T> refs;
+	for(T i = begin; i != end; i++) refs.push_back(i);
+	return refs;
+}
+
+static void write_result(FILE* out, const Result& r, bool last) {
+	fprintf(out, "        \"%s\": {\"samples\": %zu, \"median_ms\": %.6f, \"p95_ms\": %.6f, "
+				 "\"mean_allocs\": %.1f, \"p95_allocs\": %.0f}%s\n",
+			r.name.c_str(), r.time_ms.samples.size(), r.time_ms.percentile(0.5),
+			r.time_ms.percentile(0.95), r.allocs.mean(), r.allocs.percentile(0.95), last ? "" : ",");
+}
+
+int main(int argc, char** argv) {
+
+	std::string data_dir = "data", out_file = "bench.json";
+	int samples = 50;
+	unsigned int seed = 1;
+	int workers = 0;
+
+	for(int i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "--data") && i + 1 < argc) data_dir = argv[++i];
+		else if(!strcmp(argv[i], "--samples") && i + 1 < argc) samples = std::max(1, atoi(argv[++i]));
+		else if(!strcmp(argv[i], "--seed") && i + 1 < argc) seed = (unsigned int)atoi(argv[++i]);
+		else if(!strcmp(argv[i], "--workers") && i + 1 < argc) workers = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "--out") && i + 1 < argc) out_file = argv[++i];
+		else die("Unknown argument %s", argv[i]);
+	}
+
+	Bench::Headless context;
+	Jobs::init(workers);
+
+	std::vector<std::string> files = Bench::data_files(data_dir);
+	if(files.empty()) die("No .dae files found in %s", data_dir.c_str());
+
+	FILE* out = fopen(out_file.c_str(), "w");
+	if(!out) die("Failed to open %s", out_file.c_str());
+
+	std::mt19937 rng(seed);
+	fprintf(out, "{\n  \"seed\": %u,\n  \"samples\": %d,\n  \"files\": [\n", seed, samples);
+
+	bool first = true;
+	for(const std::string& file : files) {
+
+		info("Benchmarking %s", file.c_str());
+		std::vector<Result> results;
+
+		results.push_back(measure("load", std::max(1, samples / 10), nullptr, [&]() {
+			Undo undo;
+			Scene scene(1);
+			std::string err = scene.load(false, undo, file);
+			if(!err.empty()) warn("%s", err.c_str());
+		}));
+
+		// Keep one copy of each mesh around as the source for every sample
+		Undo undo;
+		Scene scene(1);
+		scene.load(false, undo, file);
+
+		std::vector<Halfedge_Mesh> meshes;
+		size_t n_faces = 0;
+		scene.for_objs([&](Scene_Object& obj) {
+			meshes.emplace_back();
+			obj.get_mesh().copy_to(meshes.back());
+			n_faces += meshes.back().n_faces();
+		});
+
+		if(meshes.empty()) {
+			warn("%s has no editable meshes", file.c_str());
+			continue;
+		}
+
+		std::vector<std::vector<std::vector<Halfedge_Mesh::Index>>> polys(meshes.size());
+		std::vector<std::vector<GL::Mesh::Vert>> verts(meshes.size());
+		for(size_t i = 0; i < meshes.size(); i++) {
+			meshes[i].to_poly(polys[i], verts[i]);
+		}
+
+		results.push_back(measure("from_poly", samples, nullptr, [&]() {
+			for(size_t i = 0; i < meshes.size(); i++) {
+				Halfedge_Mesh mesh;
+				mesh.from_poly(polys[i], verts[i]);
+			}
+		}));
+
+		std::vector<Halfedge_Mesh> copies(meshes.size());
+		results.push_back(measure("copy_to", samples, nullptr, [&]() {
+			for(size_t i = 0; i < meshes.size(); i++) meshes[i].copy_to(copies[i]);
+		}));
+
+		// Includes the GL buffer upload
+		GL::Mesh gl_mesh;
+		results.push_back(measure("to_mesh", samples, nullptr, [&]() {
+			for(auto& m : meshes) m.to_mesh(gl_mesh, true);
+		}));
+
+		results.push_back(measure("validate", samples, nullptr, [&]() {
+			for(auto& m : meshes) m.validate();
+		}));
+
+		results.push_back(measure("index", samples, nullptr, [&]() {
+			for(auto& m : meshes) m.index(0);
+		}));
+
+		// Local operations: each sample applies one operation to a random
+		// element of a random mesh, on a fresh copy of the mesh.
+		Halfedge_Mesh work;
+		auto local_op = [&](std::string name, auto begin, auto end, auto op) {
+			decltype(begin(work)) elem;
+			results.push_back(measure(name, samples, [&]() {
+				meshes[rng() % meshes.size()].copy_to(work);
+				auto refs = gather(begin(work), end(work));
+				elem = refs[rng() % refs.size()];
+			}, [&]() {
+				op(work, elem);
+			}));
+		};
+
+		auto verts_begin = [](Halfedge_Mesh& m) { return m.vertices_begin(); };
+		auto verts_end = [](Halfedge_Mesh& m) { return m.vertices_end(); };
+		auto edges_begin = [](Halfedge_Mesh& m) { return m.edges_begin(); };
+		auto edges_end = [](Halfedge_Mesh& m) { return m.edges_end(); };
+		auto faces_begin = [](Halfedge_Mesh& m) { return m.faces_begin(); };
+		auto faces_end = [](Halfedge_Mesh& m) { return m.faces_end(); };
+
+		using VertexRef = Halfedge_Mesh::VertexRef;
+		using EdgeRef = Halfedge_Mesh::EdgeRef;
+		using FaceRef = Halfedge_Mesh::FaceRef;
+
+		local_op("erase_vertex", verts_begin, verts_end, [](Halfedge_Mesh& m, VertexRef v) { m.erase_vertex(v); });
+		local_op("erase_edge", edges_begin, edges_end, [](Halfedge_Mesh& m, EdgeRef e) { m.erase_edge(e); });
+		local_op("collapse_edge", edges_begin, edges_end, [](Halfedge_Mesh& m, EdgeRef e) { m.collapse_edge(e); });
+		local_op("flip_edge", edges_begin, edges_end, [](Halfedge_Mesh& m, EdgeRef e) { m.flip_edge(e); });
+		local_op("split_edge", edges_begin, edges_end, [](Halfedge_Mesh& m, EdgeRef e) { m.split_edge(e); });
+		local_op("collapse_face", faces_begin, faces_end, [](Halfedge_Mesh& m, FaceRef f) { m.collapse_face(f); });
+		local_op("bevel_vertex", verts_begin, verts_end, [](Halfedge_Mesh& m, VertexRef v) { m.bevel_vertex(v); });
+		local_op("bevel_edge", edges_begin, edges_end, [](Halfedge_Mesh& m, EdgeRef e) { m.bevel_edge(e); });
+		local_op("bevel_face", faces_begin, faces_end, [](Halfedge_Mesh& m, FaceRef f) { m.bevel_face(f); });
+
+		results.push_back(measure("triangulate", samples, [&]() {
+			meshes[rng() % meshes.size()].copy_to(work);
+		}, [&]() {
+			work.triangulate();
+		}));
+
+		fprintf(out, "%s    {\n      \"file\": \"%s\",\n      \"meshes\": %zu,\n      \"faces\": %zu,\n      \"results\": {\n",
+				first ? "" : ",\n", Bench::escape(file).c_str(), meshes.size(), n_faces);
+		for(size_t i = 0; i < results.size(); i++) {
+			write_result(out, results[i], i + 1 == results.size());
+		}
+		fprintf(out, "      }\n    }");
+		fflush(out);
+		first = false;
+	}
+
+	fprintf(out, "\n  ]\n}\n");
+	fclose(out);
+	info("Wrote %s", out_file.c_str());
+	Jobs::shutdown();
+	return 0;
+}
@@ -0,0 +1,129 @@
+
+#pragma once
+
+// Shared setup for the headless benchmark/stress executables.
+
+#include "../lib/log.h"
+#include "../scene/halfedge.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <SDL2/SDL.h>
+#include <glad/glad.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace Bench {
+
+/// GL::Mesh needs a live context even though we never draw, so create a
+/// hidden window to own one.
+class Headless {
+public:
+	Headless() {
+		if(SDL_Init(SDL_INIT_VIDEO) != 0) {
+			die("Failed to initialize SDL: %s", SDL_GetError());
+		}
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, SDL_GL_CONTEXT_FORWARD_COMPATIBLE_FLAG);
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+
+		window = SDL_CreateWindow("s4d", 0, 0, 16, 16, SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+		if(!window) {
+			die("Failed to create window: %s", SDL_GetError());
+		}
+		context = SDL_GL_CreateContext(window);
+		if(!context) {
+			die("Failed to create OpenGL 3.3 context: %s", SDL_GetError());
+		}
+		if(!gladLoadGL()) {
+			die("Failed to load OpenGL functions.");
+		}
+	}
+	~Headless() {
+		SDL_GL_DeleteContext(context);
+		SDL_DestroyWindow(window);
+		SDL_Quit();
+	}
+
+private:
+	SDL_Window* window = nullptr;
+	SDL_GLContext context = nullptr;
+};
+
+/// Every .dae file in dir, sorted so runs are comparable
+inline std::vector<std::string> data_files(std::string dir) {
+	std::vector<std::string> files;
+	std::error_code err;
+	for(auto& entry : std::filesystem::directory_iterator(dir, err)) {
+		if(entry.path().extension() == ".dae") {
+			files.push_back(entry.path().string());
+		}
+	}
+	std::sort(files.begin(), files.end());
+	return files;
+}
+
+/// Escape a string for inclusion in JSON output
+inline std::string escape(const std::string& str) {
+	std::string ret;
+	for(char c : str) {
+		if(c == '"' || c == '\\') ret.push_back('\\');
+		ret.push_back(c);
+	}
+	return ret;
+}
+
+inline double now_ms() {
+	using namespace std::chrono;
+	return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+/// Peak resident memory of the process so far
+inline double peak_memory_mb() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if(!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return 0.0;
+	return pmc.PeakWorkingSetSize / (1024.0 * 1024.0);
+#else
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage)) return 0.0;
+#ifdef __APPLE__
+	return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+	return usage.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+/// Order statistics over a set of samples
+struct Stats {
+	void add(double sample) {
+		samples.push_back(sample);
+	}
+	double percentile(double p) const {
+		if(samples.empty()) return 0.0;
+		std::vector<double> s = samples;
+		size_t i = std::min(s.size() - 1, (size_t)(p * (s.size() - 1) + 0.5));
+		std::nth_element(s.begin(), s.begin() + i, s.end());
+		return s[i];
+	}
+	double mean() const {
+		if(samples.empty()) return 0.0;
+		double sum = 0.0;
+		for(double s : samples) sum += s;
+		return sum / samples.size();
+	}
+	std::vector<double> samples;
+};
+}
@@ -0,0 +1,322 @@
+
+// Randomized stress test for the local mesh operations in meshedit.cpp.
+//
+// Operations are applied to elements found by a random walk from the
+// element the previous operation returned, so selection is O(1) and stays
+// on live elements no matter how fragmented the mesh gets. The mesh is
+// validated periodically; on failure we bisect back from the last valid
+// checkpoint to the first operation that broke it.
+//
+// Every operation is written to a replay log. Runs are deterministic for a
+// given seed, and a log can be replayed exactly with --replay even after
+// the random selection logic changes.
+//
+// Usage: s4d_fuzz [--data dir] [--seed n] [--ops n] [--check n]
+//                 [--log fuzz.log] [--out fuzz.jsonl] [--replay file]
+
+#include "common.h"
+#include "../scene/scene.h"
+#include "../undo.h"
+
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+using HalfedgeRef = Halfedge_Mesh::HalfedgeRef;
+
+enum class Op : int {
+	erase_vertex,
+	erase_edge,
+	collapse_edge,
+	collapse_face,
+	flip_edge,
+	split_edge,
+	bevel_vertex,
+	bevel_edge,
+	bevel_face,
+	count
+};
+
+static const char* op_names[] = {"erase_vertex", "erase_edge",	 "collapse_edge",
+								 "collapse_face", "flip_edge",	 "split_edge",
+								 "bevel_vertex",  "bevel_edge", "bevel_face"};
+
+/// One logged operation: optionally jump to a uniformly random halfedge,
+/// then walk from the cursor ('n' = next, 't' = twin) and apply the op.
+struct Record {
+	Op op;
+	long long reseed = -1;
+	std::string walk;
+};
+
+static std::string write_record(const Record& r) {
+	return std::string(op_names[(int)r.op]) + " " + std::to_string(r.reseed) + " " +
+		   (r.walk.empty() ? "-" : r.walk);
+}
+
+static bool read_record(const std::string& line, Record& r) {
+	std::istringstream stream(line);
+	std::string name, walk;
+	if(!(stream >> name >> r.reseed >> walk)) return false;
+	for(int i = 0; i < (int)Op::count; i++) {
+		if(name == op_names[i]) {
+			r.op = (Op)i;
+			r.walk = walk == "-" ? "" : walk;
+			return true;
+		}
+	}
+	return false;
+}
+
+static HalfedgeRef nth_halfedge(Halfedge_Mesh& mesh, size_t n) {
+	HalfedgeRef h = mesh.halfedges_begin();
+	std::advance(h, n);
+	return h;
+}
+
+static size_t halfedge_index(Halfedge_Mesh& mesh, HalfedgeRef cursor) {
+	size_t i = 0;
+	for(HalfedgeRef h = mesh.halfedges_begin(); h != cursor; h++) i++;
+	return i;
+}
+
+/// Apply a record to the mesh, moving the cursor to the returned element
+static void apply(Halfedge_Mesh& mesh, HalfedgeRef& cursor, const Record& r) {
+
+	if(r.reseed >= 0) cursor = nth_halfedge(mesh, (size_t)r.reseed);
+	for(char c : r.walk) {
+		cursor = c == 't' ? cursor->twin() : cursor->next();
+	}
+
+	auto face = cursor->face();
+	if(face->is_boundary()) face = cursor->twin()->face();
+
+	switch(r.op) {
+	case Op::erase_vertex: cursor = mesh.erase_vertex(cursor->vertex())->halfedge(); break;
+	case Op::erase_edge: cursor = mesh.erase_edge(cursor->edge())->halfedge(); break;
+	case Op::collapse_edge: cursor = mesh.collapse_edge(cursor->edge())->halfedge(); break;
+	case Op::flip_edge: cursor = mesh.flip_edge(cursor->edge())->halfedge(); break;
+	case Op::split_edge: cursor = mesh.split_edge(cursor->edge())->halfedge(); break;
+	case Op::bevel_vertex: cursor = mesh.bevel_vertex(cursor->vertex())->halfedge(); break;
+	case Op::bevel_edge: cursor = mesh.bevel_edge(cursor->edge())->halfedge(); break;
+	case Op::collapse_face: {
+		if(!face->is_boundary()) cursor = mesh.collapse_face(face)->halfedge();
+	} break;
+	case Op::bevel_face: {
+		if(!face->is_boundary()) cursor = mesh.bevel_face(face)->halfedge();
+	} break;
+	default: assert(false);
+	}
+}
+
+static Record generate(std::mt19937& rng, const Halfedge_Mesh& mesh) {
+	Record r;
+	r.op = (Op)(rng() % (int)Op::count);
+	// Occasionally jump somewhere else so we don't only edit one region
+	if(rng() % 256 == 0) r.reseed = (long long)(rng() % mesh.n_halfedges());
+	size_t steps = rng() % 8;
+	for(size_t i = 0; i < steps; i++) r.walk.push_back(rng() % 2 ? 't' : 'n');
+	return r;
+}
+
+struct Checkpoint {
+	Halfedge_Mesh mesh;
+	size_t cursor = 0;
+	size_t step = 0;
+	std::vector<Record> since;
+};
+
+static void save(Checkpoint& cp, Halfedge_Mesh& mesh, HalfedgeRef cursor, size_t step) {
+	mesh.copy_to(cp.mesh);
+	cp.cursor = halfedge_index(mesh, cursor);
+	cp.step = step;
+	cp.since.clear();
+}
+
+/// Returns the number of operations after the checkpoint that still
+/// validate; the next one is the first to break the mesh.
+static size_t bisect(Checkpoint& cp, std::string& err) {
+
+	size_t lo = 0, hi = cp.since.size();
+	while(hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+		Halfedge_Mesh mesh;
+		cp.mesh.copy_to(mesh);
+		HalfedgeRef cursor = nth_halfedge(mesh, cp.cursor);
+		for(size_t i = 0; i < mid; i++) apply(mesh, cursor, cp.since[i]);
+		if(mesh.validate().empty()) lo = mid;
+		else hi = mid;
+	}
+
+	Halfedge_Mesh mesh;
+	cp.mesh.copy_to(mesh);
+	HalfedgeRef cursor = nth_halfedge(mesh, cp.cursor);
+	for(size_t i = 0; i < hi; i++) apply(mesh, cursor, cp.since[i]);
+	err = mesh.validate();
+	return lo;
+}
+
+struct Options {
+	std::string data_dir = "data";
+	std::string log_file = "fuzz.log";
+	std::string out_file = "fuzz.jsonl";
+	std::string replay;
+	unsigned int seed = 1;
+	size_t ops = 1000000;
+	size_t check = 1000;
+	size_t report = 100000;
+};
+
+/// Returns false if the mesh became invalid
+static bool fuzz(const Options& opt, std::string file, Halfedge_Mesh& mesh, std::vector<Record>* replay,
+				 std::ofstream& replay_log, FILE* out) {
+
+	std::mt19937 rng(opt.seed);
+	HalfedgeRef cursor = mesh.halfedges_begin();
+
+	Checkpoint cp;
+	save(cp, mesh, cursor, 0);
+
+	size_t n_ops = replay ? replay->size() : opt.ops;
+	double op_ms = 0.0, window_start = Bench::now_ms();
+	size_t window_ops = 0;
+
+	for(size_t step = 0; step < n_ops; step++) {
+
+		if(mesh.n_halfedges() == 0) {
+			info("%s: mesh is empty after %zu operations", file.c_str(), step);
+			break;
+		}
+
+		Record r = replay ? (*replay)[step] : generate(rng, mesh);
+		// Flush before applying so the record survives a crash inside apply()
+		replay_log << write_record(r) << std::endl;
+		cp.since.push_back(r);
+
+		double t = Bench::now_ms();
+		apply(mesh, cursor, r);
+		op_ms += Bench::now_ms() - t;
+		window_ops++;
+
+		bool last = step + 1 == n_ops;
+		if((step + 1) % opt.check == 0 || last) {
+			if(!mesh.validate().empty()) {
+				std::string err;
+				size_t good = bisect(cp, err);
+				size_t bad = cp.step + good;
+				warn("%s: operation %zu (%s) produced an invalid mesh: %s", file.c_str(), bad,
+					 write_record(cp.since[good]).c_str(), err.c_str());
+				fprintf(out,
+						"{\"file\": \"%s\", \"failed_step\": %zu, \"op\": \"%s\", \"error\": \"%s\"}\n",
+						Bench::escape(file).c_str(), bad, op_names[(int)cp.since[good].op],
+						Bench::escape(err).c_str());
+				return false;
+			}
+			save(cp, mesh, cursor, step + 1);
+		}
+
+		if((step + 1) % opt.report == 0 || last) {
+			double now = Bench::now_ms();
+			double op_sec = std::max(op_ms, 1e-6) / 1000.0, wall_sec = std::max(now - window_start, 1e-6) / 1000.0;
+			fprintf(out,
+					"{\"file\": \"%s\", \"step\": %zu, \"ops_per_sec\": %.0f, \"wall_ops_per_sec\": %.0f, "
+					"\"peak_mb\": %.1f, \"vertices\": %zu, \"edges\": %zu, \"faces\": %zu}\n",
+					Bench::escape(file).c_str(), step + 1, window_ops / op_sec, window_ops / wall_sec,
+					Bench::peak_memory_mb(),
+					mesh.n_vertices(), mesh.n_edges(), mesh.n_faces());
+			fflush(out);
+			info("%s: %zu ops, %.0f ops/s, %.1f MB peak", file.c_str(), step + 1,
+				 window_ops / op_sec, Bench::peak_memory_mb());
+			op_ms = 0.0;
+			window_ops = 0;
+			window_start = now;
+		}
+	}
+	return true;
+}
+
+/// Load the largest mesh in a scene file
+static bool load_mesh(std::string file, Halfedge_Mesh& mesh) {
+	Undo undo;
+	Scene scene(1);
+	std::string err = scene.load(false, undo, file);
+	if(!err.empty()) warn("%s", err.c_str());
+
+	bool found = false;
+	scene.for_objs([&](Scene_Object& obj) {
+		if(obj.get_mesh().n_faces() > mesh.n_faces()) {
+			obj.get_mesh().copy_to(mesh);
+			found = true;
+		}
+	});
+	return found;
+}
+
+int main(int argc, char** argv) {
+
+	Options opt;
+	for(int i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "--data") && i + 1 < argc) opt.data_dir = argv[++i];
+		else if(!strcmp(argv[i], "--seed") && i + 1 < argc) opt.seed = (unsigned int)atoi(argv[++i]);
+		else if(!strcmp(argv[i], "--ops") && i + 1 < argc) opt.ops = (size_t)atoll(argv[++i]);
+		else if(!strcmp(argv[i], "--check") && i + 1 < argc) opt.check = std::max(1ll, atoll(argv[++i]));
+		else if(!strcmp(argv[i], "--log") && i + 1 < argc) opt.log_file = argv[++i];
+		else if(!strcmp(argv[i], "--out") && i + 1 < argc) opt.out_file = argv[++i];
+		else if(!strcmp(argv[i], "--replay") && i + 1 < argc) opt.replay = argv[++i];
+		else die("Unknown argument %s", argv[i]);
+	}
+
+	Bench::Headless context;
+
+	// A replay log holds one run: a header naming the file, then its records
+	std::vector<std::string> files;
+	std::vector<Record> replay;
+	if(!opt.replay.empty()) {
+		std::ifstream in(opt.replay);
+		if(!in) die("Failed to open %s", opt.replay.c_str());
+		std::string line;
+		while(std::getline(in, line)) {
+			if(line.rfind("file ", 0) == 0) {
+				if(!files.empty()) break;
+				files.push_back(line.substr(5));
+				continue;
+			}
+			if(line.rfind("seed ", 0) == 0) continue;
+			Record r;
+			if(!read_record(line, r)) die("Bad replay record: %s", line.c_str());
+			replay.push_back(r);
+		}
+		if(files.empty()) die("Replay log %s names no file", opt.replay.c_str());
+	} else {
+		files = Bench::data_files(opt.data_dir);
+		if(files.empty()) die("No .dae files found in %s", opt.data_dir.c_str());
+	}
+
+	FILE* out = fopen(opt.out_file.c_str(), "w");
+	if(!out) die("Failed to open %s", opt.out_file.c_str());
+
+	bool ok = true;
+	for(const std::string& file : files) {
+
+		Halfedge_Mesh mesh;
+		if(!load_mesh(file, mesh)) {
+			warn("%s has no editable meshes", file.c_str());
+			continue;
+		}
+
+		// One log per file so each can be replayed on its own
+		std::string log_file = files.size() > 1 ? opt.log_file + "." + std::filesystem::path(file).stem().string()
+												: opt.log_file;
+		std::ofstream replay_log(log_file);
+		if(!replay_log) die("Failed to open %s", log_file.c_str());
+		replay_log << "seed " << opt.seed << "\n";
+		replay_log << "file " << file << "\n";
+
+		info("Fuzzing %s (%zu faces), logging to %s", file.c_str(), mesh.n_faces(), log_file.c_str());
+		if(!fuzz(opt, file, mesh, opt.replay.empty() ? nullptr : &replay, replay_log, out)) ok = false;
+	}
+
+	fclose(out);
+	return ok ? 0 : 1;
+}
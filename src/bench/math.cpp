@@ -0,0 +1,210 @@
+
+// Microbenchmarks for the vectorized math kernels in src/lib. Each kernel is
+// timed against a plain scalar reference over the same random data, and the
+// run fails if any result differs from the reference by more than the
+// tolerance. Reports JSON like s4d_bench.
+//
+// Usage: s4d_math_bench [--n count] [--samples n] [--seed n] [--out math.json]
+
+#include "common.h"
+#include "../lib/math.h"
+
+#include <cstring>
+#include <functional>
+#include <random>
+
+static const float tolerance = 1e-5f;
+
+// The scalar code the kernels replaced
+namespace Ref {
+static float dot4(Vec4 l, Vec4 r) {
+	return l.x * r.x + l.y * r.y + l.z * r.z + l.w * r.w;
+}
+static Vec4 unit(Vec4 v) {
+	float n = std::sqrt(dot4(v, v));
+	return Vec4(v.x / n, v.y / n, v.z / n, v.w / n);
+}
+static Vec4 mul(const Mat4& m, Vec4 v) {
+	return v[0] * m.cols[0] + v[1] * m.cols[1] + v[2] * m.cols[2] + v[3] * m.cols[3];
+}
+static Mat4 mul(const Mat4& a, const Mat4& b) {
+	Mat4 ret;
+	for(int i = 0; i < 4; i++) {
+		for(int j = 0; j < 4; j++) {
+			ret[i][j] = 0.0f;
+			for(int k = 0; k < 4; k++) ret[i][j] += b[i][k] * a[k][j];
+		}
+	}
+	return ret;
+}
+static Vec3 point(const Mat4& m, Vec3 p) {
+	return mul(m, Vec4(p, 1.0f)).project();
+}
+static Vec3 normal(const Mat4& m, Vec3 n) {
+	return mul(m, Vec4(n, 0.0f)).xyz().unit();
+}
+}
+
+// Relative error, so large coordinates aren't held to absolute precision
+static float error(float a, float b) {
+	return std::abs(a - b) / std::max(1.0f, std::max(std::abs(a), std::abs(b)));
+}
+static float error(Vec3 a, Vec3 b) {
+	return std::max(error(a.x, b.x), std::max(error(a.y, b.y), error(a.z, b.z)));
+}
+static float error(Vec4 a, Vec4 b) {
+	return std::max(error(a.xyz(), b.xyz()), error(a.w, b.w));
+}
+
+struct Kernel {
+	std::string name;
+	Bench::Stats simd_ms, scalar_ms;
+	float max_error = 0.0f;
+};
+
+static void time(Bench::Stats& stats, int samples, std::function<void()> op) {
+	for(int i = 0; i < samples; i++) {
+		double t = Bench::now_ms();
+		op();
+		stats.add(Bench::now_ms() - t);
+	}
+}
+
+int main(int argc, char** argv) {
+
+	size_t n = 1 << 20;
+	int samples = 20;
+	unsigned int seed = 1;
+	std::string out_file = "math.json";
+
+	for(int i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "--n") && i + 1 < argc) n = std::max(1, atoi(argv[++i]));
+		else if(!strcmp(argv[i], "--samples") && i + 1 < argc) samples = std::max(1, atoi(argv[++i]));
+		else if(!strcmp(argv[i], "--seed") && i + 1 < argc) seed = (unsigned int)atoi(argv[++i]);
+		else if(!strcmp(argv[i], "--out") && i + 1 < argc) out_file = argv[++i];
+		else die("Unknown argument %s", argv[i]);
+	}
+
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<float> dist(-100.0f, 100.0f);
+	auto vec3 = [&]() { return Vec3(dist(rng), dist(rng), dist(rng)); };
+	auto vec4 = [&]() { return Vec4(dist(rng), dist(rng), dist(rng), dist(rng)); };
+
+	std::vector<Vec3> p3(n), o3(n), r3(n);
+	std::vector<Vec4> p4(n), q4(n);
+	std::vector<float> of(n), rf(n);
+	std::vector<Vec4> o4(n), r4(n);
+	for(size_t i = 0; i < n; i++) {
+		p3[i] = vec3();
+		p4[i] = vec4();
+		q4[i] = vec4();
+	}
+
+	Mat4 m = Mat4::translate(vec3()) * Quat::euler(vec3()).to_mat() * Mat4::scale(Vec3(0.5f, 2.0f, 3.0f));
+	Mat4 normal = Mat4::transpose(Mat4::inverse(m));
+
+	std::vector<Kernel> kernels;
+	auto run = [&](std::string name, std::function<void()> simd, std::function<void()> scalar,
+				   std::function<float()> compare) {
+		Kernel k;
+		k.name = name;
+		time(k.simd_ms, samples, simd);
+		time(k.scalar_ms, samples, scalar);
+		k.max_error = compare();
+		kernels.push_back(k);
+	};
+
+	run("dot4", [&]() {
+		for(size_t i = 0; i < n; i++) of[i] = dot(p4[i], q4[i]);
+	}, [&]() {
+		for(size_t i = 0; i < n; i++) rf[i] = Ref::dot4(p4[i], q4[i]);
+	}, [&]() {
+		float e = 0.0f;
+		// Relative to the size of the terms, since the sum can cancel
+		for(size_t i = 0; i < n; i++) e = std::max(e, std::abs(of[i] - rf[i]) / std::max(1.0f, Ref::dot4(p4[i].abs(), q4[i].abs())));
+		return e;
+	});
+
+	run("unit4", [&]() {
+		for(size_t i = 0; i < n; i++) o4[i] = p4[i].unit();
+	}, [&]() {
+		for(size_t i = 0; i < n; i++) r4[i] = Ref::unit(p4[i]);
+	}, [&]() {
+		float e = 0.0f;
+		for(size_t i = 0; i < n; i++) e = std::max(e, error(o4[i], r4[i]));
+		return e;
+	});
+
+	run("mat4_vec4", [&]() {
+		for(size_t i = 0; i < n; i++) o4[i] = m * p4[i];
+	}, [&]() {
+		for(size_t i = 0; i < n; i++) r4[i] = Ref::mul(m, p4[i]);
+	}, [&]() {
+		float e = 0.0f;
+		for(size_t i = 0; i < n; i++) e = std::max(e, error(o4[i], r4[i]));
+		return e;
+	});
+
+	std::vector<Mat4> mats(n / 4), om(n / 4), rm(n / 4);
+	for(auto& a : mats) a = Mat4(vec4(), vec4(), vec4(), vec4());
+	run("mat4_mat4", [&]() {
+		for(size_t i = 0; i < mats.size(); i++) om[i] = m * mats[i];
+	}, [&]() {
+		for(size_t i = 0; i < mats.size(); i++) rm[i] = Ref::mul(m, mats[i]);
+	}, [&]() {
+		float e = 0.0f;
+		for(size_t i = 0; i < mats.size(); i++) {
+			for(int j = 0; j < 4; j++) e = std::max(e, error(om[i][j], rm[i][j]));
+		}
+		return e;
+	});
+
+	run("transform_points", [&]() {
+		m.transform_points(p3.data(), o3.data(), n);
+	}, [&]() {
+		for(size_t i = 0; i < n; i++) r3[i] = Ref::point(m, p3[i]);
+	}, [&]() {
+		float e = 0.0f;
+		for(size_t i = 0; i < n; i++) e = std::max(e, error(o3[i], r3[i]));
+		return e;
+	});
+
+	run("transform_normals", [&]() {
+		normal.transform_vectors(p3.data(), o3.data(), n, true);
+	}, [&]() {
+		for(size_t i = 0; i < n; i++) r3[i] = Ref::normal(normal, p3[i]);
+	}, [&]() {
+		float e = 0.0f;
+		for(size_t i = 0; i < n; i++) e = std::max(e, error(o3[i], r3[i]));
+		return e;
+	});
+
+	FILE* out = fopen(out_file.c_str(), "w");
+	if(!out) die("Failed to open %s", out_file.c_str());
+
+#ifdef S4D_AVX
+	const char* isa = "avx";
+#elif defined(S4D_SSE)
+	const char* isa = "sse";
+#else
+	const char* isa = "scalar";
+#endif
+
+	bool failed = false;
+	fprintf(out, "{\n  \"isa\": \"%s\",\n  \"n\": %zu,\n  \"samples\": %d,\n  \"kernels\": {\n", isa, n, samples);
+	for(size_t i = 0; i < kernels.size(); i++) {
+		const Kernel& k = kernels[i];
+		bool ok = k.max_error <= tolerance;
+		if(!ok) {
+			warn("%s differs from the scalar reference by %g", k.name.c_str(), k.max_error);
+			failed = true;
+		}
+		fprintf(out, "    \"%s\": {\"median_ms\": %.6f, \"scalar_median_ms\": %.6f, \"max_error\": %g, \"ok\": %s}%s\n",
+				k.name.c_str(), k.simd_ms.percentile(0.5), k.scalar_ms.percentile(0.5), k.max_error,
+				ok ? "true" : "false", i + 1 == kernels.size() ? "" : ",");
+	}
+	fprintf(out, "  }\n}\n");
+	fclose(out);
+	info("Wrote %s", out_file.c_str());
+	return failed ? 1 : 0;
+}
@@ -2,6 +2,7 @@
 #include "gui.h"
 #include "scene/util.h"
 #include "scene/mesh_render.h"
+#include "platform/prof.h"
 
 #include <imgui/imgui.h>
 #include <nfd/nfd.h>
@@ -40,6 +41,17 @@ Scene_Object::ID Gui::num_ids() {
 
 void Gui::update_dim(Vec2 dim) {
 	window_dim = dim;
+	invalidate();
+}
+
+void Gui::invalidate() {
+	redraw = true;
+}
+
+bool Gui::check_redraw() {
+	bool ret = redraw;
+	redraw = false;
+	return ret;
 }
 
 Vec3 Gui::Color::axis(Axis a) {
@@ -115,12 +127,12 @@ Scene_Object::ID Gui::selected_id() {
 	return selected_mesh;
 }
 
-void Gui::render_widgets(Mat4 viewproj, Mat4 view, Vec3 pos, float scl) {
+void Gui::render_widgets(Mat4 view, Vec3 pos, float scl) {
 
 	Renderer::reset_depth();
 
 	Vec3 scale(scl);
-	Renderer::lines(widget_lines, viewproj, 0.5f);
+	Renderer::lines(widget_lines, 0.5f);
 
 	if(action == Action::move) {
 
@@ -192,7 +204,7 @@ void Gui::render_widgets(Mat4 viewproj, Mat4 view, Vec3 pos, float scl) {
 void Gui::write_scene(Scene& scene) {
 
 	char* path = nullptr;
-	NFD_SaveDialog("dae", nullptr, &path);
+	NFD_SaveDialog("s4d;dae", nullptr, &path);
 	if(path) {
 		std::string error = scene.write(std::string(path));
 		if(!error.empty()) {
@@ -208,7 +220,7 @@ void Gui::load_scene(Scene& scene, Undo& undo) {
 	NFD_OpenDialog(file_types, nullptr, &path);
 	
 	if(path) {
-		std::string error = scene.load(true, undo, std::string(path));
+		std::string error = scene.begin_load(true, undo, std::string(path));
 		if(!error.empty()) {
 			set_error(error);
 		}
@@ -239,6 +251,16 @@ void Gui::objs(Scene& scene, Undo& undo, float menu_height) {
 
 	const ImGuiWindowFlags flags = ImGuiWindowFlags_NoResize | ImGuiWindowFlags_NoSavedSettings | ImGuiWindowFlags_NoFocusOnAppearing;
 
+	// Imported objects only get a halfedge mesh once edited, which can fail
+	if(_mode == Mode::model && selected_mesh) {
+		Scene_Object& obj = *scene.get(selected_mesh);
+		std::string err = obj.build_mesh();
+		if(!err.empty()) {
+			set_error("Cannot edit " + std::string(obj.opt.name.c_str()) + ": " + err);
+			_mode = Mode::scene;
+		}
+	}
+
 	ImGui::SetNextWindowPos({0.0, menu_height});
 	ImGui::SetNextWindowSize({window_dim.x / 5.0f, window_dim.y});
 
@@ -259,7 +281,7 @@ void Gui::objs(Scene& scene, Undo& undo, float menu_height) {
 			NFD_OpenDialog(file_types, nullptr, &path);
 
 			if(path) {
-				std::string error = scene.load(false, undo, std::string(path));
+				std::string error = scene.begin_load(false, undo, std::string(path));
 				if(!error.empty()) {
 					set_error(error);
 				}
@@ -273,22 +295,28 @@ void Gui::objs(Scene& scene, Undo& undo, float menu_height) {
 		ImGui::Text("Select an Object");
 	}
 
-	scene.for_objs([&](Scene_Object& obj) {
-
-		ImGui::PushID(obj.id());
+	// Only submit the rows that are visible, in a stable order
+	const std::vector<Scene_Object::ID>& ids = scene.ids();
+	ImGuiListClipper clipper((int)ids.size());
+	while(clipper.Step()) {
+		for(int i = clipper.DisplayStart; i < clipper.DisplayEnd; i++) {
+
+			Scene_Object& obj = *scene.get(ids[i]);
+			ImGui::PushID(obj.id());
+
+			std::string& name = obj.opt.name;
+			ImGui::InputText("##name", name.data(), name.capacity());
+			
+			bool is_selected = obj.id() == selected_mesh;
+			ImGui::SameLine();
+			if(ImGui::Checkbox("##selected", &is_selected)) {
+				if(is_selected) selected_mesh = obj.id();
+				else 		    selected_mesh = 0;
+			}
 
-		std::string& name = obj.opt.name;
-		ImGui::InputText("##name", name.data(), name.capacity());
-		
-		bool is_selected = obj.id() == selected_mesh;
-		ImGui::SameLine();
-		if(ImGui::Checkbox("##selected", &is_selected)) {
-			if(is_selected) selected_mesh = obj.id();
-			else 		    selected_mesh = 0;
+			ImGui::PopID();
 		}
-
-		ImGui::PopID();
-	});
+	}
 
 	if(_mode == Mode::scene && selected_mesh) {
 
@@ -327,8 +355,11 @@ void Gui::objs(Scene& scene, Undo& undo, float menu_height) {
 		fake_display(Action::rotate, "Rotation", obj.pose.euler, 1.0f);
 		fake_display(Action::scale, "Scale", obj.pose.scale, 0.03f);
 
-		if(ImGui::Button("Edit Mesh"))
+		if(ImGui::Button("Edit Mesh")) {
 			_mode = Mode::model;
+			// Built while the rest of the frame runs; objs() waits for it
+			obj.prepare_mesh();
+		}
 		if(wrap_button("Delete")) {
 			undo.del_obj(scene, selected_mesh);
 			selected_mesh = 0;
@@ -360,6 +391,7 @@ void Gui::objs(Scene& scene, Undo& undo, float menu_height) {
 			ImGui::Separator();
 			ImGui::Text("Global Operations");
 			if(ImGui::Button("Triangulate")) {
+				PROF_ZONE("Triangulate");
 				mesh.triangulate();
 				update_mesh = true;
 			}
@@ -380,6 +412,7 @@ void Gui::objs(Scene& scene, Undo& undo, float menu_height) {
 				std::visit(overloaded {
 					[&](Halfedge_Mesh::VertexRef vert) {
 						if(ImGui::Button("Erase")) {
+							PROF_ZONE("Erase Vertex");
 							new_ref = mesh.erase_vertex(vert);
 							update_mesh = true;
 							update_ref = true;
@@ -387,21 +420,25 @@ void Gui::objs(Scene& scene, Undo& undo, float menu_height) {
 					},
 					[&](Halfedge_Mesh::EdgeRef edge) {
 						if(ImGui::Button("Erase")) {
+							PROF_ZONE("Erase Edge");
 							new_ref = mesh.erase_edge(edge);
 							update_mesh = true;
 							update_ref = true;
 						}
 						if(wrap_button("Collapse")) {
+							PROF_ZONE("Collapse Edge");
 							new_ref = mesh.collapse_edge(edge);
 							update_mesh = true;
 							update_ref = true;
 						}
 						if(wrap_button("Flip")) {
+							PROF_ZONE("Flip Edge");
 							new_ref = mesh.flip_edge(edge);
 							update_mesh = true;
 							update_ref = true;
 						}
 						if(wrap_button("Split")) {
+							PROF_ZONE("Split Edge");
 							new_ref = mesh.split_edge(edge);
 							update_mesh = true;
 							update_ref = true;
@@ -409,6 +446,7 @@ void Gui::objs(Scene& scene, Undo& undo, float menu_height) {
 					},
 					[&](Halfedge_Mesh::FaceRef face) {
 						if(ImGui::Button("Collapse")) {
+							PROF_ZONE("Collapse Face");
 							new_ref = mesh.collapse_face(face);
 							update_mesh = true;
 							update_ref = true;
@@ -478,6 +516,7 @@ void Gui::objs(Scene& scene, Undo& undo, float menu_height) {
 void Gui::set_error(std::string msg) {
 	error_msg = msg;
 	error_shown = true;
+	invalidate();
 }
 
 void Gui::error() {
@@ -493,6 +532,38 @@ void Gui::error() {
 	}
 }
 
+void Gui::loading(Scene& scene, Undo& undo) {
+
+	if(!scene.loading()) return;
+
+	std::string errors;
+	if(scene.update_load(undo, errors) && !errors.empty()) {
+		set_error(errors);
+	}
+
+	// The selection may have been replaced by the new scene
+	if(selected_mesh && !scene.get(selected_mesh).has_value()) {
+		Renderer::set_he_select(0);
+		selected_mesh = 0;
+		_mode = Mode::scene;
+	}
+	invalidate();
+
+	if(!scene.loading()) return;
+
+	std::string stage;
+	float progress = scene.load_progress(stage);
+
+	Vec2 center = window_dim / 2.0f;
+	ImGui::SetNextWindowPos(Vec2{center.x, center.y}, 0, Vec2{0.5f, 0.5f});
+	ImGui::Begin("Loading", nullptr, ImGuiWindowFlags_AlwaysAutoResize | ImGuiWindowFlags_NoSavedSettings | ImGuiWindowFlags_NoResize);
+	ImGui::ProgressBar(progress, Vec2{window_dim.x / 4.0f, 0.0f}, stage.c_str());
+	if(ImGui::Button("Cancel")) {
+		scene.cancel_load();
+	}
+	ImGui::End();
+}
+
 bool Gui::mode_button(Gui::Mode m, std::string name) {
 	bool active = m == _mode;
 	if(active) ImGui::PushStyleColor(ImGuiCol_Button, ImGui::GetColorU32(ImGuiCol_ButtonActive));
@@ -534,8 +605,10 @@ float Gui::menu(Scene& scene, Undo& undo, bool& settings) {
 		if(mode_button(Gui::Mode::scene, "Scene"))
 			_mode = Gui::Mode::scene;
 
-		if(mode_button(Gui::Mode::model, "Model"))
+		if(mode_button(Gui::Mode::model, "Model")) {
 			_mode = Gui::Mode::model;
+			if(selected_mesh) scene.get(selected_mesh)->get().prepare_mesh();
+		}
 
 		// if(mode_button(Gui::Mode::render, "Render"))
 		// 	_mode = Gui::Mode::render;
@@ -849,12 +922,15 @@ bool Gui::select_model(Scene& scene, Undo& undo, Scene_Object::ID click, Vec3 ca
 
 		std::visit(overloaded {
 			[&](Halfedge_Mesh::VertexRef vert) {
+				PROF_ZONE("Bevel Vertex");
 				new_ref = mesh.bevel_vertex(vert);
 			},
 			[&](Halfedge_Mesh::EdgeRef edge) {
+				PROF_ZONE("Bevel Edge");
 				new_ref = mesh.bevel_edge(edge);
 			},
 			[&](Halfedge_Mesh::FaceRef face) {
+				PROF_ZONE("Bevel Face");
 				new_ref = mesh.bevel_face(face);
 			},
 			[&](auto) {}
@@ -897,6 +973,6 @@ void Gui::apply_transform(Scene_Object& obj) {
 	if(dragging) obj.pose = apply_action(obj.pose);
 }
 
-void Gui::render_base(Mat4 viewproj) {
-	Renderer::lines(baseplane, viewproj, 0.5f);
+void Gui::render_base() {
+	Renderer::lines(baseplane, 0.5f);
 }
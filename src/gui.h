@@ -48,6 +48,10 @@ public:
 
 	Mode mode() const {return _mode;}
 
+	// Redraw
+	void invalidate();
+	bool check_redraw();
+
 	// Input
 	void update_dim(Vec2 dim);
 	void set_error(std::string msg);
@@ -66,14 +70,15 @@ public:
 	// 2D GUI rendering
 	float menu(Scene& scene, Undo& undo, bool& settings);
 	void error();
+	void loading(Scene& scene, Undo& undo);
 	void objs(Scene& scene, Undo& undo, float menu_height);
 
 	// 3D GUI rendering
-	void render_widgets(Mat4 viewproj, Mat4 view, Vec3 pos, float scale);
-	void render_base(Mat4 viewproj);
+	void render_widgets(Mat4 view, Vec3 pos, float scale);
+	void render_base();
 
 private:
-	static inline const char* file_types = "dae,obj,fbx,glb,gltf,3ds,blend";
+	static inline const char* file_types = "s4d,dae,obj,ply,fbx,glb,gltf,3ds,blend";
 	void load_scene(Scene& scene, Undo& undo);
 	void write_scene(Scene& scene);
 
@@ -88,6 +93,9 @@ private:
 	bool mode_button(Gui::Mode m, std::string name);
 	bool action_button(Action act, std::string name, bool same = true);
 
+	// Set when something changed outside of an input event
+	bool redraw = false;
+
 	// Error handling
 	bool error_shown = false;
 	std::string error_msg;
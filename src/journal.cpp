@@ -0,0 +1,394 @@
+
+#include "journal.h"
+#include "undo.h"
+#include "lib/log.h"
+#include "platform/prof.h"
+#include "scene/mesh_render.h"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+// Each record is a fixed header followed by its payload, padded to 8 bytes
+// so mesh data can be read in place (see Halfedge_Mesh::read_flat). The
+// checksum lets replay stop cleanly at a record torn by the crash.
+namespace {
+enum : uint32_t {
+	rec_pose = 1,
+	rec_add,
+	rec_erase,
+	rec_mesh,
+	rec_undo,
+	rec_redo,
+	rec_checkpoint, // Never written, tells the writer to start a new generation
+};
+
+struct Record_Header {
+	uint32_t type, id;
+	uint64_t size;
+	uint32_t check, pad;
+};
+
+// Pose minus its cached matrices
+struct Pose_Record {
+	Vec3 pos, euler, scale;
+};
+
+const char journal_magic[8] = {'S', '4', 'D', 'J', 'R', 'N', 'L', '1'};
+
+// How many records may pile up before checkpointing, once the user pauses
+const size_t checkpoint_records = 256;
+const std::chrono::seconds checkpoint_idle(2);
+
+uint32_t checksum(const unsigned char* data, size_t size) {
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < size; i++) {
+		hash = (hash ^ data[i]) * 16777619u;
+	}
+	return hash;
+}
+}
+
+Journal::Journal() {}
+
+Journal::~Journal() {
+	close();
+}
+
+std::string Journal::path(const char* kind, unsigned int gen, const char* ext) {
+	return dir + kind + "-" + std::to_string(gen) + ext;
+}
+
+std::string Journal::open(std::string d, Scene& scene, Undo& undo, bool& recovered) {
+
+	close();
+	dir = d;
+	recovered = false;
+
+	namespace fs = std::filesystem;
+	std::error_code err;
+
+	// Recover from the newest complete checkpoint and the journal that follows it
+	unsigned int newest = 0;
+	bool any = false;
+	std::vector<fs::path> old;
+	for(auto& entry : fs::directory_iterator(dir, err)) {
+		std::string name = entry.path().filename().string();
+		unsigned int gen = 0;
+		char ext[8] = {};
+		if(sscanf(name.c_str(), "checkpoint-%u.%7s", &gen, ext) == 2) {
+			if(!strcmp(ext, "s4d")) newest = std::max(newest, gen);
+			old.push_back(entry.path());
+		} else if(sscanf(name.c_str(), "journal-%u.%7s", &gen, ext) == 2) {
+			if(!strcmp(ext, "bin")) any = true;
+			old.push_back(entry.path());
+		}
+	}
+	if(err) return "Failed to open journal directory " + dir + ": " + err.message();
+
+	std::string error;
+	std::string checkpoint_file = path("checkpoint", newest, ".replay.s4d");
+	std::string journal_file = path("journal", newest, ".replay.bin");
+	if(newest || any) {
+		PROF_ZONE("Recover Session");
+		// Moved aside first: if replaying crashes, the next start finds only
+		// these names, which it deletes instead of replaying them again
+		fs::rename(path("checkpoint", newest, ".s4d"), checkpoint_file, err);
+		fs::rename(path("journal", newest, ".bin"), journal_file, err);
+		old.push_back(checkpoint_file);
+		old.push_back(journal_file);
+		err.clear();
+		if(newest) error = scene.load(true, undo, checkpoint_file);
+		if(error.empty() && fs::exists(journal_file, err)) error = replay(journal_file, scene, undo);
+		recovered = true;
+		info("Recovered session from %s", dir.c_str());
+	}
+
+	for(auto& p : old) fs::remove(p, err);
+
+	generation = newest + 1;
+	quit = false;
+	active = true;
+	writer = std::thread(&Journal::write_loop, this);
+
+	// The new journal starts from the current (possibly recovered) scene
+	history = &undo;
+	checkpoint(scene);
+	undo.set_journal(this);
+	return error;
+}
+
+void Journal::close() {
+
+	if(!active) return;
+	active = false;
+	history->set_journal(nullptr);
+	history = nullptr;
+
+	{
+		std::lock_guard<std::mutex> lock(mut);
+		queue.clear();
+		quit = true;
+	}
+	cv.notify_one();
+	writer.join();
+
+	// Nothing to recover after a clean exit
+	namespace fs = std::filesystem;
+	std::error_code err;
+	fs::remove(path("journal", generation, ".bin"), err);
+	fs::remove(path("checkpoint", generation, ".s4d"), err);
+}
+
+void Journal::update(Scene& scene) {
+
+	if(!active || scene.loading()) return;
+
+	bool idle = std::chrono::steady_clock::now() - last_record > checkpoint_idle;
+	if(need_checkpoint || (since_checkpoint >= checkpoint_records && idle)) {
+		checkpoint(scene);
+	}
+}
+
+void Journal::checkpoint(Scene& scene) {
+	Entry entry;
+	entry.type = rec_checkpoint;
+	entry.snapshot = std::make_unique<Scene::Snapshot>(scene.snapshot());
+	push(std::move(entry));
+	history->checkpointed();
+	need_checkpoint = false;
+	since_checkpoint = 0;
+}
+
+void Journal::push(Entry&& entry) {
+	if(!active) return;
+	if(entry.type != rec_checkpoint) {
+		since_checkpoint++;
+		last_record = std::chrono::steady_clock::now();
+	}
+	{
+		std::lock_guard<std::mutex> lock(mut);
+		queue.push_back(std::move(entry));
+	}
+	cv.notify_one();
+}
+
+void Journal::pose(Scene_Object::ID id, Pose pose) {
+	Entry entry;
+	entry.type = rec_pose;
+	entry.id = id;
+	Pose_Record rec = {pose.pos, pose.euler, pose.scale};
+	entry.data.resize(sizeof(rec));
+	std::memcpy(entry.data.data(), &rec, sizeof(rec));
+	push(std::move(entry));
+}
+
+void Journal::add(Scene_Object::ID id, const GL::Mesh& mesh) {
+	Entry entry;
+	entry.type = rec_add;
+	entry.id = id;
+	const auto& verts = mesh.verts();
+	const auto& idxs = mesh.indices();
+	uint32_t counts[2] = {(uint32_t)verts.size(), (uint32_t)idxs.size()};
+	const unsigned char* c = (const unsigned char*)counts;
+	const unsigned char* v = (const unsigned char*)verts.data();
+	const unsigned char* i = (const unsigned char*)idxs.data();
+	entry.data.insert(entry.data.end(), c, c + sizeof(counts));
+	entry.data.insert(entry.data.end(), v, v + verts.size() * sizeof(GL::Mesh::Vert));
+	entry.data.insert(entry.data.end(), i, i + idxs.size() * sizeof(GL::Mesh::Index));
+	push(std::move(entry));
+}
+
+void Journal::erase(Scene_Object::ID id) {
+	Entry entry;
+	entry.type = rec_erase;
+	entry.id = id;
+	push(std::move(entry));
+}
+
+void Journal::mesh(Scene_Object::ID id, std::shared_ptr<const Halfedge_Mesh> mesh) {
+	Entry entry;
+	entry.type = rec_mesh;
+	entry.id = id;
+	entry.mesh = std::move(mesh);
+	push(std::move(entry));
+}
+
+void Journal::undo() {
+	Entry entry;
+	entry.type = rec_undo;
+	push(std::move(entry));
+}
+
+void Journal::redo() {
+	Entry entry;
+	entry.type = rec_redo;
+	push(std::move(entry));
+}
+
+void Journal::scene_changed() {
+	need_checkpoint = true;
+}
+
+void Journal::write_loop() {
+
+	if(Prof::tracing) Prof::name_thread("Journal");
+
+	std::vector<Entry> batch;
+	while(true) {
+		{
+			std::unique_lock<std::mutex> lock(mut);
+			cv.wait(lock, [this]() { return quit || !queue.empty(); });
+			if(quit) break;
+			std::swap(batch, queue);
+		}
+
+		PROF_ZONE("Write Journal");
+		for(Entry& entry : batch) write(entry);
+		batch.clear();
+		if(file) fflush(file);
+	}
+
+	if(file) fclose(file);
+	file = nullptr;
+}
+
+void Journal::write(Entry& entry) {
+
+	if(entry.snapshot) entry.snapshot->write(entry.data);
+	if(entry.mesh) entry.mesh->write_flat(entry.data);
+
+	if(entry.type == rec_checkpoint) {
+
+		// Write the snapshot under a temporary name first so a crash never
+		// leaves a partial checkpoint behind, then start its journal.
+		unsigned int next = generation + 1;
+		std::string tmp = path("checkpoint", next, ".tmp");
+		std::string checkpoint_file = path("checkpoint", next, ".s4d");
+		std::ofstream out(tmp, std::ios::binary);
+		out.write((const char*)entry.data.data(), entry.data.size());
+		out.close();
+		if(!out) {
+			warn("Failed to write journal checkpoint %s", tmp.c_str());
+			return;
+		}
+
+		namespace fs = std::filesystem;
+		std::error_code err;
+		fs::rename(tmp, checkpoint_file, err);
+		if(err) {
+			warn("Failed to write journal checkpoint %s", checkpoint_file.c_str());
+			return;
+		}
+
+		if(file) fclose(file);
+		file = fopen(path("journal", next, ".bin").c_str(), "wb");
+		if(!file) warn("Failed to open journal in %s", dir.c_str());
+		else fwrite(journal_magic, 1, sizeof(journal_magic), file);
+
+		fs::remove(path("journal", generation, ".bin"), err);
+		fs::remove(path("checkpoint", generation, ".s4d"), err);
+		generation = next;
+		return;
+	}
+
+	if(!file) return;
+
+	const std::vector<unsigned char>& data = entry.data;
+
+	Record_Header header = {};
+	header.type = entry.type;
+	header.id = entry.id;
+	header.size = data.size();
+	header.check = checksum(data.data(), data.size());
+
+	const unsigned char zero[8] = {};
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(data.data(), 1, data.size(), file);
+	fwrite(zero, 1, (8 - data.size() % 8) % 8, file);
+}
+
+std::string Journal::replay(std::string path, Scene& scene, Undo& undo) {
+
+	std::ifstream in(path, std::ios::binary);
+	std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+	// Copy into 8-byte aligned storage for read_flat
+	std::vector<uint64_t> storage((bytes.size() + 7) / 8);
+	std::memcpy(storage.data(), bytes.data(), bytes.size());
+	const unsigned char* data = (const unsigned char*)storage.data();
+	size_t size = bytes.size();
+
+	if(size < sizeof(journal_magic) || std::memcmp(data, journal_magic, sizeof(journal_magic))) {
+		return {};
+	}
+
+	size_t offset = sizeof(journal_magic), n_records = 0;
+	std::string error;
+
+	while(size - offset >= sizeof(Record_Header)) {
+
+		Record_Header header;
+		std::memcpy(&header, data + offset, sizeof(header));
+		const unsigned char* body = data + offset + sizeof(header);
+		if(size - offset - sizeof(header) < header.size) break;
+		if(checksum(body, header.size) != header.check) break;
+		offset += sizeof(header) + ((header.size + 7) & ~(uint64_t)7);
+		offset = std::min(offset, size);
+
+		bool exists = scene.get(header.id).has_value();
+		switch(header.type) {
+		case rec_pose: {
+			if(!exists || header.size != sizeof(Pose_Record)) error = "Bad pose record.";
+			else {
+				Pose_Record rec;
+				std::memcpy((void*)&rec, body, sizeof(rec));
+				undo.update_obj(scene, header.id, Pose{rec.pos, rec.euler, rec.scale});
+			}
+		} break;
+		case rec_add: {
+			uint32_t counts[2] = {};
+			if(header.size >= sizeof(counts)) std::memcpy(counts, body, sizeof(counts));
+			size_t v_bytes = (size_t)counts[0] * sizeof(GL::Mesh::Vert);
+			size_t i_bytes = (size_t)counts[1] * sizeof(GL::Mesh::Index);
+			if(header.size != sizeof(counts) + v_bytes + i_bytes) {
+				error = "Bad add record.";
+				break;
+			}
+			std::vector<GL::Mesh::Vert> verts(counts[0]);
+			std::vector<GL::Mesh::Index> idxs(counts[1]);
+			std::memcpy((void*)verts.data(), body + sizeof(counts), v_bytes);
+			std::memcpy(idxs.data(), body + sizeof(counts) + v_bytes, i_bytes);
+			undo.add_obj(scene, GL::Mesh(std::move(verts), std::move(idxs)));
+			if(!scene.get(header.id).has_value()) error = "Added object has the wrong id.";
+		} break;
+		case rec_erase: {
+			if(!exists) error = "Bad erase record.";
+			else undo.del_obj(scene, header.id);
+		} break;
+		case rec_mesh: {
+			auto mesh = std::make_shared<Halfedge_Mesh>();
+			Halfedge_Mesh old;
+			size_t used = 0;
+			if(!exists) error = "Bad mesh record.";
+			else error = mesh->read_flat(body, header.size, used);
+			if(!error.empty()) break;
+			Scene_Object& obj = *scene.get(header.id);
+			obj.copy_mesh(old);
+			obj.set_mesh(std::move(mesh));
+			undo.update_mesh(scene, header.id, std::move(old), 0);
+		} break;
+		case rec_undo: undo.undo(); break;
+		case rec_redo: undo.redo(); break;
+		default: error = "Unknown record type."; break;
+		}
+
+		if(!error.empty()) {
+			return "Replaying journal record " + std::to_string(n_records) + ": " + error;
+		}
+		n_records++;
+	}
+
+	info("Replayed %zu journal records", n_records);
+	return {};
+}
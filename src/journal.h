@@ -0,0 +1,82 @@
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "scene/scene.h"
+
+class Undo;
+
+/// Append-only log of undo actions, for crash recovery. The main thread only
+/// queues records, sharing (not copying) any mesh data with the scene; a
+/// background thread serializes and writes them. Every so
+/// often the scene is checkpointed to a full .s4d snapshot and a new journal
+/// is started. A clean exit deletes both, so finding them at startup means
+/// the previous session crashed and can be rebuilt by replaying the journal.
+class Journal {
+public:
+	Journal();
+	~Journal();
+
+	/// Start journaling into dir. If a previous session left a journal
+	/// there, it is first replayed into scene; recovered is then set.
+	std::string open(std::string dir, Scene& scene, Undo& undo, bool& recovered);
+	/// Stop journaling and delete the files
+	void close();
+
+	/// Call once per frame; takes a checkpoint when one is due
+	void update(Scene& scene);
+
+	// Called by Undo
+	void pose(Scene_Object::ID id, Pose pose);
+	void add(Scene_Object::ID id, const GL::Mesh& mesh);
+	void erase(Scene_Object::ID id);
+	/// Serialized on the writer, so mesh must not change afterwards
+	void mesh(Scene_Object::ID id, std::shared_ptr<const Halfedge_Mesh> mesh);
+	void undo();
+	void redo();
+	void scene_changed();
+
+private:
+	struct Entry {
+		uint32_t type = 0;
+		Scene_Object::ID id = 0;
+		std::vector<unsigned char> data;
+		// Serialized into data by the writer
+		std::shared_ptr<const Halfedge_Mesh> mesh;
+		std::unique_ptr<Scene::Snapshot> snapshot;
+	};
+
+	void push(Entry&& entry);
+	void checkpoint(Scene& scene);
+	void write_loop();
+	void write(Entry& entry);
+	std::string replay(std::string file, Scene& scene, Undo& undo);
+	std::string path(const char* kind, unsigned int gen, const char* ext);
+
+	std::string dir;
+	bool active = false;
+	Undo* history = nullptr;
+
+	// Main thread only
+	bool need_checkpoint = false;
+	size_t since_checkpoint = 0;
+	std::chrono::steady_clock::time_point last_record;
+
+	// Shared with the writer
+	std::mutex mut;
+	std::condition_variable cv;
+	std::vector<Entry> queue;
+	bool quit = false;
+
+	// Writer only
+	std::thread writer;
+	FILE* file = nullptr;
+	unsigned int generation = 0;
+};
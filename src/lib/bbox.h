@@ -67,9 +67,9 @@ struct BBox {
         min_out = Vec2(FLT_MAX);
         max_out = Vec2(-FLT_MAX);
         auto c = corners();
+        transform.transform_points(c.data(), c.data(), c.size());
         bool partially_behind = false, all_behind = true;
-        for(auto& v : c) {
-            Vec3 p = transform * v;
+        for(auto& p : c) {
             if(p.z < 0) {
                 partially_behind = true;
             } else {
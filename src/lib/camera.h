@@ -13,7 +13,7 @@ public:
 
 	/// View transformation matrix
 	Mat4 view() const {
-		return Mat4::look_at(_pos, center, global_up);
+		return _view;
 	}
 	/// View transformation matrix without translation
 	Mat4 view_origin() const {
@@ -21,7 +21,15 @@ public:
 	}
 	/// Perspective projection transformation matrix
 	Mat4 proj() const {
-		return Mat4::project(fov, ar, n);
+		return _proj;
+	}
+	/// proj() * view()
+	Mat4 viewproj() const {
+		return _viewproj;
+	}
+	/// Inverse of viewproj(), maps screen space back to world space
+	Mat4 iviewproj() const {
+		return _iviewproj;
 	}
 	
 	/// Camera position
@@ -45,6 +53,7 @@ public:
 		orbit_sens = 0.2f;
 		center = Vec3();
 		global_up = Vec3(0, 1, 0);
+		update_proj();
 		update_pos();
 	}
 	
@@ -75,6 +84,8 @@ public:
 	/// Apply screen aspect ratio (for perspective projection)
 	void set_ar(Vec2 dim) {
 		ar = dim.x / dim.y;
+		update_proj();
+		update_view();
 	}
 
 private:
@@ -83,13 +94,26 @@ private:
 		_pos.y = std::sin(Radians(pitch));
 		_pos.z = std::sin(Radians(yaw)) * std::cos(Radians(pitch));
 		_pos = radius * _pos.unit() + center;
+		update_view();
+	}
+	// The matrices only change with the camera, so they are rebuilt here
+	// instead of on every query
+	void update_proj() {
+		_proj = Mat4::project(fov, ar, n);
+		_iproj = Mat4::inverse(_proj);
+	}
+	void update_view() {
+		_view = Mat4::look_at(_pos, center, global_up);
+		_viewproj = _proj * _view;
+		_iviewproj = Mat4::inverse_rigid(_view) * _iproj;
 	}
 
 	// parameters
-	float pitch, yaw, fov, n, ar, radius;
+	float pitch, yaw, fov, n, ar = 1.0f, radius;
 	float orbit_sens, move_sens, radius_sens;
 	Vec3 global_up, center;
 
-	// set by update_pos
+	// set by update_pos and set_ar
 	Vec3 _pos;
+	Mat4 _view, _proj, _iproj, _viewproj, _iviewproj;
 };
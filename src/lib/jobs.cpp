@@ -0,0 +1,369 @@
+
+#include "jobs.h"
+#include "log.h"
+#include "../platform/prof.h"
+
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace Jobs {
+
+struct Task {
+	std::function<void()> func;
+	Group* group = nullptr;       // Finished by execute()
+	const Group* owner = nullptr; // Whose wait() may run it on a thread outside the pool
+};
+
+// Chase-Lev deque. The owning thread pushes and pops at the bottom without
+// locking; any thread may steal from the top, racing only on one CAS. Rings
+// are replaced when full, and old ones kept as long as the deque, since a
+// thief may still be reading from them.
+class Deque {
+public:
+	Deque() {
+		rings.push_back(std::make_unique<Ring>(64));
+		ring = rings.back().get();
+	}
+
+	/// Owner only
+	void push(Task* task) {
+		int64_t b = bottom.load(std::memory_order_relaxed);
+		int64_t t = top.load(std::memory_order_acquire);
+		Ring* r = ring.load(std::memory_order_relaxed);
+		if(b - t >= (int64_t)r->size()) {
+			auto bigger = std::make_unique<Ring>(r->size() * 2);
+			for(int64_t i = t; i < b; i++) bigger->put(i, r->get(i));
+			r = bigger.get();
+			rings.push_back(std::move(bigger));
+			ring.store(r, std::memory_order_release);
+		}
+		r->put(b, task);
+		// Sequentially consistent, so a worker going to sleep either sees the
+		// task or is seen as sleeping by the pusher (see Pool::push)
+		bottom.store(b + 1, std::memory_order_seq_cst);
+	}
+
+	/// Owner only; newest task first
+	Task* pop() {
+		int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+		Ring* r = ring.load(std::memory_order_relaxed);
+		bottom.store(b, std::memory_order_seq_cst);
+		int64_t t = top.load(std::memory_order_seq_cst);
+		if(t > b) {
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return nullptr;
+		}
+		Task* task = r->get(b);
+		if(t == b) {
+			// Last task, which a thief may be taking too
+			if(!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+				task = nullptr;
+			}
+			bottom.store(b + 1, std::memory_order_relaxed);
+		}
+		return task;
+	}
+
+	/// Any thread; oldest task first. Null if empty or another thread won the race.
+	Task* steal() {
+		int64_t t = top.load(std::memory_order_seq_cst);
+		int64_t b = bottom.load(std::memory_order_seq_cst);
+		if(t >= b) return nullptr;
+		Task* task = ring.load(std::memory_order_acquire)->get(t);
+		if(!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+			return nullptr;
+		}
+		return task;
+	}
+
+	bool empty() const {
+		return top.load(std::memory_order_seq_cst) >= bottom.load(std::memory_order_seq_cst);
+	}
+
+private:
+	class Ring {
+	public:
+		Ring(size_t size) : mask(size - 1), slots(new std::atomic<Task*>[size]) {}
+		size_t size() const {return mask + 1;}
+		Task* get(int64_t i) const {return slots[i & mask].load(std::memory_order_relaxed);}
+		void put(int64_t i, Task* task) {slots[i & mask].store(task, std::memory_order_relaxed);}
+	private:
+		size_t mask;
+		std::unique_ptr<std::atomic<Task*>[]> slots;
+	};
+
+	// Separate cache lines, as thieves hammer top while the owner works at the bottom
+	alignas(64) std::atomic<int64_t> top = 0;
+	alignas(64) std::atomic<int64_t> bottom = 0;
+	std::atomic<Ring*> ring;
+	std::vector<std::unique_ptr<Ring>> rings; // Owner only
+};
+
+// Every thread that submits tasks owns a deque: workers get one at start,
+// other threads (main, loader) the first time they push, and hand it back
+// when they exit. Slots are never freed, so thieves can scan them without
+// locking.
+static const size_t max_deques = 256;
+
+struct Pool {
+	std::unique_ptr<Deque> deques[max_deques];
+	std::atomic<size_t> n_deques = 0;
+	std::mutex deque_mut;
+	std::vector<size_t> free_deques;
+
+	std::vector<std::thread> threads;
+	std::vector<size_t> worker_deques;
+
+	// Idle workers sleep here. A push wakes one of them, and only takes the
+	// lock when one might be asleep.
+	std::atomic<int> sleeping = 0;
+	std::atomic<bool> quit = false;
+	uint64_t pushes = 0; // Under sleep_mut
+	std::mutex sleep_mut;
+	std::condition_variable wake;
+
+	std::mutex main_mut;
+	std::vector<std::function<void()>> main_queue;
+
+	Deque& local();
+	size_t acquire();
+	void release(size_t slot);
+	void push(Task* task);
+	Task* steal(size_t start);
+	bool has_work();
+	void execute(Task* task);
+	void finish(Group* group);
+	void work(size_t slot);
+};
+
+static Pool pool;
+
+// The calling thread's deque, if it has one yet
+struct Local {
+	Deque* deque = nullptr;
+	size_t slot = 0;
+	bool worker = false;
+	~Local() {
+		if(deque && !worker) pool.release(slot);
+	}
+};
+static thread_local Local local;
+
+Deque& Pool::local() {
+	Local& l = Jobs::local;
+	if(!l.deque) {
+		l.slot = acquire();
+		l.deque = deques[l.slot].get();
+	}
+	return *l.deque;
+}
+
+size_t Pool::acquire() {
+	std::lock_guard<std::mutex> lock(deque_mut);
+	if(!free_deques.empty()) {
+		size_t slot = free_deques.back();
+		free_deques.pop_back();
+		return slot;
+	}
+	size_t slot = n_deques;
+	if(slot == max_deques) die("Too many threads submitting jobs");
+	deques[slot] = std::make_unique<Deque>();
+	n_deques.store(slot + 1, std::memory_order_release);
+	return slot;
+}
+
+void Pool::release(size_t slot) {
+	// Tasks left behind are still stolen as usual; the next owner just adds to them
+	std::lock_guard<std::mutex> lock(deque_mut);
+	free_deques.push_back(slot);
+}
+
+void Pool::push(Task* task) {
+	local().push(task);
+	// Paired with the sleeping++ before a worker looks for work one last time
+	if(sleeping.load(std::memory_order_seq_cst) > 0) {
+		std::lock_guard<std::mutex> lock(sleep_mut);
+		pushes++;
+		wake.notify_one();
+	}
+}
+
+Task* Pool::steal(size_t start) {
+	size_t n = n_deques.load(std::memory_order_acquire);
+	for(size_t i = 0; i < n; i++) {
+		if(Task* task = deques[(start + i) % n]->steal()) return task;
+	}
+	return nullptr;
+}
+
+bool Pool::has_work() {
+	size_t n = n_deques.load(std::memory_order_acquire);
+	for(size_t i = 0; i < n; i++) {
+		if(!deques[i]->empty()) return true;
+	}
+	return false;
+}
+
+void Pool::execute(Task* task) {
+	task->func();
+	Group* group = task->group;
+	// Captures are released before the group counts the task as done
+	delete task;
+	if(group) finish(group);
+}
+
+void Pool::finish(Group* group) {
+	size_t left = group->pending.load(std::memory_order_relaxed);
+	while(left > 1) {
+		if(group->pending.compare_exchange_weak(left, left - 1, std::memory_order_acq_rel)) return;
+	}
+	// The last task finishes under the group's lock, which wait() takes
+	// before returning, so the group outlives this
+	std::lock_guard<std::mutex> lock(group->mut);
+	group->pending.fetch_sub(1, std::memory_order_acq_rel);
+	group->finished.notify_all();
+}
+
+void Pool::work(size_t slot) {
+
+	Local& l = Jobs::local;
+	l.deque = deques[slot].get();
+	l.slot = slot;
+	l.worker = true;
+	if(Prof::tracing) Prof::name_thread("Worker");
+
+	while(true) {
+		Task* task = l.deque->pop();
+		if(!task) task = steal(slot + 1);
+		if(task) {
+			execute(task);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(sleep_mut);
+		uint64_t seen = pushes;
+		sleeping++;
+		if(!has_work()) {
+			if(quit) {
+				sleeping--;
+				return;
+			}
+			wake.wait(lock, [&]() { return quit || pushes != seen; });
+		}
+		sleeping--;
+	}
+}
+
+void init(int workers) {
+
+	shutdown();
+
+	if(workers == 0) workers = (int)std::thread::hardware_concurrency() - 1;
+	workers = std::max(workers, 0);
+
+	pool.quit = false;
+	for(int i = 0; i < workers; i++) {
+		pool.worker_deques.push_back(pool.acquire());
+		pool.threads.emplace_back(&Pool::work, &pool, pool.worker_deques.back());
+	}
+	info("Started %d worker threads", workers);
+}
+
+void shutdown() {
+	{
+		std::lock_guard<std::mutex> lock(pool.sleep_mut);
+		pool.quit = true;
+	}
+	pool.wake.notify_all();
+	for(auto& t : pool.threads) t.join();
+	pool.threads.clear();
+	for(size_t slot : pool.worker_deques) pool.release(slot);
+	pool.worker_deques.clear();
+}
+
+size_t n_threads() {
+	return pool.threads.size() + 1;
+}
+
+Group::~Group() {
+	wait();
+}
+
+void Group::run(std::function<void()> task) {
+	if(pool.threads.empty()) {
+		task();
+		return;
+	}
+	pending.fetch_add(1, std::memory_order_relaxed);
+	pool.push(new Task{std::move(task), this, this});
+}
+
+void Group::wait() {
+
+	Local& l = local;
+	while(!done()) {
+
+		// Workers run whatever is at the bottom of their own deque: it was
+		// queued by the task doing the waiting, or the tasks it is nested in.
+		// Other threads only run this group's tasks, since anything else
+		// could be a long build that would hold up, say, the main thread.
+		Task* task = l.deque ? l.deque->pop() : nullptr;
+		if(task && !l.worker && task->owner != this) {
+			l.deque->push(task);
+			task = nullptr;
+		}
+		if(task) {
+			pool.execute(task);
+			continue;
+		}
+
+		// The rest were stolen or sit behind other tasks, which a worker
+		// will get to
+		std::unique_lock<std::mutex> lock(mut);
+		finished.wait(lock, [this]() { return done(); });
+	}
+
+	// See Pool::finish
+	std::lock_guard<std::mutex> lock(mut);
+}
+
+bool Group::done() const {
+	return pending.load(std::memory_order_acquire) == 0;
+}
+
+void async(std::function<void()> task, std::function<void()> then, Group* group) {
+	if(pool.threads.empty()) {
+		task();
+		if(then) on_main(std::move(then));
+		return;
+	}
+	if(group) group->pending.fetch_add(1, std::memory_order_relaxed);
+	pool.push(new Task{[task = std::move(task), then = std::move(then), group]() {
+		task();
+		// Finish the group first, so the continuation sees the task as done
+		if(group) pool.finish(group);
+		if(then) on_main(then);
+	}, nullptr, group});
+}
+
+void on_main(std::function<void()> func) {
+	std::lock_guard<std::mutex> lock(pool.main_mut);
+	pool.main_queue.push_back(std::move(func));
+}
+
+void run_main() {
+	std::vector<std::function<void()>> funcs;
+	{
+		std::lock_guard<std::mutex> lock(pool.main_mut);
+		std::swap(funcs, pool.main_queue);
+	}
+	for(auto& f : funcs) f();
+}
+
+bool main_pending() {
+	std::lock_guard<std::mutex> lock(pool.main_mut);
+	return !pool.main_queue.empty();
+}
+}
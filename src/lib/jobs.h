@@ -0,0 +1,83 @@
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+
+// Work-stealing thread pool shared by every subsystem. Each thread that
+// submits tasks (workers, but also the main thread or the loader) owns a
+// lock-free deque: it pushes and pops its own tasks at the back, and idle
+// workers steal from the front of the others. A waiting thread runs tasks
+// from the back of its own deque instead of blocking, so nested parallel_for
+// inside a task is fine; threads outside the pool only run the group they
+// wait on. Otherwise it sleeps until the group's last task wakes it.
+//
+// Without init() (or with zero workers) everything runs inline on the caller.
+
+namespace Jobs {
+
+/// Start the pool. workers = 0 picks one per core, minus the main thread;
+/// a negative count means no workers at all.
+void init(int workers = 0);
+/// Finish queued tasks and join the workers
+void shutdown();
+/// Threads that execute tasks, including the caller of wait()
+size_t n_threads();
+
+/// A set of tasks that can be waited on together
+class Group {
+public:
+	Group() = default;
+	~Group();
+
+	Group(const Group& src) = delete;
+	void operator=(const Group& src) = delete;
+
+	void run(std::function<void()> task);
+	/// Help run queued tasks (see above), then sleep until the rest have finished
+	void wait();
+	bool done() const;
+
+private:
+	std::atomic<size_t> pending = 0;
+	// Only for waking waiters when pending reaches zero
+	std::mutex mut;
+	std::condition_variable finished;
+	friend struct Pool;
+	friend void async(std::function<void()>, std::function<void()>, Group*);
+};
+
+/// Run task on the pool and then, once it finishes, then() on the main
+/// thread (for GL work). The group, if given, covers only task.
+void async(std::function<void()> task, std::function<void()> then = nullptr, Group* group = nullptr);
+
+/// Queue func to run on the main thread at the next run_main()
+void on_main(std::function<void()> func);
+/// Run completions queued by on_main(); call once per frame from the main thread
+void run_main();
+/// Whether on_main() work is waiting
+bool main_pending();
+
+/// Call func(i) for i in [0, n), grain indices per task. Returns once all are done.
+template<typename F> void parallel_for(size_t n, F&& func, size_t grain = 1) {
+	if(n == 0) return;
+	grain = grain ? grain : 1;
+	if(n <= grain || n_threads() == 1) {
+		for(size_t i = 0; i < n; i++) func(i);
+		return;
+	}
+	Group group;
+	for(size_t begin = grain; begin < n; begin += grain) {
+		size_t end = begin + grain < n ? begin + grain : n;
+		group.run([&func, begin, end]() {
+			for(size_t i = begin; i < end; i++) func(i);
+		});
+	}
+	// The caller takes the first range itself
+	for(size_t i = 0; i < grain; i++) func(i);
+	group.wait();
+}
+}
@@ -19,6 +19,11 @@ struct Mat4 {
 	static Mat4 transpose(Mat4 m);
 	/// Return inverse matrix (will be NaN if m is not invertible)
 	static Mat4 inverse(Mat4 m);
+	/// Return inverse of an affine matrix (bottom row 0 0 0 1), e.g. any
+	/// translate/rotate/scale/shear combination. Cheaper than inverse().
+	static Mat4 inverse_affine(Mat4 m);
+	/// Return inverse of a rotation plus translation, e.g. a view matrix
+	static Mat4 inverse_rigid(Mat4 m);
 	/// Return tranformation matrix for given translation vector
 	static Mat4 translate(Vec3 t);
 	/// Return tranformation matrix for given angle (degrees) and axis
@@ -149,19 +154,24 @@ struct Mat4 {
 	Mat4 operator*(Mat4 m) const {
 		Mat4 ret;
 		for(int i = 0; i < 4; i++) {
-			for(int j = 0; j < 4; j++) {
-				ret[i][j] = 0.0f;
-				for(int k = 0; k < 4; k++) {
-					ret[i][j] += m[i][k] * cols[k][j];
-				}
-			}
+			ret.cols[i] = operator*(m.cols[i]);
 		}
 		return ret;
 	}
 
 	Vec4 operator*(Vec4 v) const {
+#ifdef S4D_SSE
+		__m128 r = _mm_mul_ps(_mm_loadu_ps(cols[0].data), _mm_set1_ps(v.x));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(cols[1].data), _mm_set1_ps(v.y)));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(cols[2].data), _mm_set1_ps(v.z)));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(cols[3].data), _mm_set1_ps(v.w)));
+		Vec4 ret;
+		_mm_storeu_ps(ret.data, r);
+		return ret;
+#else
 		return v[0] * cols[0] + v[1] * cols[1] +
 			   v[2] * cols[2] + v[3] * cols[3];
+#endif
 	}
 
 	/// Expands v to Vec4(v, 1.0), multiplies, and projects back to 3D
@@ -173,6 +183,12 @@ struct Mat4 {
 		return operator*(Vec4(v, 0.0f)).xyz();
 	}
 
+	/// Same as out[i] = *this * in[i] for n points; in and out may be the same array
+	void transform_points(const Vec3* in, Vec3* out, size_t n) const;
+	/// Same as out[i] = rotate(in[i]) for n vectors, optionally normalizing
+	/// the results (for normals, pass the inverse transpose)
+	void transform_vectors(const Vec3* in, Vec3* out, size_t n, bool normalize = false) const;
+
 	/// Converts rotation (orthonormal 3x3) matrix to equivalent Euler angles
 	Vec3 to_euler() const {
 		Vec3 eul1, eul2;
@@ -253,6 +269,83 @@ inline Mat4 operator/(float s, Mat4 m) {
 	return r;
 }
 
+#ifdef S4D_SSE
+namespace Mat4_SIMD {
+// Store the first three lanes without touching the float after them
+inline void store3(Vec3& out, __m128 v) {
+	_mm_storel_pi((__m64*)out.data, v);
+	_mm_store_ss(out.data + 2, _mm_movehl_ps(v, v));
+}
+// Same operation order as the scalar Mat4 * Vec4, so results match exactly
+inline __m128 point(__m128 c0, __m128 c1, __m128 c2, __m128 c3, Vec3 p) {
+	__m128 r = _mm_mul_ps(c0, _mm_set1_ps(p.x));
+	r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_set1_ps(p.y)));
+	r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_set1_ps(p.z)));
+	r = _mm_add_ps(r, c3);
+	return _mm_div_ps(r, _mm_shuffle_ps(r, r, _MM_SHUFFLE(3, 3, 3, 3)));
+}
+#ifdef S4D_AVX
+inline __m256 pair(const Vec3& a, const Vec3& b, int lane) {
+	return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_set1_ps(a.data[lane])), _mm_set1_ps(b.data[lane]), 1);
+}
+#endif
+}
+#endif
+
+inline void Mat4::transform_points(const Vec3* in, Vec3* out, size_t n) const {
+#ifdef S4D_SSE
+	__m128 c0 = _mm_loadu_ps(cols[0].data), c1 = _mm_loadu_ps(cols[1].data);
+	__m128 c2 = _mm_loadu_ps(cols[2].data), c3 = _mm_loadu_ps(cols[3].data);
+	size_t i = 0;
+#ifdef S4D_AVX
+	// Two points per iteration, one in each 128-bit half
+	__m256 w0 = _mm256_insertf128_ps(_mm256_castps128_ps256(c0), c0, 1);
+	__m256 w1 = _mm256_insertf128_ps(_mm256_castps128_ps256(c1), c1, 1);
+	__m256 w2 = _mm256_insertf128_ps(_mm256_castps128_ps256(c2), c2, 1);
+	__m256 w3 = _mm256_insertf128_ps(_mm256_castps128_ps256(c3), c3, 1);
+	for(; i + 2 <= n; i += 2) {
+		__m256 r = _mm256_mul_ps(w0, Mat4_SIMD::pair(in[i], in[i + 1], 0));
+		r = _mm256_add_ps(r, _mm256_mul_ps(w1, Mat4_SIMD::pair(in[i], in[i + 1], 1)));
+		r = _mm256_add_ps(r, _mm256_mul_ps(w2, Mat4_SIMD::pair(in[i], in[i + 1], 2)));
+		r = _mm256_add_ps(r, w3);
+		r = _mm256_div_ps(r, _mm256_permute_ps(r, _MM_SHUFFLE(3, 3, 3, 3)));
+		Mat4_SIMD::store3(out[i], _mm256_castps256_ps128(r));
+		Mat4_SIMD::store3(out[i + 1], _mm256_extractf128_ps(r, 1));
+	}
+#endif
+	for(; i < n; i++) {
+		Mat4_SIMD::store3(out[i], Mat4_SIMD::point(c0, c1, c2, c3, in[i]));
+	}
+#else
+	for(size_t i = 0; i < n; i++) out[i] = *this * in[i];
+#endif
+}
+
+inline void Mat4::transform_vectors(const Vec3* in, Vec3* out, size_t n, bool normalize) const {
+#ifdef S4D_SSE
+	__m128 c0 = _mm_loadu_ps(cols[0].data), c1 = _mm_loadu_ps(cols[1].data);
+	__m128 c2 = _mm_loadu_ps(cols[2].data);
+	for(size_t i = 0; i < n; i++) {
+		__m128 r = _mm_mul_ps(c0, _mm_set1_ps(in[i].x));
+		r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_set1_ps(in[i].y)));
+		r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_set1_ps(in[i].z)));
+		if(normalize) {
+			__m128 m = _mm_mul_ps(r, r);
+			__m128 s = _mm_add_ss(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1)));
+			s = _mm_add_ss(s, _mm_movehl_ps(m, m));
+			s = _mm_sqrt_ss(s);
+			r = _mm_div_ps(r, _mm_shuffle_ps(s, s, _MM_SHUFFLE(0, 0, 0, 0)));
+		}
+		Mat4_SIMD::store3(out[i], r);
+	}
+#else
+	for(size_t i = 0; i < n; i++) {
+		out[i] = rotate(in[i]);
+		if(normalize) out[i].normalize();
+	}
+#endif
+}
+
 const inline Mat4 Mat4::I = {{1.0f, 0.0f, 0.0f, 0.0f}, 
 							 {0.0f, 1.0f, 0.0f, 0.0f},
 							 {0.0f, 0.0f, 1.0f, 0.0f},
@@ -341,6 +434,28 @@ inline Mat4 Mat4::ortho(float l, float r, float b, float t, float n, float f) {
 	return rs;
 }
 
+inline Mat4 Mat4::inverse_affine(Mat4 m) {
+	Vec3 x = m.cols[0].xyz(), y = m.cols[1].xyz(), z = m.cols[2].xyz(), t = m.cols[3].xyz();
+	// Rows of the inverse 3x3 are the cofactor cross products over the determinant
+	Vec3 r0 = cross(y, z), r1 = cross(z, x), r2 = cross(x, y);
+	float idet = 1.0f / dot(x, r0);
+	r0 *= idet;
+	r1 *= idet;
+	r2 *= idet;
+	return Mat4(Vec4(r0.x, r1.x, r2.x, 0.0f),
+				Vec4(r0.y, r1.y, r2.y, 0.0f),
+				Vec4(r0.z, r1.z, r2.z, 0.0f),
+				Vec4(-dot(r0, t), -dot(r1, t), -dot(r2, t), 1.0f));
+}
+
+inline Mat4 Mat4::inverse_rigid(Mat4 m) {
+	Vec3 x = m.cols[0].xyz(), y = m.cols[1].xyz(), z = m.cols[2].xyz(), t = m.cols[3].xyz();
+	return Mat4(Vec4(x.x, y.x, z.x, 0.0f),
+				Vec4(x.y, y.y, z.y, 0.0f),
+				Vec4(x.z, y.z, z.z, 0.0f),
+				Vec4(-dot(x, t), -dot(y, t), -dot(z, t), 1.0f));
+}
+
 inline Mat4 Mat4::project(float fov, float ar, float n) {
 	float f = 1.0f / std::tan(Radians(fov) / 2.0f);
 	Mat4 r;
@@ -30,6 +30,7 @@ inline Vec4 clamp(Vec4 v, Vec4 min, Vec4 max) {
 #include "bbox.h"
 #include "mat4.h"
 #include "quat.h"
+#include "transform.h"
 
 template<typename T>
 T lerp(T start, T end, float t) {
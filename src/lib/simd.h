@@ -0,0 +1,16 @@
+
+#pragma once
+
+// Picks the vector instruction set used by the math library at compile time.
+// Every vectorized operation keeps its scalar version as the fallback, so
+// other targets (or builds with S4D_NO_SIMD defined) compute the same
+// results up to rounding. AVX is only used when the compiler targets it,
+// e.g. with -march=native.
+
+#if !defined(S4D_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define S4D_SSE 1
+#if defined(__AVX__)
+#define S4D_AVX 1
+#endif
+#include <immintrin.h>
+#endif
@@ -0,0 +1,45 @@
+
+#pragma once
+
+#include "mat4.h"
+
+/// Translate * rotate * scale matrix built from a position, Euler angles
+/// (degrees, applied x then y then z), and per-axis scale, along with its
+/// inverse. Both are kept until set() is given different inputs, so owners can
+/// ask for them every frame and only pay for the trig when something moved.
+class Transform {
+public:
+	/// Rebuild the matrices if any input changed. Returns whether it did.
+	bool set(Vec3 pos, Vec3 euler, Vec3 scale) {
+		if(built && pos == _pos && euler == _euler && scale == _scale) return false;
+		_pos = pos;
+		_euler = euler;
+		_scale = scale;
+		built = true;
+
+		// The rotation is orthonormal, so undoing it is a transpose
+		Mat4 R = rotation(euler);
+		_matrix = Mat4::translate(pos) * R * Mat4::scale(scale);
+		_inverse = Mat4::scale(1.0f / scale) * Mat4::transpose(R) * Mat4::translate(-pos);
+		return true;
+	}
+
+	const Mat4& matrix() const {
+		return _matrix;
+	}
+	const Mat4& inverse() const {
+		return _inverse;
+	}
+
+	/// Rotation matrix for Euler angles in degrees, applied x then y then z
+	static Mat4 rotation(Vec3 euler) {
+		return Mat4::rotate(euler.z, {0.0f, 0.0f, 1.0f}) *
+			   Mat4::rotate(euler.y, {0.0f, 1.0f, 0.0f}) *
+			   Mat4::rotate(euler.x, {1.0f, 0.0f, 0.0f});
+	}
+
+private:
+	Vec3 _pos, _euler, _scale;
+	Mat4 _matrix, _inverse;
+	bool built = false;
+};
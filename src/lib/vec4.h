@@ -6,8 +6,12 @@
 #include <ostream>
 
 #include "log.h"
+#include "simd.h"
 #include "vec3.h"
 
+struct Vec4;
+inline float dot(Vec4 l, Vec4 r);
+
 struct Vec4 {
 
 	Vec4() {
@@ -168,21 +172,31 @@ struct Vec4 {
 
 	/// Modify vec to have unit length
 	Vec4 normalize() {
-		float n = norm();
-		x /= n;
-		y /= n;
-		z /= n;
-		w /= n;
+		*this = unit();
 		return *this;
 	}
 	/// Return unit length vec in the same direction
 	Vec4 unit() const {
+#ifdef S4D_SSE
+		__m128 v = _mm_loadu_ps(data);
+		__m128 m = _mm_mul_ps(v, v);
+		m = _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+		m = _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+		Vec4 ret;
+		_mm_storeu_ps(ret.data, _mm_div_ps(v, _mm_sqrt_ps(m)));
+		return ret;
+#else
 		float n = norm();
 		return Vec4(x / n, y / n, z / n, w / n);
+#endif
 	}
 
 	float norm_squared() const {
+#ifdef S4D_SSE
+		return dot(*this, *this);
+#else
 		return x * x + y * y + z * z + w * w;
+#endif
 	}
 	float norm() const {
 		return std::sqrt(norm_squared());
@@ -232,7 +246,14 @@ inline Vec4 hmax(Vec4 l, Vec4 r) {
 
 /// 4D dot product
 inline float dot(Vec4 l, Vec4 r) {
+#ifdef S4D_SSE
+	__m128 m = _mm_mul_ps(_mm_loadu_ps(l.data), _mm_loadu_ps(r.data));
+	__m128 s = _mm_add_ps(m, _mm_movehl_ps(m, m));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 1, 1, 1)));
+	return _mm_cvtss_f32(s);
+#else
 	return l.x * r.x + l.y * r.y + l.z * r.z + l.w * r.w;
+#endif
 }
 
 inline std::ostream& operator<<(std::ostream& out, Vec4 v) {
@@ -1,11 +1,29 @@
 
 #include <iostream>
 #include "platform/platform.h"
+#include "platform/prof.h"
+#include "lib/jobs.h"
+
+#include <cstdlib>
+#include <cstring>
 
 int main(int argc, char** argv) {
 
-	Platform eng;
-	App app(eng);
-	eng.loop(app);
+	int workers = 0;
+	for(int i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "--trace") && i + 1 < argc) {
+			Prof::start_trace(argv[++i]);
+		} else if(!strcmp(argv[i], "--workers") && i + 1 < argc) {
+			workers = atoi(argv[++i]);
+		}
+	}
+
+	Jobs::init(workers);
+	{
+		Platform eng;
+		App app(eng);
+		eng.loop(app);
+	}
+	Jobs::shutdown();
 	return 0;
 }
@@ -0,0 +1,112 @@
+
+#include "file.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+Mapped_File::Mapped_File(Mapped_File&& src) {
+	*this = std::move(src);
+}
+
+Mapped_File::~Mapped_File() {
+	close();
+}
+
+void Mapped_File::operator=(Mapped_File&& src) {
+	close();
+	_data = src._data; src._data = nullptr;
+	_size = src._size; src._size = 0;
+#ifdef _WIN32
+	file = src.file; src.file = nullptr;
+	mapping = src.mapping; src.mapping = nullptr;
+#endif
+}
+
+#ifdef _WIN32
+
+std::string Mapped_File::open(std::string path) {
+
+	close();
+
+	HANDLE f = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+						   FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if(f == INVALID_HANDLE_VALUE) return "Failed to open " + path;
+	file = f;
+
+	LARGE_INTEGER size;
+	if(!GetFileSizeEx(f, &size)) {
+		close();
+		return "Failed to get size of " + path;
+	}
+	_size = (size_t)size.QuadPart;
+	if(_size == 0) return {};
+
+	mapping = CreateFileMappingA(f, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if(!mapping) {
+		close();
+		return "Failed to map " + path;
+	}
+	_data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if(!_data) {
+		close();
+		return "Failed to map " + path;
+	}
+	return {};
+}
+
+void Mapped_File::close() {
+	if(_data) UnmapViewOfFile(_data);
+	if(mapping) CloseHandle(mapping);
+	if(file) CloseHandle(file);
+	_data = nullptr;
+	_size = 0;
+	mapping = nullptr;
+	file = nullptr;
+}
+
+#else
+
+std::string Mapped_File::open(std::string path) {
+
+	close();
+
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if(fd < 0) return "Failed to open " + path;
+
+	struct stat st;
+	if(fstat(fd, &st)) {
+		::close(fd);
+		return "Failed to get size of " + path;
+	}
+	_size = (size_t)st.st_size;
+	if(_size == 0) {
+		::close(fd);
+		return {};
+	}
+
+	void* data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if(data == MAP_FAILED) {
+		_size = 0;
+		return "Failed to map " + path;
+	}
+	// We read the file front to back exactly once
+	madvise(data, _size, MADV_SEQUENTIAL);
+	_data = (const unsigned char*)data;
+	return {};
+}
+
+void Mapped_File::close() {
+	if(_data) munmap((void*)_data, _size);
+	_data = nullptr;
+	_size = 0;
+}
+
+#endif
@@ -0,0 +1,31 @@
+
+#pragma once
+
+#include <string>
+
+/// Read-only memory mapping of an entire file
+class Mapped_File {
+public:
+	Mapped_File() = default;
+	Mapped_File(const Mapped_File& src) = delete;
+	Mapped_File(Mapped_File&& src);
+	~Mapped_File();
+
+	void operator=(const Mapped_File& src) = delete;
+	void operator=(Mapped_File&& src);
+
+	/// Returns an error message on failure
+	std::string open(std::string path);
+	void close();
+
+	const unsigned char* data() const {return _data;}
+	size_t size() const {return _size;}
+
+private:
+	const unsigned char* _data = nullptr;
+	size_t _size = 0;
+#ifdef _WIN32
+	void* file = nullptr;
+	void* mapping = nullptr;
+#endif
+};
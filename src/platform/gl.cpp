@@ -2,6 +2,7 @@
 #include "gl.h"
 #include "../lib/log.h"
 
+#include <cstring>
 #include <fstream>
 
 namespace GL {
@@ -10,11 +11,104 @@ static void setup_debug_proc();
 static void check_leaked_handles();
 static bool is_nvidia = false;
 static bool is_gl45 = false;
+static bool has_buffer_storage = false;
+
+// Shadow copy of the state the wrappers in this file change, so calls that
+// wouldn't change anything are never issued. Every program, VAO, framebuffer,
+// viewport, and capability change in this file goes through the functions
+// below; code outside (ImGui) is followed by invalidate_state().
+namespace {
+const GLuint unknown = ~0u;
+const GLenum tracked_caps[] = {GL_BLEND, GL_DEPTH_TEST, GL_CULL_FACE, GL_LINE_SMOOTH,
+							   GL_POLYGON_OFFSET_FILL, GL_POLYGON_OFFSET_LINE};
+const int n_caps = sizeof(tracked_caps) / sizeof(tracked_caps[0]);
+
+struct State {
+	GLuint program = unknown, vao = unknown;
+	GLuint read_fb = unknown, draw_fb = unknown;
+	GLint viewport[4] = {-1, -1, -1, -1};
+	GLenum polygon_mode = 0;
+	int enabled[n_caps] = {}; // 1 on, 0 off, -1 unknown
+	State_Counts counts;
+	State() {
+		for(int& e : enabled) e = -1;
+	}
+};
+State state;
+
+bool changed(bool differs) {
+	if(differs) state.counts.issued++;
+	else state.counts.skipped++;
+	return differs;
+}
+
+void set_program(GLuint program) {
+	if(changed(state.program != program)) glUseProgram(program);
+	state.program = program;
+}
+
+void set_vao(GLuint vao) {
+	if(changed(state.vao != vao)) glBindVertexArray(vao);
+	state.vao = vao;
+}
+
+void set_framebuffer(GLenum target, GLuint fb) {
+	bool read = target != GL_DRAW_FRAMEBUFFER, draw = target != GL_READ_FRAMEBUFFER;
+	if(changed((read && state.read_fb != fb) || (draw && state.draw_fb != fb))) {
+		glBindFramebuffer(target, fb);
+	}
+	if(read) state.read_fb = fb;
+	if(draw) state.draw_fb = fb;
+}
+
+void set_viewport(GLint x, GLint y, GLint w, GLint h) {
+	GLint* v = state.viewport;
+	if(changed(v[0] != x || v[1] != y || v[2] != w || v[3] != h)) glViewport(x, y, w, h);
+	v[0] = x; v[1] = y; v[2] = w; v[3] = h;
+}
+
+void set_enabled(GLenum cap, bool on) {
+	int i = 0;
+	while(i < n_caps && tracked_caps[i] != cap) i++;
+	if(i == n_caps || changed(state.enabled[i] != (int)on)) {
+		if(on) glEnable(cap);
+		else glDisable(cap);
+	}
+	if(i < n_caps) state.enabled[i] = on;
+}
+
+void set_polygon_mode(GLenum mode) {
+	if(changed(state.polygon_mode != mode)) glPolygonMode(GL_FRONT_AND_BACK, mode);
+	state.polygon_mode = mode;
+}
+
+// Deleting a bound object reverts its binding to zero, and the name may be reused
+void deleted_vao(GLuint vao) {
+	if(vao && state.vao == vao) state.vao = 0;
+}
+void deleted_framebuffer(GLuint fb) {
+	if(fb && state.read_fb == fb) state.read_fb = 0;
+	if(fb && state.draw_fb == fb) state.draw_fb = 0;
+}
+}
+
+void invalidate_state() {
+	State_Counts counts = state.counts;
+	state = State();
+	state.counts = counts;
+}
+
+State_Counts take_state_counts() {
+	State_Counts ret = state.counts;
+	state.counts = {};
+	return ret;
+}
 
 void setup() {
 	std::string ver = version();
 	is_nvidia = ver.find("NVIDIA") != std::string::npos;
 	is_gl45 = ver.find("4.5") != std::string::npos;
+	has_buffer_storage = GLAD_GL_VERSION_4_4 && glBufferStorage;
 
 	setup_debug_proc();
 	Effects::init();
@@ -41,10 +135,10 @@ std::string renderer() {
 }
 
 void global_params() {
-	glEnable(GL_BLEND);
+	set_enabled(GL_BLEND, true);
 	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
 	glPolygonOffset(1.0f, 1.0f);
-	glEnable(GL_DEPTH_TEST);
+	set_enabled(GL_DEPTH_TEST, true);
 	glDepthFunc(GL_GREATER);
 	glClearDepth(0.0);
 	if(glClipControl) glClipControl(GL_LOWER_LEFT, GL_ZERO_TO_ONE);
@@ -60,14 +154,14 @@ void clear_screen(Vec4 col) {
 void enable(Opt opt) {
 	switch(opt) {
 	case Opt::wireframe: {
-		glEnable(GL_POLYGON_OFFSET_LINE);
-		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+		set_enabled(GL_POLYGON_OFFSET_LINE, true);
+		set_polygon_mode(GL_LINE);
 	} break;
 	case Opt::offset: {
-		glEnable(GL_POLYGON_OFFSET_FILL);
+		set_enabled(GL_POLYGON_OFFSET_FILL, true);
 	} break;
 	case Opt::culling: {
-		glEnable(GL_CULL_FACE);
+		set_enabled(GL_CULL_FACE, true);
 	} break;
 	}
 }
@@ -75,20 +169,20 @@ void enable(Opt opt) {
 void disable(Opt opt) {
 	switch(opt) {
 	case Opt::wireframe: {
-		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-		glDisable(GL_POLYGON_OFFSET_LINE);
+		set_polygon_mode(GL_FILL);
+		set_enabled(GL_POLYGON_OFFSET_LINE, false);
 	} break;
 	case Opt::offset: {
-		glDisable(GL_POLYGON_OFFSET_FILL);
+		set_enabled(GL_POLYGON_OFFSET_FILL, false);
 	} break;
 	case Opt::culling: {
-		glDisable(GL_CULL_FACE);
+		set_enabled(GL_CULL_FACE, false);
 	} break;
 	}
 }
 
 void viewport(Vec2 dim) {
-	glViewport(0, 0, (GLsizei)dim.x, (GLsizei)dim.y);
+	set_viewport(0, 0, (GLint)dim.x, (GLint)dim.y);
 }
 
 Mesh::Mesh() {
@@ -105,6 +199,7 @@ Mesh::Mesh(Mesh&& src) {
 	ebo = src.ebo; src.ebo = 0;
 	vbo = src.vbo; src.vbo = 0;
 	n_elem = src.n_elem; src.n_elem = 0;
+	_revision = src._revision; src._revision = 0;
 	_bbox = src._bbox; src._bbox.reset();
 	_verts = std::move(src._verts);
 	_idxs = std::move(src._idxs);
@@ -116,6 +211,7 @@ void Mesh::operator=(Mesh&& src) {
 	vbo = src.vbo; src.vbo = 0;
 	ebo = src.ebo; src.ebo = 0;
 	n_elem = src.n_elem; src.n_elem = 0;
+	_revision = src._revision; src._revision = 0;
 	_bbox = src._bbox; src._bbox.reset();
 	_verts = std::move(src._verts);
 	_idxs = std::move(src._idxs);
@@ -125,61 +221,82 @@ Mesh::~Mesh() {
 	destroy();
 }
 
-void Mesh::create() {
-	glGenVertexArrays(1, &vao);
-	glGenBuffers(1, &vbo);
-	glGenBuffers(1, &ebo);
-
-	glBindVertexArray(vao);
+// Points the bound VAO at vbo and ebo, laid out as Mesh::Vert and Mesh::Index
+static void mesh_attribs(GLuint vbo, GLuint ebo) {
 
 	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vert), (GLvoid*)0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Mesh::Vert), (GLvoid*)0);
 	glEnableVertexAttribArray(0);
 
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vert), (GLvoid*)sizeof(Vec3));
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Mesh::Vert), (GLvoid*)sizeof(Vec3));
 	glEnableVertexAttribArray(1);
 
-	glVertexAttribIPointer(2, 1, GL_UNSIGNED_INT, sizeof(Vert), (GLvoid*)(2 * sizeof(Vec3)));
+	glVertexAttribIPointer(2, 1, GL_UNSIGNED_INT, sizeof(Mesh::Vert), (GLvoid*)(2 * sizeof(Vec3)));
 	glEnableVertexAttribArray(2);
 
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-	
-	glBindVertexArray(0);
+}
+
+void Mesh::create() {
+	glGenVertexArrays(1, &vao);
+	glGenBuffers(1, &vbo);
+	glGenBuffers(1, &ebo);
+
+	set_vao(vao);
+	mesh_attribs(vbo, ebo);
+	set_vao(0);
 }
 
 void Mesh::destroy() {
 	glDeleteBuffers(1, &ebo);
 	glDeleteBuffers(1, &vbo);
+	deleted_vao(vao);
 	glDeleteVertexArrays(1, &vao);
 	ebo = vao = vbo = 0;
 }
 
 void Mesh::update(std::vector<Vert>&& vertices, std::vector<Index>&& indices) {
+	BBox box;
+	for(auto& v : vertices) {
+		box.enclose(v.pos);
+	}
+	update(std::move(vertices), std::move(indices), box);
+}
+
+void Mesh::update(std::vector<Vert>&& vertices, std::vector<Index>&& indices, BBox box) {
 
 	_verts = std::move(vertices);
 	_idxs = std::move(indices);
 	
-	glBindVertexArray(vao);
+	set_vao(vao);
 
+	// Orphan the old storage before filling it, so the driver hands out fresh
+	// memory instead of waiting on draws from previous frames still in flight.
 	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(Vert) * _verts.size(), _verts.data(), GL_STATIC_DRAW);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(Vert) * _verts.size(), nullptr, GL_DYNAMIC_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(Vert) * _verts.size(), _verts.data());
 
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(Index) * _idxs.size(), _idxs.data(), GL_STATIC_DRAW);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(Index) * _idxs.size(), nullptr, GL_DYNAMIC_DRAW);
+	glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, sizeof(Index) * _idxs.size(), _idxs.data());
 
-	glBindVertexArray(0);
+	set_vao(0);
 
-	_bbox.reset();
-	for(auto& v : _verts) {
-		_bbox.enclose(v.pos);
-	}
+	_bbox = box;
 	n_elem = _idxs.size();
+
+	static unsigned int revisions = 0;
+	_revision = ++revisions;
 }
 
 GLuint Mesh::tris() const {
 	return n_elem / 3;
 }
 
+unsigned int Mesh::revision() const {
+	return _revision;
+}
+
 const std::vector<Mesh::Vert>& Mesh::verts() const {
 	return _verts;
 }
@@ -193,19 +310,271 @@ BBox Mesh::bbox() const {
 }
 
 void Mesh::render() const {
-	glBindVertexArray(vao);
+	set_vao(vao);
 	glDrawElements(GL_TRIANGLES, n_elem, GL_UNSIGNED_INT, nullptr);
-	glBindVertexArray(0);
 }
 
-Instances::Instances(GL::Mesh&& mesh) : mesh(std::move(mesh)) {
-	create();
+Batch::Batch() {}
+
+Batch::Batch(Batch&& src) {
+	*this = std::move(src);
 }
 
-Instances::Instances(Instances&& src) {
-	mesh = std::move(src.mesh);
-	data = std::move(src.data);
+Batch::~Batch() {
+	destroy();
+}
+
+void Batch::operator=(Batch&& src) {
+	destroy();
+	entries = std::move(src.entries);
+	vao = src.vao; src.vao = 0;
 	vbo = src.vbo; src.vbo = 0;
+	ebo = src.ebo; src.ebo = 0;
+	n_verts = src.n_verts; src.n_verts = 0;
+	n_idxs = src.n_idxs; src.n_idxs = 0;
+	vert_cap = src.vert_cap; src.vert_cap = 0;
+	idx_cap = src.idx_cap; src.idx_cap = 0;
+}
+
+void Batch::destroy() {
+	if(!vao) return;
+	deleted_vao(vao);
+	glDeleteVertexArrays(1, &vao);
+	glDeleteBuffers(1, &vbo);
+	glDeleteBuffers(1, &ebo);
+	vao = vbo = ebo = 0;
+	entries.clear();
+	n_verts = n_idxs = vert_cap = idx_cap = 0;
+}
+
+void Batch::clear() {
+	// Keeps the buffers for the entries added next
+	entries.clear();
+	n_verts = n_idxs = 0;
+}
+
+void Batch::reserve(size_t verts, size_t indices) {
+
+	if(!vao) glGenVertexArrays(1, &vao);
+	if(verts <= vert_cap && indices <= idx_cap) return;
+
+	// Grow by copying on the GPU. Uploads use the copy targets, so they never
+	// touch the element buffer of whatever VAO happens to be bound.
+	auto grow = [](GLuint& buf, size_t& cap, size_t need, size_t used, size_t size) {
+		if(need <= cap) return;
+		size_t new_cap = std::max(need, cap * 2);
+		GLuint new_buf = 0;
+		glGenBuffers(1, &new_buf);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, new_buf);
+		glBufferData(GL_COPY_WRITE_BUFFER, new_cap * size, nullptr, GL_STATIC_DRAW);
+		if(used) {
+			glBindBuffer(GL_COPY_READ_BUFFER, buf);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, used * size);
+		}
+		glDeleteBuffers(1, &buf);
+		buf = new_buf;
+		cap = new_cap;
+	};
+	grow(vbo, vert_cap, verts, n_verts, sizeof(Mesh::Vert));
+	grow(ebo, idx_cap, indices, n_idxs, sizeof(Mesh::Index));
+
+	set_vao(vao);
+	mesh_attribs(vbo, ebo);
+	set_vao(0);
+}
+
+size_t Batch::add(const std::vector<Mesh::Vert>& verts, const std::vector<Mesh::Index>& indices) {
+
+	reserve(n_verts + verts.size(), n_idxs + indices.size());
+
+	glBindBuffer(GL_COPY_WRITE_BUFFER, vbo);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, n_verts * sizeof(Mesh::Vert), verts.size() * sizeof(Mesh::Vert), verts.data());
+	glBindBuffer(GL_COPY_WRITE_BUFFER, ebo);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, n_idxs * sizeof(Mesh::Index), indices.size() * sizeof(Mesh::Index), indices.data());
+
+	entries.push_back({(GLint)n_verts, n_idxs, (GLsizei)indices.size(), verts.size()});
+	n_verts += verts.size();
+	n_idxs += indices.size();
+	return entries.size() - 1;
+}
+
+void Batch::update(size_t entry, const std::vector<Mesh::Vert>& verts) {
+
+	const Entry& e = entries[entry];
+	assert(verts.size() == e.n_verts);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, vbo);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, e.base_vertex * sizeof(Mesh::Vert), verts.size() * sizeof(Mesh::Vert), verts.data());
+}
+
+void Batch::render(const std::vector<size_t>& which) const {
+
+	if(which.empty()) return;
+	counts.clear();
+	offsets.clear();
+	bases.clear();
+	for(size_t i : which) {
+		const Entry& e = entries[i];
+		counts.push_back(e.count);
+		offsets.push_back((const void*)(e.first_index * sizeof(Mesh::Index)));
+		bases.push_back(e.base_vertex);
+	}
+
+	set_vao(vao);
+	glMultiDrawElementsBaseVertex(GL_TRIANGLES, counts.data(), GL_UNSIGNED_INT, offsets.data(), (GLsizei)counts.size(), bases.data());
+}
+
+Stream::Stream(size_t stride) : stride(stride) {}
+
+Stream::Stream(Stream&& src) {
+	*this = std::move(src);
+}
+
+Stream::~Stream() {
+	destroy();
+}
+
+void Stream::operator=(Stream&& src) {
+	destroy();
+	stride = src.stride;
+	buf = src.buf; src.buf = 0;
+	persistent = src.persistent; src.persistent = false;
+	writing = src.writing; src.writing = false;
+	changed = src.changed; src.changed = false;
+	n = src.n; src.n = 0;
+	map = src.map; src.map = nullptr;
+	capacity = src.capacity; src.capacity = 0;
+	region = src.region; src.region = 0;
+	drawn = src.drawn; src.drawn = 0;
+	for(int i = 0; i < 3; i++) {
+		fences[i] = src.fences[i]; src.fences[i] = nullptr;
+	}
+	staging = std::move(src.staging);
+}
+
+void Stream::destroy() {
+	for(GLsync& f : fences) {
+		if(f) glDeleteSync(f);
+		f = nullptr;
+	}
+	if(buf) glDeleteBuffers(1, &buf);
+	buf = 0;
+	map = nullptr;
+	capacity = n = 0;
+	writing = false;
+	staging.clear();
+}
+
+size_t Stream::size() const {
+	return n;
+}
+
+void* Stream::data() {
+	if(!persistent) return staging.data();
+	return map + (region * capacity) * stride;
+}
+
+size_t Stream::first() const {
+	return persistent ? drawn * capacity : 0;
+}
+
+void Stream::wait(int r) {
+	if(!fences[r]) return;
+	while(true) {
+		GLenum ret = glClientWaitSync(fences[r], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+		if(ret != GL_TIMEOUT_EXPIRED) break;
+	}
+	glDeleteSync(fences[r]);
+	fences[r] = nullptr;
+}
+
+void Stream::open(size_t keep) {
+	writing = true;
+	if(!persistent) return;
+	// Carry over what the caller keeps from the batch being drawn
+	region = (drawn + 1) % 3;
+	wait(region);
+	if(keep) {
+		std::memcpy(map + region * capacity * stride, map + drawn * capacity * stride, keep * stride);
+	}
+}
+
+void Stream::grow(size_t count, size_t keep) {
+
+	size_t cap = std::max(std::max(count, capacity * 2), (size_t)64);
+	GLuint new_buf = 0;
+	glGenBuffers(1, &new_buf);
+	glBindBuffer(GL_ARRAY_BUFFER, new_buf);
+
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glBufferStorage(GL_ARRAY_BUFFER, 3 * cap * stride, nullptr, flags);
+	unsigned char* new_map = (unsigned char*)glMapBufferRange(GL_ARRAY_BUFFER, 0, 3 * cap * stride, flags);
+
+	if(keep) std::memcpy(new_map, map + region * capacity * stride, keep * stride);
+
+	// Draws already queued keep the old storage alive until they finish
+	for(GLsync& f : fences) {
+		if(f) glDeleteSync(f);
+		f = nullptr;
+	}
+	glDeleteBuffers(1, &buf);
+	buf = new_buf;
+	map = new_map;
+	capacity = cap;
+	region = 0;
+	drawn = 2;
+	changed = true;
+}
+
+void Stream::resize(size_t count, bool keep) {
+
+	if(!buf) {
+		persistent = has_buffer_storage;
+		if(persistent) grow(count, 0);
+		else glGenBuffers(1, &buf);
+		changed = true;
+	}
+
+	size_t kept = keep ? std::min(n, count) : 0;
+	if(!writing) open(kept);
+
+	if(persistent) {
+		if(count > capacity) grow(count, kept);
+	} else {
+		staging.resize(count * stride);
+	}
+	n = count;
+}
+
+bool Stream::commit() {
+
+	if(!buf) resize(0);
+	glBindBuffer(GL_ARRAY_BUFFER, buf);
+
+	if(persistent) {
+		drawn = region;
+	} else if(writing) {
+		// Orphan the old storage first so this never waits on earlier draws
+		glBufferData(GL_ARRAY_BUFFER, staging.size(), nullptr, GL_STREAM_DRAW);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, staging.size(), staging.data());
+	}
+	writing = false;
+
+	bool ret = changed;
+	changed = false;
+	return ret;
+}
+
+void Stream::fence() {
+	if(!persistent) return;
+	if(fences[drawn]) glDeleteSync(fences[drawn]);
+	fences[drawn] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+Instances::Instances(GL::Mesh&& mesh) : _mesh(std::move(mesh)), stream(sizeof(Info)) {}
+
+Instances::Instances(Instances&& src) {
+	_mesh = std::move(src._mesh);
+	stream = std::move(src.stream);
 	dirty = src.dirty; src.dirty = false;
 }
 
@@ -214,16 +583,13 @@ Instances::~Instances() {
 }
 
 void Instances::operator=(Instances&& src) {
-	mesh = std::move(src.mesh);
-	data = std::move(src.data);
-	vbo = src.vbo; src.vbo = 0;
+	_mesh = std::move(src._mesh);
+	stream = std::move(src.stream);
 	dirty = src.dirty; src.dirty = false;
 }
 
-void Instances::create() {
-	glGenBuffers(1, &vbo);
-	glBindVertexArray(mesh.vao);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+void Instances::attach() {
+	set_vao(_mesh.vao);
 
 	glEnableVertexAttribArray(3);
 	glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, sizeof(Info), (GLvoid*)0);
@@ -235,44 +601,58 @@ void Instances::create() {
 		glVertexAttribPointer(base_idx + i, 4, GL_FLOAT, GL_FALSE, sizeof(Info), (void*)(sizeof(GLuint) + sizeof(Vec4) * i));
 		glVertexAttribDivisor(base_idx + i, 1);
 	}
-	glBindVertexArray(0);
+	set_vao(0);
 }
 
 void Instances::render() {
 	
-	if(dirty) update();
-	glBindVertexArray(mesh.vao);
-	glDrawElementsInstanced(GL_TRIANGLES, mesh.n_elem, GL_UNSIGNED_INT, nullptr, data.size());
-	glBindVertexArray(0);
+	if(dirty) {
+		if(stream.commit()) attach();
+		dirty = false;
+	}
+	if(!stream.size()) return;
+
+	set_vao(_mesh.vao);
+	GLsizei count = (GLsizei)stream.size();
+	if(stream.first()) {
+		glDrawElementsInstancedBaseInstance(GL_TRIANGLES, _mesh.n_elem, GL_UNSIGNED_INT, nullptr, count, (GLuint)stream.first());
+	} else {
+		glDrawElementsInstanced(GL_TRIANGLES, _mesh.n_elem, GL_UNSIGNED_INT, nullptr, count);
+	}
+	stream.fence();
 }
 
 void Instances::add(Mat4 transform, GLuint id) {
-	data.push_back({id, transform});
+	size_t i = stream.size();
+	stream.resize(i + 1);
+	set(i, transform, id);
 	dirty = true;
 }
 
 void Instances::clear() {
-	data.clear();
+	stream.resize(0);
 	dirty = true;
 }
 
-void Instances::update() {
+void Instances::resize(size_t n) {
+	stream.resize(n, false);
+	dirty = true;
+}
 
-	glBindVertexArray(mesh.vao);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(Info) * data.size(), data.data(), GL_STATIC_DRAW);
-	glBindVertexArray(0);
+void Instances::set(size_t i, Mat4 transform, GLuint id) {
+	Info info = {id, transform};
+	std::memcpy((unsigned char*)stream.data() + i * sizeof(Info), &info, sizeof(Info));
+}
 
-	dirty = false;
+const Mesh& Instances::mesh() const {
+	return _mesh;
 }
 
 void Instances::destroy() {
-	glDeleteBuffers(1, &vbo);
-	vbo = 0;
-	mesh.destroy();
+	_mesh.destroy();
 }
 
-Lines::Lines(float thickness) : thickness(thickness) {
+Lines::Lines(float thickness) : thickness(thickness), stream(sizeof(Line_Vert)) {
 	create();
 }
 
@@ -280,8 +660,7 @@ Lines::Lines(Lines&& src) {
 	dirty = src.dirty; src.dirty = false;
 	thickness = src.thickness; src.thickness = 0.0f;
 	vao = src.vao; src.vao = 0;
-	vbo = src.vbo; src.vbo = 0;
-	vertices = std::move(src.vertices);
+	stream = std::move(src.stream);
 }
 
 void Lines::operator=(Lines&& src) {
@@ -289,79 +668,111 @@ void Lines::operator=(Lines&& src) {
 	dirty = src.dirty; src.dirty = false;
 	thickness = src.thickness; src.thickness = 0.0f;
 	vao = src.vao; src.vao = 0;
-	vbo = src.vbo; src.vbo = 0;
-	vertices = std::move(src.vertices);
+	stream = std::move(src.stream);
 }
 
 Lines::~Lines() {
 	destroy();
 }
 
-void Lines::update() const {
+void Lines::attach() const {
 
-	glBindVertexArray(vao);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(Line_Vert) * vertices.size(), vertices.data(), GL_STATIC_DRAW);
-	glBindVertexArray(0);
+	set_vao(vao);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Line_Vert), (GLvoid*)0);
+	glEnableVertexAttribArray(0);
 
-	dirty = false;
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Line_Vert), (GLvoid*)sizeof(Vec3));
+	glEnableVertexAttribArray(1);
+	set_vao(0);
 }
 
 void Lines::render(bool smooth) const {
 
-	if(dirty) update();
+	if(dirty) {
+		if(stream.commit()) attach();
+		dirty = false;
+	}
+	if(!stream.size()) return;
 
 	glLineWidth(thickness);
-	if(smooth) glEnable(GL_LINE_SMOOTH);
-	else glDisable(GL_LINE_SMOOTH);
+	set_enabled(GL_LINE_SMOOTH, smooth);
 
-	glBindVertexArray(vao);
-	glDrawArrays(GL_LINES, 0, vertices.size());
-	glBindVertexArray(0);
+	set_vao(vao);
+	glDrawArrays(GL_LINES, (GLint)stream.first(), (GLsizei)stream.size());
+	stream.fence();
 }
 
 void Lines::clear() {
-	vertices.clear();
+	stream.resize(0);
 	dirty = true;
 }
 
 void Lines::pop() {
-	vertices.pop_back();
-	vertices.pop_back();
+	stream.resize(stream.size() - 2);
 	dirty = true;
 }
 
 void Lines::add(Vec3 start, Vec3 end, Vec3 color) {
 
-	vertices.push_back({start, color});
-	vertices.push_back({end, color});
+	size_t i = stream.size();
+	stream.resize(i + 2);
+	Line_Vert verts[2] = {{start, color}, {end, color}};
+	std::memcpy((unsigned char*)stream.data() + i * sizeof(Line_Vert), verts, sizeof(verts));
 	dirty = true;
 }
 
 void Lines::create() {
 	glGenVertexArrays(1, &vao);
-	glGenBuffers(1, &vbo);
-
-	glBindVertexArray(vao);
-
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Line_Vert), (GLvoid*)0);
-	glEnableVertexAttribArray(0);
-
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Line_Vert), (GLvoid*)sizeof(Vec3));
-	glEnableVertexAttribArray(1);
-	
-	glBindVertexArray(0);
 }
 
 void Lines::destroy() {
-	glDeleteBuffers(1, &vbo);
+	deleted_vao(vao);
 	glDeleteVertexArrays(1, &vao);
-	vao = vbo = 0;
-	vertices.clear();
+	vao = 0;
+	stream = Stream(sizeof(Line_Vert));
 	dirty = false;
 }
 
+Uniform_Block::Uniform_Block(std::string name, GLuint binding, size_t size) :
+	name(name), binding(binding), size(size) {
+	glGenBuffers(1, &ubo);
+	glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+	glBufferData(GL_UNIFORM_BUFFER, size, nullptr, GL_DYNAMIC_DRAW);
+	glBindBufferBase(GL_UNIFORM_BUFFER, binding, ubo);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+Uniform_Block::Uniform_Block(Uniform_Block&& src) {
+	name = std::move(src.name);
+	binding = src.binding; src.binding = 0;
+	ubo = src.ubo; src.ubo = 0;
+	size = src.size; src.size = 0;
+}
+
+void Uniform_Block::operator=(Uniform_Block&& src) {
+	destroy();
+	name = std::move(src.name);
+	binding = src.binding; src.binding = 0;
+	ubo = src.ubo; src.ubo = 0;
+	size = src.size; src.size = 0;
+}
+
+Uniform_Block::~Uniform_Block() {
+	destroy();
+}
+
+void Uniform_Block::destroy() {
+	glDeleteBuffers(1, &ubo);
+	ubo = 0;
+}
+
+void Uniform_Block::update(const void* data) {
+	glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+	glBufferData(GL_UNIFORM_BUFFER, size, nullptr, GL_DYNAMIC_DRAW);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, size, data);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
 Shader::Shader() {}
 
 Shader::Shader(std::string vertex, std::string fragment) {
@@ -372,6 +783,7 @@ Shader::Shader(Shader&& src) {
 	program = src.program; src.program = 0;
 	v = src.v; src.v = 0;
 	f = src.f; src.f = 0;
+	locations = std::move(src.locations);
 }
 
 void Shader::operator=(Shader&& src) {
@@ -379,6 +791,7 @@ void Shader::operator=(Shader&& src) {
 	program = src.program; src.program = 0;
 	v = src.v; src.v = 0;
 	f = src.f; src.f = 0;
+	locations = std::move(src.locations);
 }
 
 Shader::~Shader() {
@@ -386,15 +799,21 @@ Shader::~Shader() {
 }
 
 void Shader::bind() const {
-	glUseProgram(program);
+	set_program(program);
 }
 
 void Shader::destroy() {
-	glUseProgram(0);
+	set_program(0);
 	glDeleteShader(v);
 	glDeleteShader(f);
 	glDeleteProgram(program);
 	v = f = program = 0;
+	locations.clear();
+}
+
+void Shader::use_block(const Uniform_Block& block) const {
+	GLuint idx = glGetUniformBlockIndex(program, block.name.c_str());
+	if(idx != GL_INVALID_INDEX) glUniformBlockBinding(program, idx, block.binding);
 }
 
 void Shader::uniform(std::string name, int count, const Vec2 items[]) const {
@@ -429,9 +848,48 @@ void Shader::uniform(std::string name, bool b) const {
 	glUniform1i(loc(name), b);
 }
 
-GLuint Shader::loc(std::string name) const {
+void Shader::uniform(Uniform<Mat4> u, Mat4 mat) const {
+	glUniformMatrix4fv(u.loc, 1, GL_FALSE, mat.data);
+}
+
+void Shader::uniform(Uniform<Vec3> u, Vec3 vec3) const {
+	glUniform3fv(u.loc, 1, vec3.data);
+}
 
-	return glGetUniformLocation(program, name.c_str());
+void Shader::uniform(Uniform<GLuint> u, GLuint i) const {
+	glUniform1ui(u.loc, i);
+}
+
+void Shader::uniform(Uniform<bool> u, bool b) const {
+	glUniform1i(u.loc, b);
+}
+
+GLint Shader::loc(const std::string& name) const {
+	// Unknown names get -1, which GL ignores just like it would have
+	auto entry = locations.find(name);
+	return entry == locations.end() ? -1 : entry->second;
+}
+
+void Shader::find_uniforms() {
+
+	GLint count = 0, max_len = 0;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_len);
+
+	std::vector<GLchar> name(std::max(max_len, 1));
+	for(GLint i = 0; i < count; i++) {
+		GLint size = 0;
+		GLenum type = 0;
+		glGetActiveUniform(program, i, max_len, nullptr, &size, &type, name.data());
+		GLint l = glGetUniformLocation(program, name.data());
+		if(l < 0) continue; // Lives in a uniform block
+
+		// Arrays are reported as name[0] but set by their plain name
+		std::string key = name.data();
+		size_t bracket = key.find('[');
+		if(bracket != std::string::npos) key.resize(bracket);
+		locations[key] = l;
+	}
 }
 
 void Shader::load(std::string vertex, std::string fragment) {
@@ -458,6 +916,7 @@ void Shader::load(std::string vertex, std::string fragment) {
 	glAttachShader(program, v);
 	glAttachShader(program, f);
 	glLinkProgram(program);
+	find_uniforms();
 }
 
 bool Shader::validate(GLuint program) {
@@ -482,14 +941,16 @@ bool Shader::validate(GLuint program) {
 
 Framebuffer::Framebuffer() {}
 
-Framebuffer::Framebuffer(int outputs, Vec2 dim, int samples, bool d) {
-	setup(outputs, dim, samples, d);
+Framebuffer::Framebuffer(int outputs, Vec2 dim, int samples, bool d, int id_output) {
+	setup(outputs, dim, samples, d, id_output);
 }
 
-void Framebuffer::setup(int outputs, Vec2 dim, int samples, bool d) {
+void Framebuffer::setup(int outputs, Vec2 dim, int samples, bool d, int id_output) {
 	destroy();
 	assert(outputs >= 0 && outputs < 31);
+	assert(id_output < outputs);
 	depth = d;
+	id_buf = id_output;
 	output_textures.resize(outputs);
 	resize(dim, samples);
 }
@@ -501,6 +962,8 @@ Framebuffer::Framebuffer(Framebuffer&& src) {
 	w = src.w; src.w = 0;
 	h = src.h; src.h = 0;
 	s = src.s; src.s = 0;
+	id_buf = src.id_buf; src.id_buf = -1;
+	depth = src.depth;
 }
 
 void Framebuffer::operator=(Framebuffer&& src) {
@@ -511,6 +974,8 @@ void Framebuffer::operator=(Framebuffer&& src) {
 	w = src.w; src.w = 0;
 	h = src.h; src.h = 0;
 	s = src.s; src.s = 0;
+	id_buf = src.id_buf; src.id_buf = -1;
+	depth = src.depth;
 }
 
 Framebuffer::~Framebuffer() {
@@ -526,6 +991,7 @@ void Framebuffer::create() {
 void Framebuffer::destroy() {
 	glDeleteTextures(1, &depth_tex);
 	glDeleteTextures(output_textures.size(), output_textures.data());
+	deleted_framebuffer(framebuffer);
 	glDeleteFramebuffers(1, &framebuffer);
 	depth_tex = framebuffer = 0;
 }
@@ -540,7 +1006,7 @@ void Framebuffer::resize(Vec2 dim, int samples) {
 	s = samples;
 	assert(w > 0 && h > 0 && s > 0);
 
-	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	set_framebuffer(GL_FRAMEBUFFER, framebuffer);
 
 	GLenum type = samples == 1 ? GL_TEXTURE_2D : GL_TEXTURE_2D_MULTISAMPLE;
 
@@ -550,8 +1016,13 @@ void Framebuffer::resize(Vec2 dim, int samples) {
 
 		glBindTexture(type, output_textures[i]);
 
+		bool id = (int)i == id_buf;
 		if(s > 1) {
-			glTexImage2DMultisample(type, s, GL_RGB8, w, h, GL_TRUE);
+			glTexImage2DMultisample(type, s, id ? GL_R32UI : GL_RGB8, w, h, GL_TRUE);
+		} else if(id) {
+			glTexImage2D(type, 0, GL_R32UI, w, h, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, 0);
+			glTexParameteri(type, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(type, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 		} else {
 			glTexImage2D(type, 0, GL_RGB8, w, h, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
 			glTexParameteri(type, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
@@ -580,26 +1051,34 @@ void Framebuffer::resize(Vec2 dim, int samples) {
 
 	glDrawBuffers(draw_buffers.size(), draw_buffers.data());
 
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	set_framebuffer(GL_FRAMEBUFFER, 0);
 }
 
 void Framebuffer::clear(int buf, Vec4 col) const {
 	assert(buf >= 0 && buf < (int)output_textures.size());
+	assert(!is_id(buf));
 	bind();
 	glClearBufferfv(GL_COLOR, buf, col.data);
 }
 
+void Framebuffer::clear_id(int buf) const {
+	assert(is_id(buf));
+	bind();
+	GLuint zero[4] = {};
+	glClearBufferuiv(GL_COLOR, buf, zero);
+}
+
 void Framebuffer::clear_d() const {
 	bind();
 	glClear(GL_DEPTH_BUFFER_BIT);
 }
 
 void Framebuffer::bind_screen() {
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	set_framebuffer(GL_FRAMEBUFFER, 0);
 }
 
 void Framebuffer::bind() const {
-	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	set_framebuffer(GL_FRAMEBUFFER, framebuffer);
 }
 
 GLuint Framebuffer::get_output(int buf) const {
@@ -612,38 +1091,44 @@ GLuint Framebuffer::get_depth() const {
 	return depth_tex;
 }
 
+bool Framebuffer::is_id(int buf) const {
+	return buf >= 0 && buf == id_buf;
+}
+
 bool Framebuffer::can_read_at() const {
 	return is_gl45 && s == 1;
 }
 
-void Framebuffer::read_at(int buf, int x, int y, GLubyte* data) const {
+void Framebuffer::read_at(int buf, int x, int y, GLuint* data) const {
 	assert(can_read_at());
-	assert(buf >= 0 && buf < (int)output_textures.size());
-	glGetTextureSubImage(output_textures[buf], 0, x, y, 0, 1, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, 4, data);
+	assert(is_id(buf));
+	glGetTextureSubImage(output_textures[buf], 0, x, y, 0, 1, 1, 1, GL_RED_INTEGER, GL_UNSIGNED_INT, sizeof(GLuint), data);
 }
 
-void Framebuffer::read(int buf, GLubyte* data) const {
+void Framebuffer::read(int buf, GLuint* data) const {
 	assert(s == 1);
-	assert(buf >= 0 && buf < (int)output_textures.size());
+	assert(is_id(buf));
 	glBindTexture(GL_TEXTURE_2D, output_textures[buf]);
-	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, data);
+	glBindTexture(GL_TEXTURE_2D, 0);
 }
 
 void Framebuffer::blit_to(int buf, const Framebuffer& fb, bool avg) const {
 
 	assert(buf >= 0 && buf < (int)output_textures.size());
+	assert(is_id(buf) == fb.is_id(0));
 	if(s > 1) {
 		Effects::resolve_to(buf, *this, fb, avg);
 		return;
 	}
 
-	glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
-	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fb.framebuffer);
+	set_framebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+	set_framebuffer(GL_DRAW_FRAMEBUFFER, fb.framebuffer);
 
 	glReadBuffer(GL_COLOR_ATTACHMENT0 + buf);
 	glBlitFramebuffer(0, 0, w, h, 0, 0, fb.w, fb.h, GL_COLOR_BUFFER_BIT, GL_NEAREST);
 
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	set_framebuffer(GL_FRAMEBUFFER, 0);
 }
 
 void Framebuffer::blit_to_screen(int buf, Vec2 dim) const {
@@ -654,13 +1139,13 @@ void Framebuffer::blit_to_screen(int buf, Vec2 dim) const {
 		return;
 	}
 
-	glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
-	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	set_framebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+	set_framebuffer(GL_DRAW_FRAMEBUFFER, 0);
 
 	glReadBuffer(GL_COLOR_ATTACHMENT0 + buf);
 	glBlitFramebuffer(0, 0, w, h, 0, 0, (GLint)dim.x, (GLint)dim.y, GL_COLOR_BUFFER_BIT, GL_NEAREST);
 
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	set_framebuffer(GL_FRAMEBUFFER, 0);
 }
 
 bool Framebuffer::is_multisampled() const {
@@ -671,15 +1156,18 @@ void Effects::init() {
 
 	glGenVertexArrays(1, &vao);
 	resolve_shader.load(effects_v, resolve_f);
+	resolve_id_shader.load(effects_v, resolve_id_f);
 	outline_shader.load(effects_v, outline_f);
 	outline_shader_ms.load(effects_v, is_gl45 ? outline_ms_f_4 : outline_ms_f_33);
 }
 
 void Effects::destroy() {
 
+	deleted_vao(vao);
 	glDeleteVertexArrays(1, &vao);
 	vao = 0;
 	resolve_shader.~Shader();
+	resolve_id_shader.~Shader();
 	outline_shader.~Shader();
 	outline_shader_ms.~Shader();
 }
@@ -711,11 +1199,10 @@ void Effects::outline(const Framebuffer& from, const Framebuffer& to, Vec3 color
 		outline_shader.uniform("bounds", 4, quad);
 	}
 
-	glBindVertexArray(vao);
-	glDisable(GL_DEPTH_TEST);
+	set_vao(vao);
+	set_enabled(GL_DEPTH_TEST, false);
 	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-	glEnable(GL_DEPTH_TEST);
-	glBindVertexArray(0);
+	set_enabled(GL_DEPTH_TEST, true);
 	
 	flush_if_nvidia();
 }
@@ -733,31 +1220,35 @@ void Effects::resolve_to_screen(int buf, const Framebuffer& framebuffer) {
 	resolve_shader.uniform("samples", framebuffer.s);
 	resolve_shader.uniform("bounds", 4, screen_quad);
 
-	glBindVertexArray(vao);
-	glDisable(GL_DEPTH_TEST);
+	set_vao(vao);
+	set_enabled(GL_DEPTH_TEST, false);
 	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-	glEnable(GL_DEPTH_TEST);
-	glBindVertexArray(0);
+	set_enabled(GL_DEPTH_TEST, true);
 }
 
 void Effects::resolve_to(int buf, const Framebuffer& from, const Framebuffer& to, bool avg) {
 
 	to.bind();
 
-	resolve_shader.bind();
-	
 	assert(buf >= 0 && buf < (int)from.output_textures.size());
 	glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, from.output_textures[buf]);
 
-	resolve_shader.uniform("tex", 0);
-	resolve_shader.uniform("samples", avg ? from.s : 1);
-	resolve_shader.uniform("bounds", 4, screen_quad);
+	// IDs can't be averaged, so integer outputs always take the first sample
+	if(from.is_id(buf)) {
+		resolve_id_shader.bind();
+		resolve_id_shader.uniform("tex", 0);
+		resolve_id_shader.uniform("bounds", 4, screen_quad);
+	} else {
+		resolve_shader.bind();
+		resolve_shader.uniform("tex", 0);
+		resolve_shader.uniform("samples", avg ? from.s : 1);
+		resolve_shader.uniform("bounds", 4, screen_quad);
+	}
 
-	glBindVertexArray(vao);
-	glDisable(GL_DEPTH_TEST);
+	set_vao(vao);
+	set_enabled(GL_DEPTH_TEST, false);
 	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-	glEnable(GL_DEPTH_TEST);
-	glBindVertexArray(0);
+	set_enabled(GL_DEPTH_TEST, true);
 }
 
 static void debug_proc(GLenum glsource, GLenum gltype, GLuint id, GLenum severity, GLsizei length, const GLchar* glmessage, const void* up) {
@@ -969,7 +1460,18 @@ void main() {
 
 	out_color = vec4(color, 1.0f);
 })";
+const std::string Effects::resolve_id_f = R"(
+#version 330 core
+
+uniform usampler2DMS tex;
+out uint out_id;
+
+void main() {
+	out_id = texelFetch(tex, ivec2(gl_FragCoord.xy), 0).r;
+})";
 
+// The renderer inserts its Frame uniform block (proj, viewproj, sel_color,
+// hov_color) after the #version line of each of these
 namespace Shaders {
 	const std::string line_v = R"(
 #version 330 core
@@ -977,7 +1479,6 @@ namespace Shaders {
 layout (location = 0) in vec3 v_pos;
 layout (location = 1) in vec3 v_col;
 
-uniform mat4 viewproj;
 smooth out vec3 f_col;
 
 void main() {
@@ -988,13 +1489,13 @@ void main() {
 #version 330 core
 
 layout (location = 0) out vec4 out_col;
-layout (location = 1) out vec4 out_id;
+layout (location = 1) out uint out_id;
 
 uniform float alpha;
 smooth in vec3 f_col;
 
 void main() {
-	out_id = vec4(0.0f);
+	out_id = 0u;
 	out_col = vec4(f_col, alpha);
 })"; 
 	const std::string mesh_v = R"(
@@ -1004,7 +1505,7 @@ layout (location = 0) in vec3 v_pos;
 layout (location = 1) in vec3 v_norm;
 layout (location = 2) in uint v_id;
 
-uniform mat4 mvp, normal;
+uniform mat4 modelview, normal;
 
 smooth out vec3 f_norm;
 flat out uint f_id;
@@ -1012,7 +1513,7 @@ flat out uint f_id;
 void main() {
 	f_id = v_id;
 	f_norm = (normal * vec4(v_norm, 0.0f)).xyz;
-	gl_Position = mvp * vec4(v_pos, 1.0f);
+	gl_Position = proj * (modelview * vec4(v_pos, 1.0f));
 })";
 	const std::string inst_v = R"(
 #version 330 core
@@ -1025,7 +1526,7 @@ layout (location = 3) in uint i_id;
 layout (location = 4) in mat4 i_trans;
 
 uniform bool use_i_id;
-uniform mat4 proj, modelview;
+uniform mat4 modelview;
 
 smooth out vec3 f_norm;
 flat out uint f_id;
@@ -1042,10 +1543,10 @@ void main() {
 
 uniform bool solid, use_v_id;
 uniform uint id, sel_id, hov_id;
-uniform vec3 color, sel_color, hov_color;
+uniform vec3 color;
 
 layout (location = 0) out vec4 out_col;
-layout (location = 1) out vec4 out_id;
+layout (location = 1) out uint out_id;
 
 smooth in vec3 f_norm;
 flat in uint f_id;
@@ -1054,11 +1555,11 @@ void main() {
 
 	vec3 use_color;
 	if(use_v_id) {
-		out_id = vec4((f_id & 0xffu) / 255.0f, ((f_id >> 8) & 0xffu) / 255.0f, ((f_id >> 16) & 0xffu) / 255.0f, 1.0f);
-		use_color = f_id == sel_id ? sel_color : (f_id == hov_id ? hov_color : color);
+		out_id = f_id;
+		use_color = f_id == sel_id ? sel_color.rgb : (f_id == hov_id ? hov_color.rgb : color);
 	} else {
-		out_id = vec4((id & 0xffu) / 255.0f, ((id >> 8) & 0xffu) / 255.0f, ((id >> 16) & 0xffu) / 255.0f, 1.0f);
-		use_color = id == sel_id ? sel_color : (id == hov_id ? hov_color : color);
+		out_id = id;
+		use_color = id == sel_id ? sel_color.rgb : (id == hov_id ? hov_color.rgb : color);
 	}
 
 	if(solid) {
@@ -2,6 +2,7 @@
 #pragma once
 
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <glad/glad.h>
@@ -31,6 +32,16 @@ void disable(Opt opt);
 
 void color_mask(bool enable);
 
+/// Program, VAO, framebuffer, viewport, and capability changes made through
+/// this module, split into those sent to GL and those skipped as redundant
+struct State_Counts {
+	size_t issued = 0, skipped = 0;
+};
+/// Counts since the last call
+State_Counts take_state_counts();
+/// Forget the tracked state, after code outside this module changed it
+void invalidate_state();
+
 class Mesh {
 public:
 	typedef GLuint Index;
@@ -52,11 +63,15 @@ public:
 	/// Assumes proper shader is already bound
 	void render() const;
 	void update(std::vector<Vert>&& vertices, std::vector<Index>&& indices);
+	/// Same, with the bounding box already computed (e.g. on a worker thread)
+	void update(std::vector<Vert>&& vertices, std::vector<Index>&& indices, BBox box);
 
 	BBox bbox() const;
 	const std::vector<Vert>& verts() const;
 	const std::vector<Index>& indices() const;
 	GLuint tris() const;
+	/// Changes on every update(), and no two meshes share one
+	unsigned int revision() const;
 
 private:
 	void create();
@@ -65,6 +80,7 @@ private:
 	BBox _bbox;
 	GLuint vao = 0, vbo = 0, ebo = 0;
 	GLuint n_elem = 0;
+	unsigned int _revision = 0;
 
 	std::vector<Vert> _verts;
 	std::vector<Index> _idxs;
@@ -72,6 +88,105 @@ private:
 	friend class Instances;
 };
 
+/// Many static meshes packed into shared vertex and index buffers, so any
+/// subset of them is drawn with a single glMultiDrawElementsBaseVertex.
+/// Entries are appended or have their vertices rewritten in place; space
+/// of entries no longer drawn is only reclaimed by clear().
+class Batch {
+public:
+	Batch();
+	Batch(const Batch& src) = delete;
+	Batch(Batch&& src);
+	~Batch();
+
+	void operator=(const Batch& src) = delete;
+	void operator=(Batch&& src);
+
+	/// Append a mesh, returning its entry
+	size_t add(const std::vector<Mesh::Vert>& verts, const std::vector<Mesh::Index>& indices);
+	/// Rewrite an entry's vertices; there must be as many as it was added with
+	void update(size_t entry, const std::vector<Mesh::Vert>& verts);
+	void clear();
+
+	/// Assumes proper shader is already bound
+	void render(const std::vector<size_t>& entries) const;
+
+private:
+	void destroy();
+	void reserve(size_t verts, size_t indices);
+
+	struct Entry {
+		GLint base_vertex;
+		size_t first_index;
+		GLsizei count;
+		size_t n_verts;
+	};
+	std::vector<Entry> entries;
+
+	GLuint vao = 0, vbo = 0, ebo = 0;
+	size_t n_verts = 0, n_idxs = 0;
+	size_t vert_cap = 0, idx_cap = 0;
+
+	// Draw arguments, kept to avoid reallocating them every frame
+	mutable std::vector<GLsizei> counts;
+	mutable std::vector<const void*> offsets;
+	mutable std::vector<GLint> bases;
+};
+
+/// Vertex data rewritten from the CPU, e.g. per-instance transforms. Where
+/// GL 4.4 buffer storage is available the buffer stays mapped and is split
+/// into three regions, so a new batch is written straight into GPU-visible
+/// memory without stalling on draws still reading an older one. Elsewhere
+/// the batch is staged in system memory and uploaded by orphaning.
+class Stream {
+public:
+	Stream(size_t stride = 1);
+	Stream(const Stream& src) = delete;
+	Stream(Stream&& src);
+	~Stream();
+
+	void operator=(const Stream& src) = delete;
+	void operator=(Stream&& src);
+
+	/// Elements in the batch being written, or the last one committed
+	size_t size() const;
+	/// Resize the batch being written, starting a new one if the last was
+	/// committed. Call on the GL thread; data() may then be written from any
+	/// thread until commit(). Without keep the contents are left undefined.
+	void resize(size_t n, bool keep = true);
+	void* data();
+
+	/// Make the written batch the one draws read from, and bind the buffer to
+	/// GL_ARRAY_BUFFER. Returns true if the buffer object changed, in which
+	/// case vertex attributes have to be pointed at it again.
+	bool commit();
+	/// Index of the committed batch's first element, to draw with as the first
+	/// vertex or base instance
+	size_t first() const;
+	/// Call after drawing from the committed batch, so its region is not
+	/// rewritten until the GPU is done with it
+	void fence();
+
+private:
+	void destroy();
+	void open(size_t keep);
+	void grow(size_t n, size_t keep);
+	void wait(int r);
+
+	size_t stride = 1;
+	GLuint buf = 0;
+	bool persistent = false, writing = false, changed = false;
+	size_t n = 0;
+
+	// Persistent mapping: three regions of capacity elements each
+	unsigned char* map = nullptr;
+	size_t capacity = 0;
+	int region = 0, drawn = 0;
+	GLsync fences[3] = {};
+
+	std::vector<unsigned char> staging;
+};
+
 class Instances {
 public:
 	Instances(GL::Mesh&& mesh);
@@ -85,23 +200,28 @@ public:
 	void render();
 	void add(Mat4 transform, GLuint id = 0);
 	void clear();
+	/// Make room for exactly n instances, to be filled in with set()
+	void resize(size_t n);
+	/// Threads may set different instances concurrently
+	void set(size_t i, Mat4 transform, GLuint id = 0);
+
+	/// The geometry every instance draws
+	const Mesh& mesh() const;
 
 private:
-	void create();
 	void destroy();
-	void update();
+	void attach();
 
-	GLuint vbo = 0;
 	bool dirty = false;
 
-	Mesh mesh;
+	Mesh _mesh;
 
 	// NOTE(max): densely packed; alignof(mat4) = 4
 	struct Info {
 		GLuint id;
 		Mat4 transform;
 	};
-	std::vector<Info> data;
+	Stream stream;
 };
 
 class Lines {
@@ -123,18 +243,44 @@ public:
 private:
 	void create();
 	void destroy();
-	void update() const;
+	void attach() const;
 
 	mutable bool dirty = false;
 	float thickness = 0.0f;
-	GLuint vao = 0, vbo = 0;
+	GLuint vao = 0;
 
 	struct Line_Vert {
 		Vec3 pos;
 		Vec3 color;
 	};
 
-	std::vector<Line_Vert> vertices;
+	mutable Stream stream;
+};
+
+/// Uniform buffer shared by every shader that uses its block, e.g. per-frame
+/// camera data. Stays bound to its binding point, so it costs one upload per
+/// change instead of a uniform call per shader per draw.
+class Uniform_Block {
+public:
+	Uniform_Block(std::string name, GLuint binding, size_t size);
+	Uniform_Block(const Uniform_Block& src) = delete;
+	Uniform_Block(Uniform_Block&& src);
+	~Uniform_Block();
+
+	void operator=(const Uniform_Block& src) = delete;
+	void operator=(Uniform_Block&& src);
+
+	/// Replace the contents; data must match the std140 block layout
+	void update(const void* data);
+
+private:
+	void destroy();
+
+	std::string name;
+	GLuint binding = 0, ubo = 0;
+	size_t size = 0;
+
+	friend class Shader;
 };
 
 class Shader {	
@@ -150,6 +296,8 @@ public:
 
 	void bind() const;
 	void load(std::string vertex, std::string fragment);
+	/// Source the block of the same name from the given buffer
+	void use_block(const Uniform_Block& block) const;
 	
 	void uniform(std::string name, Mat4 mat) const;
 	void uniform(std::string name, Vec3 vec3) const;
@@ -160,22 +308,39 @@ public:
 	void uniform(std::string name, bool b) const;
 	void uniform(std::string name, int count, const Vec2 items[]) const;
 
+	/// Uniform location looked up once, for uniforms set on every draw
+	template<typename T> struct Uniform {
+		GLint loc = -1;
+	};
+	template<typename T> Uniform<T> get(std::string name) const {
+		return {loc(name)};
+	}
+
+	void uniform(Uniform<Mat4> u, Mat4 mat) const;
+	void uniform(Uniform<Vec3> u, Vec3 vec3) const;
+	void uniform(Uniform<GLuint> u, GLuint i) const;
+	void uniform(Uniform<bool> u, bool b) const;
+
 private:
-	GLuint loc(std::string name) const;
+	GLint loc(const std::string& name) const;
 	static bool validate(GLuint program);
+	void find_uniforms();
 
 	GLuint program = 0;
 	GLuint v = 0, f = 0;
+	// Resolved at load; names are looked up here instead of asking GL
+	std::unordered_map<std::string, GLint> locations;
 
 	void destroy();
 };
 
 /// this is very restrictive; it assumes a set number of gl_rgb8 output
-/// textures and a floating point depth render buffer.
+/// textures and a floating point depth render buffer. Optionally, one of
+/// the outputs may instead be a gl_r32ui integer texture for object IDs.
 class Framebuffer {
 public:
 	Framebuffer();
-	Framebuffer(int outputs, Vec2 dim, int samples = 1, bool depth = true);
+	Framebuffer(int outputs, Vec2 dim, int samples = 1, bool depth = true, int id_output = -1);
 	Framebuffer(const Framebuffer& src) = delete;
 	Framebuffer(Framebuffer&& src);
 	~Framebuffer();
@@ -185,7 +350,7 @@ public:
 
 	static void bind_screen();
 
-	void setup(int outputs, Vec2 dim, int samples, bool d);
+	void setup(int outputs, Vec2 dim, int samples, bool d, int id_output = -1);
 	void resize(Vec2 dim, int samples = 1);
 	void bind() const;
 	bool is_multisampled() const;
@@ -193,14 +358,16 @@ public:
 	GLuint get_output(int buf) const; 
 	GLuint get_depth() const; 
 
+	bool is_id(int buf) const;
 	bool can_read_at() const;
-	void read_at(int buf, int x, int y, GLubyte* data) const;
-	void read(int buf, GLubyte* data) const;
+	void read_at(int buf, int x, int y, GLuint* data) const;
+	void read(int buf, GLuint* data) const;
 	
 	void blit_to_screen(int buf, Vec2 dim) const;
 	void blit_to(int buf, const Framebuffer& fb, bool avg = true) const;
 
 	void clear(int buf, Vec4 col) const;
+	void clear_id(int buf) const;
 	void clear_d() const;
 
 private:
@@ -212,6 +379,7 @@ private:
 	GLuint framebuffer = 0;
 
 	int w = 0, h = 0, s = 0;
+	int id_buf = -1;
 	bool depth = true;
 
 	friend class Effects;
@@ -228,7 +396,7 @@ private:
 	static void init();
 	static void destroy();
 
-	static inline Shader resolve_shader, outline_shader, outline_shader_ms;
+	static inline Shader resolve_shader, resolve_id_shader, outline_shader, outline_shader_ms;
 	static inline GLuint vao;
 	static inline const Vec2 screen_quad[] = {
 		{-1.0f,  1.0f},
@@ -242,7 +410,7 @@ private:
 
 	static const std::string effects_v;
 	static const std::string outline_f, outline_ms_f_33, outline_ms_f_4;
-	static const std::string resolve_f;
+	static const std::string resolve_f, resolve_id_f;
 };
 
 namespace Shaders {
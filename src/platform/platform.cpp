@@ -3,6 +3,7 @@
 
 #include "gl.h"
 #include "platform.h"
+#include "prof.h"
 #include "font.h"
 
 #include <glad/glad.h>
@@ -119,6 +120,7 @@ void Platform::set_dpi() {
 
 void Platform::platform_shutdown() {
 
+	Prof::shutdown();
 	ImGui_ImplOpenGL3_Shutdown();
 	ImGui_ImplSDL2_Shutdown();
 	ImGui::DestroyContext();
@@ -133,9 +135,15 @@ void Platform::platform_shutdown() {
 
 void Platform::complete_frame() {
 
-	GL::Framebuffer::bind_screen();
-	ImGui::Render();
-	ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+	{
+		PROF_ZONE("ImGui");
+		PROF_GPU_ZONE("ImGui");
+		GL::Framebuffer::bind_screen();
+		ImGui::Render();
+		ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+		GL::invalidate_state();
+	}
+	PROF_ZONE("Swap");
 	SDL_GL_SwapWindow(window);
 }
 
@@ -150,32 +158,43 @@ void Platform::loop(App& app) {
 
 	bool running = true;
 	while(running) {
+
+		// Block until an event arrives (without removing it from the queue)
+		// if nothing is waiting to be drawn.
+		if(!app.needs_redraw()) {
+			SDL_WaitEventTimeout(nullptr, idle_timeout_ms);
+		}
 		
+		Prof::begin_frame();
 		begin_frame();
 
-		SDL_Event e;
-		while(SDL_PollEvent(&e)) {
+		{
+			PROF_ZONE("Events");
+			SDL_Event e;
+			while(SDL_PollEvent(&e)) {
 
-			ImGui_ImplSDL2_ProcessEvent(&e);
+				ImGui_ImplSDL2_ProcessEvent(&e);
 
-			switch(e.type) {
-			case SDL_QUIT: {
-				running = false;
-			} break;
-			case SDL_KEYDOWN: {
-				if(e.key.keysym.sym == SDLK_ESCAPE) {
+				switch(e.type) {
+				case SDL_QUIT: {
 					running = false;
+				} break;
+				case SDL_KEYDOWN: {
+					if(e.key.keysym.sym == SDLK_ESCAPE) {
+						running = false;
+					}
+				} break;
 				}
-			} break;
-			}
 
-			app.event(e);
+				app.event(e);
+			}
 		}
 
 		app.render();
 
 		complete_frame();
 		set_dpi();
+		Prof::end_frame();
 	}
 }
 
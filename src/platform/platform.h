@@ -26,6 +26,10 @@ public:
 	void ungrab_mouse();
 
 private:
+	// When nothing changed, still wake up periodically for time-based GUI
+	// elements (text cursor blink, FPS counter).
+	static const Uint32 idle_timeout_ms = 500;
+
 	float dpi_scale();
 	float prev_dpi = 0.0f;
 
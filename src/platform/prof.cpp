@@ -0,0 +1,470 @@
+
+#include "prof.h"
+#include "../lib/log.h"
+#include "../lib/math.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <glad/glad.h>
+#include <imgui/imgui.h>
+
+namespace Prof {
+
+struct Record {
+	const char* name;
+	int depth;
+	uint64_t begin, end;
+};
+
+struct Frame {
+	uint64_t number = 0;
+	bool gpu_valid = false;
+	float cpu_ms = 0.0f, gpu_ms = 0.0f;
+	std::vector<Record> cpu, gpu;
+};
+
+// GPU timer queries are read back a few frames after they are issued so that
+// we never stall waiting on the driver. Each in-flight frame gets its own
+// pool of timestamp queries.
+struct Pending {
+	bool waiting = false;
+	bool traced = false;
+	int64_t trace_offset = 0;
+	uint64_t number = 0;
+	size_t used = 0;
+	std::vector<GLuint> queries;
+	std::vector<Record> zones; // begin/end are query indices until resolved
+};
+
+static const size_t history = 128;
+static const size_t latency = 4;
+
+static Frame frames[history];
+static Pending pending[latency];
+static uint64_t frame_number = 0;
+
+static std::vector<size_t> cpu_stack, gpu_stack;
+static std::chrono::steady_clock::time_point cpu_epoch;
+
+static int view_offset = 0;
+static bool view_paused = false;
+
+// Trace events are appended to fixed-size chunks owned by the recording
+// thread. Only the owner writes to a buffer; the count is published with
+// release semantics so dump_trace() can read completed events from another
+// thread without locking. The registry lock is only taken when a thread
+// records its first event.
+struct Trace_Event {
+	const char* name;
+	uint64_t begin, end;
+};
+
+struct Trace_Chunk {
+	static const size_t capacity = 4096;
+	Trace_Event events[capacity];
+	std::atomic<size_t> count = 0;
+	std::atomic<Trace_Chunk*> next = nullptr;
+};
+
+struct Trace_Buffer {
+	~Trace_Buffer() {
+		Trace_Chunk* c = head.next.load();
+		while(c) {
+			Trace_Chunk* next = c->next.load();
+			delete c;
+			c = next;
+		}
+	}
+	std::atomic<const char*> name = nullptr;
+	size_t tid = 0;
+	Trace_Chunk head;
+	Trace_Chunk* tail = &head;
+};
+
+static const std::chrono::steady_clock::time_point trace_epoch = std::chrono::steady_clock::now();
+static std::mutex trace_lock;
+static std::vector<std::unique_ptr<Trace_Buffer>> trace_buffers;
+static thread_local Trace_Buffer* trace_local = nullptr;
+static Trace_Buffer* trace_gpu = nullptr;
+static std::string trace_file;
+static std::string trace_status;
+static uint64_t trace_frame_start = 0;
+
+static Trace_Buffer* new_trace_buffer(const char* name) {
+	std::lock_guard<std::mutex> lock(trace_lock);
+	trace_buffers.push_back(std::make_unique<Trace_Buffer>());
+	Trace_Buffer* buf = trace_buffers.back().get();
+	buf->tid = trace_buffers.size();
+	buf->name = name;
+	return buf;
+}
+
+static Trace_Buffer* thread_buffer() {
+	if(!trace_local) trace_local = new_trace_buffer(nullptr);
+	return trace_local;
+}
+
+static void push_event(Trace_Buffer* buf, const char* name, uint64_t begin, uint64_t end) {
+	Trace_Chunk* c = buf->tail;
+	size_t n = c->count.load(std::memory_order_relaxed);
+	if(n == Trace_Chunk::capacity) {
+		Trace_Chunk* next = new Trace_Chunk;
+		c->next.store(next, std::memory_order_release);
+		buf->tail = c = next;
+		n = 0;
+	}
+	c->events[n] = {name, begin, end};
+	c->count.store(n + 1, std::memory_order_release);
+}
+
+static uint64_t cpu_now() {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			   std::chrono::steady_clock::now() - cpu_epoch)
+		.count();
+}
+
+static Frame& frame_at(uint64_t number) {
+	return frames[number % history];
+}
+
+static GLuint timestamp(Pending& p) {
+	if(p.used == p.queries.size()) {
+		GLuint q = 0;
+		glGenQueries(1, &q);
+		p.queries.push_back(q);
+	}
+	GLuint q = p.queries[p.used++];
+	glQueryCounter(q, GL_TIMESTAMP);
+	return (GLuint)(p.used - 1);
+}
+
+static void resolve(Pending& p, bool block) {
+
+	if(!p.waiting) return;
+
+	if(!block) {
+		GLint ready = 0;
+		glGetQueryObjectiv(p.queries[p.used - 1], GL_QUERY_RESULT_AVAILABLE, &ready);
+		if(!ready) return;
+	}
+
+	static std::vector<uint64_t> times;
+	times.resize(p.used);
+	for(size_t i = 0; i < p.used; i++) {
+		glGetQueryObjectui64v(p.queries[i], GL_QUERY_RESULT, &times[i]);
+	}
+
+	if(p.traced) {
+		for(const Record& r : p.zones) {
+			push_event(trace_gpu, r.name, times[r.begin] + p.trace_offset, times[r.end] + p.trace_offset);
+		}
+	}
+
+	Frame& f = frame_at(p.number);
+	if(f.number == p.number) {
+		uint64_t base = times[0];
+		f.gpu.clear();
+		for(const Record& r : p.zones) {
+			f.gpu.push_back({r.name, r.depth, times[r.begin] - base, times[r.end] - base});
+		}
+		f.gpu_ms = (times[p.used - 1] - base) / 1000000.0f;
+		f.gpu_valid = true;
+	}
+	p.waiting = false;
+}
+
+void begin_frame() {
+
+	for(Pending& p : pending) resolve(p, false);
+
+	bool trace = tracing.load(std::memory_order_relaxed);
+	active = enabled || trace;
+	if(!active) return;
+
+	frame_number++;
+	cpu_epoch = std::chrono::steady_clock::now();
+	cpu_stack.clear();
+	gpu_stack.clear();
+
+	Frame& f = frame_at(frame_number);
+	f.number = frame_number;
+	f.gpu_valid = false;
+	f.cpu_ms = f.gpu_ms = 0.0f;
+	f.cpu.clear();
+	f.gpu.clear();
+
+	// The slot may still be in flight if the GPU is more than `latency`
+	// frames behind; in that case we have to wait for it.
+	Pending& p = pending[frame_number % latency];
+	resolve(p, true);
+	p.number = frame_number;
+	p.used = 0;
+	p.zones.clear();
+	p.traced = trace;
+	timestamp(p);
+
+	if(trace) {
+		// Line the GPU clock up with the trace clock once per frame
+		GLint64 gpu_now = 0;
+		glGetInteger64v(GL_TIMESTAMP, &gpu_now);
+		trace_frame_start = trace_now();
+		p.trace_offset = (int64_t)trace_frame_start - gpu_now;
+	}
+}
+
+void end_frame() {
+
+	if(!active) return;
+
+	while(!cpu_stack.empty()) end();
+	while(!gpu_stack.empty()) gpu_end();
+
+	Frame& f = frame_at(frame_number);
+	f.cpu_ms = cpu_now() / 1000000.0f;
+
+	Pending& p = pending[frame_number % latency];
+	timestamp(p);
+	p.waiting = true;
+
+	if(p.traced) trace_event("Frame", trace_frame_start, trace_now());
+
+	active = false;
+}
+
+void shutdown() {
+
+	for(Pending& p : pending) resolve(p, true);
+
+	if(tracing) {
+		std::string err = dump_trace();
+		if(err.empty()) {
+			info("Wrote trace to %s", trace_file.c_str());
+		} else {
+			warn("%s", err.c_str());
+		}
+		tracing = false;
+	}
+
+	for(Pending& p : pending) {
+		if(!p.queries.empty()) {
+			glDeleteQueries((GLsizei)p.queries.size(), p.queries.data());
+		}
+		p = Pending();
+	}
+	active = false;
+}
+
+void begin(const char* name) {
+	if(!active) return;
+	Frame& f = frame_at(frame_number);
+	cpu_stack.push_back(f.cpu.size());
+	f.cpu.push_back({name, (int)cpu_stack.size() - 1, cpu_now(), 0});
+}
+
+void end() {
+	if(!active) return;
+	assert(!cpu_stack.empty());
+	Frame& f = frame_at(frame_number);
+	f.cpu[cpu_stack.back()].end = cpu_now();
+	cpu_stack.pop_back();
+}
+
+void gpu_begin(const char* name) {
+	if(!active) return;
+	Pending& p = pending[frame_number % latency];
+	gpu_stack.push_back(p.zones.size());
+	p.zones.push_back({name, (int)gpu_stack.size() - 1, timestamp(p), 0});
+}
+
+void gpu_end() {
+	if(!active) return;
+	assert(!gpu_stack.empty());
+	Pending& p = pending[frame_number % latency];
+	p.zones[gpu_stack.back()].end = timestamp(p);
+	gpu_stack.pop_back();
+}
+
+uint64_t trace_now() {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			   std::chrono::steady_clock::now() - trace_epoch)
+		.count();
+}
+
+void trace_event(const char* name, uint64_t begin, uint64_t end) {
+	push_event(thread_buffer(), name, begin, end);
+}
+
+void name_thread(const char* name) {
+	thread_buffer()->name = name;
+}
+
+void start_trace(std::string file) {
+	trace_file = file;
+	if(!trace_gpu) trace_gpu = new_trace_buffer("GPU");
+	name_thread("Main");
+	tracing = true;
+}
+
+static void write_string(FILE* out, const char* str) {
+	fputc('"', out);
+	for(const char* c = str; *c; c++) {
+		if(*c == '"' || *c == '\\') fputc('\\', out);
+		fputc(*c, out);
+	}
+	fputc('"', out);
+}
+
+std::string dump_trace() {
+
+	FILE* out = fopen(trace_file.c_str(), "wb");
+	if(!out) return "Failed to open trace file " + trace_file;
+
+	std::lock_guard<std::mutex> lock(trace_lock);
+
+	fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool first = true;
+
+	for(auto& buf : trace_buffers) {
+
+		const char* name = buf->name.load();
+		if(name) {
+			fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":",
+					first ? "" : ",\n", buf->tid);
+			write_string(out, name);
+			fprintf(out, "}}");
+			first = false;
+		}
+
+		for(Trace_Chunk* c = &buf->head; c; c = c->next.load(std::memory_order_acquire)) {
+			size_t n = c->count.load(std::memory_order_acquire);
+			for(size_t i = 0; i < n; i++) {
+				const Trace_Event& e = c->events[i];
+				fprintf(out, "%s{\"name\":", first ? "" : ",\n");
+				write_string(out, e.name);
+				fprintf(out, ",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f}",
+						buf->tid, e.begin / 1000.0, (e.end - e.begin) / 1000.0);
+				first = false;
+			}
+		}
+	}
+
+	fprintf(out, "\n]}\n");
+
+	bool failed = ferror(out) != 0;
+	fclose(out);
+	if(failed) return "Failed to write trace file " + trace_file;
+	return {};
+}
+
+static ImU32 zone_color(const char* name) {
+	// Hash the name so a zone keeps the same color across frames
+	uint32_t h = 2166136261u;
+	for(const char* c = name; *c; c++) h = (h ^ (uint8_t)*c) * 16777619u;
+	float hue = (h % 360) / 360.0f;
+	float r, g, b;
+	ImGui::ColorConvertHSVtoRGB(hue, 0.5f, 0.8f, r, g, b);
+	return ImGui::GetColorU32(ImVec4(r, g, b, 1.0f));
+}
+
+static void flame_graph(const char* label, const std::vector<Record>& zones, float total_ms) {
+
+	ImGui::Text("%s: %.3f ms", label, total_ms);
+	if(zones.empty() || total_ms <= 0.0f) return;
+
+	int rows = 0;
+	for(const Record& r : zones) rows = std::max(rows, r.depth + 1);
+
+	float row_h = ImGui::GetTextLineHeightWithSpacing();
+	float width = std::max(ImGui::GetContentRegionAvail().x, 400.0f);
+	Vec2 origin = ImGui::GetCursorScreenPos();
+	ImGui::Dummy(Vec2(width, row_h * rows));
+
+	ImDrawList* draw = ImGui::GetWindowDrawList();
+	float ns_to_px = width / (total_ms * 1000000.0f);
+
+	for(const Record& r : zones) {
+
+		Vec2 min(origin.x + r.begin * ns_to_px, origin.y + r.depth * row_h);
+		Vec2 max(origin.x + std::max(r.end * ns_to_px, r.begin * ns_to_px + 1.0f),
+				 min.y + row_h - 1.0f);
+		max.x = std::min(max.x, origin.x + width);
+
+		draw->AddRectFilled(min, max, zone_color(r.name));
+
+		float text_w = ImGui::CalcTextSize(r.name).x;
+		if(text_w + 4.0f < max.x - min.x) {
+			draw->AddText(Vec2(min.x + 2.0f, min.y), IM_COL32_BLACK, r.name);
+		}
+
+		if(ImGui::IsMouseHoveringRect(min, max)) {
+			ImGui::SetTooltip("%s: %.3f ms", r.name, (r.end - r.begin) / 1000000.0f);
+		}
+	}
+}
+
+void gui() {
+
+	ImGui::Checkbox("Profile Frames", &enabled);
+
+	if(tracing) {
+		if(ImGui::Button("Save Trace")) {
+			std::string err = dump_trace();
+			trace_status = err.empty() ? "Wrote " + trace_file : err;
+		}
+	} else if(ImGui::Button("Start Trace")) {
+		start_trace(trace_file.empty() ? "trace.json" : trace_file);
+		trace_status = "Tracing to " + trace_file;
+	}
+	if(!trace_status.empty()) {
+		ImGui::SameLine();
+		ImGui::Text("%s", trace_status.c_str());
+	}
+	if(frame_number == 0) return;
+
+	size_t count = (size_t)std::min(frame_number, (uint64_t)history);
+
+	float cpu_ms[history], gpu_ms[history];
+	float cpu_max = 0.0f, gpu_max = 0.0f;
+	for(size_t i = 0; i < count; i++) {
+		const Frame& f = frame_at(frame_number - count + 1 + i);
+		cpu_ms[i] = f.cpu_ms;
+		gpu_ms[i] = f.gpu_valid ? f.gpu_ms : 0.0f;
+		cpu_max = std::max(cpu_max, cpu_ms[i]);
+		gpu_max = std::max(gpu_max, gpu_ms[i]);
+	}
+
+	ImGui::PlotLines("CPU ms", cpu_ms, (int)count, 0, nullptr, 0.0f, cpu_max, Vec2(0.0f, 40.0f));
+	ImGui::PlotLines("GPU ms", gpu_ms, (int)count, 0, nullptr, 0.0f, gpu_max, Vec2(0.0f, 40.0f));
+
+	// GPU results lag a few frames, so by default show the newest frame
+	// that has both.
+	ImGui::Checkbox("Pause View", &view_paused);
+	ImGui::SameLine();
+	ImGui::SliderInt("Frames Ago", &view_offset, 0, (int)count - 1);
+
+	if(!view_paused) {
+		view_offset = 0;
+		for(size_t i = 0; i < count; i++) {
+			if(frame_at(frame_number - i).gpu_valid) {
+				view_offset = (int)i;
+				break;
+			}
+		}
+	}
+	view_offset = std::max(0, std::min(view_offset, (int)count - 1));
+
+	const Frame& f = frame_at(frame_number - view_offset);
+	flame_graph("CPU", f.cpu, f.cpu_ms);
+	if(f.gpu_valid) {
+		flame_graph("GPU", f.gpu, f.gpu_ms);
+	} else {
+		ImGui::Text("GPU: pending");
+	}
+}
+
+} // namespace Prof
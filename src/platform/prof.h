@@ -0,0 +1,79 @@
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Frame profiler: records nested CPU zones and GPU timer query zones for
+// each frame into a ring buffer, which is displayed by Prof::gui().
+// Zones may also be streamed into per-thread trace buffers and written out
+// as Chrome trace JSON (load it in chrome://tracing or ui.perfetto.dev).
+
+namespace Prof {
+
+/// Set to start/stop recording; takes effect at the next begin_frame()
+inline bool enabled = false;
+/// Whether the current frame is being recorded (only ever set on the main thread)
+inline thread_local bool active = false;
+/// Whether zones on any thread are being captured for trace export
+inline std::atomic<bool> tracing = false;
+
+void begin_frame();
+void end_frame();
+void shutdown();
+
+/// Zone names must be string literals (only the pointer is stored)
+void begin(const char* name);
+void end();
+void gpu_begin(const char* name);
+void gpu_end();
+
+/// Start capturing trace events; they will be written to file by dump_trace()
+void start_trace(std::string file);
+/// Write every event captured so far as Chrome trace JSON. Returns an error
+/// message on failure. Safe to call while other threads are recording.
+std::string dump_trace();
+/// Name the calling thread in exported traces
+void name_thread(const char* name);
+
+/// Nanoseconds since the trace clock started
+uint64_t trace_now();
+/// Append a complete event to the calling thread's trace buffer
+void trace_event(const char* name, uint64_t begin, uint64_t end);
+
+/// Display recorded frames with ImGui
+void gui();
+
+struct Zone {
+	Zone(const char* name) : name(name), frame(active), trace(tracing.load(std::memory_order_relaxed)) {
+		if(frame) begin(name);
+		if(trace) start = trace_now();
+	}
+	~Zone() {
+		if(trace) trace_event(name, start, trace_now());
+		if(frame) end();
+	}
+	const char* name;
+	bool frame, trace;
+	uint64_t start = 0;
+};
+
+struct GPU_Zone {
+	GPU_Zone(const char* name) : on(active) {
+		if(on) gpu_begin(name);
+	}
+	~GPU_Zone() {
+		if(on) gpu_end();
+	}
+	bool on;
+};
+}
+
+#define PROF_CAT_(a, b) a##b
+#define PROF_CAT(a, b) PROF_CAT_(a, b)
+
+/// Time the enclosing scope on the CPU
+#define PROF_ZONE(name) Prof::Zone PROF_CAT(prof_zone_, __LINE__)(name)
+/// Time the GL commands issued in the enclosing scope on the GPU
+#define PROF_GPU_ZONE(name) Prof::GPU_Zone PROF_CAT(prof_gpu_zone_, __LINE__)(name)
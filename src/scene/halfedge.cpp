@@ -1,9 +1,12 @@
 
 #include "halfedge.h"
+#include "../platform/prof.h"
 
+#include <cstring>
 #include <map>
 #include <set>
 #include <sstream>
+#include <unordered_map>
 
 Halfedge_Mesh::Halfedge_Mesh(const GL::Mesh& mesh) {
 	from_mesh(mesh);
@@ -37,8 +40,19 @@ void Halfedge_Mesh::clear() {
 	render_dirty_flag = true;
 }
 
+Halfedge_Mesh::Size Halfedge_Mesh::bytes() const {
+	// Each list node also carries its prev/next pointers
+	const Size node = 2 * sizeof(void*);
+	return halfedges.size() * (sizeof(Halfedge) + node) +
+		   vertices.size() * (sizeof(Vertex) + node) +
+		   edges.size() * (sizeof(Edge) + node) +
+		   (faces.size() + boundaries.size()) * (sizeof(Face) + node);
+}
+
 void Halfedge_Mesh::copy_to(Halfedge_Mesh& mesh) const {
 
+	PROF_ZONE("Copy Mesh");
+
 	// Clear any existing elements.
 	mesh.halfedges.clear();
 	mesh.vertices.clear();
@@ -215,6 +229,8 @@ Vec3 Halfedge_Mesh::center_of(Halfedge_Mesh::ElementRef elem) {
 
 void Halfedge_Mesh::index(unsigned int base) {
 
+	PROF_ZONE("Index Mesh");
+
 	unsigned int id = base;
 	for(FaceRef f = faces_begin(); f != faces_end(); f++)
 		f->_id = id++;
@@ -227,9 +243,18 @@ void Halfedge_Mesh::index(unsigned int base) {
 }
 
 void Halfedge_Mesh::to_mesh(GL::Mesh& mesh, bool face_normals) const {
-
 	std::vector<GL::Mesh::Vert> verts;
 	std::vector<GL::Mesh::Index> idxs;
+	to_mesh(verts, idxs, face_normals);
+	mesh.update(std::move(verts), std::move(idxs));
+}
+
+void Halfedge_Mesh::to_mesh(std::vector<GL::Mesh::Vert>& verts, std::vector<GL::Mesh::Index>& idxs, bool face_normals) const {
+
+	PROF_ZONE("To Mesh");
+
+	verts.clear();
+	idxs.clear();
 
 	if(face_normals) {
 		for(FaceCRef f = faces_begin(); f != faces_end(); f++) {
@@ -288,8 +313,6 @@ void Halfedge_Mesh::to_mesh(GL::Mesh& mesh, bool face_normals) const {
 			}
 		}
 	}
-
-	mesh = GL::Mesh(std::move(verts), std::move(idxs));
 }
 
 void Halfedge_Mesh::mark_dirty() {
@@ -298,6 +321,7 @@ void Halfedge_Mesh::mark_dirty() {
 
 std::string Halfedge_Mesh::validate() const {
 	
+	PROF_ZONE("Validate Mesh");
 	if(!check_finite()) return "A vertex position or normal has a non-finite value.";
 
 	std::map<HalfedgeCRef, bool> permutation;
@@ -367,6 +391,65 @@ std::string Halfedge_Mesh::validate() const {
 	return {};
 }
 
+void Halfedge_Mesh::to_poly(std::vector<std::vector<Index>>& polygons, std::vector<GL::Mesh::Vert>& verts,
+							bool split_normals) const {
+
+	PROF_ZONE("To Poly");
+
+	polygons.clear();
+	verts.clear();
+	polygons.reserve(faces.size());
+	verts.reserve(vertices.size());
+
+	std::unordered_map<const Vertex*, Index> vert_to_idx;
+	vert_to_idx.reserve(vertices.size());
+
+	for(VertexCRef v = vertices_begin(); v != vertices_end(); v++) {
+		vert_to_idx[&*v] = verts.size();
+		// Keep the imported normal if there is one
+		Vec3 n = v->norm;
+		if(!n.valid() || n.norm_squared() == 0.0f) n = v->normal();
+		verts.push_back({v->pos, n, v->_id});
+	}
+
+	// Further copies of a vertex with other normals are chained from the first
+	const float crease = 0.5f; // cos(60 degrees)
+	std::vector<Index> next_copy(verts.size(), (Index)-1);
+	std::vector<bool> used(verts.size(), false);
+	// Coplanar faces don't come out with bit-identical normals
+	auto same = [](Vec3 a, Vec3 b) { return dot(a, b) > 0.9999f; };
+
+	for(FaceCRef f = faces_begin(); f != faces_end(); f++) {
+		std::vector<Index> poly;
+		Vec3 face_n = split_normals ? f->normal() : Vec3();
+		HalfedgeCRef h = f->halfedge();
+		do {
+			Index i = vert_to_idx[&*h->vertex()];
+			if(split_normals) {
+				Vec3 n = h->vertex()->norm;
+				if(n.norm_squared() > 0.0f) n = n.unit();
+				if(!n.valid() || n.norm_squared() == 0.0f || dot(n, face_n) < crease) n = face_n;
+				// The first corner claims the original copy
+				if(!used[i]) {
+					verts[i].norm = n;
+					used[i] = true;
+				}
+				while(!same(verts[i].norm, n) && next_copy[i] != (Index)-1) i = next_copy[i];
+				if(!same(verts[i].norm, n)) {
+					next_copy[i] = verts.size();
+					i = verts.size();
+					verts.push_back({h->vertex()->pos, n, h->vertex()->_id});
+					next_copy.push_back((Index)-1);
+					used.push_back(true);
+				}
+			}
+			poly.push_back(i);
+			h = h->next();
+		} while(h != f->halfedge());
+		polygons.push_back(std::move(poly));
+	}
+}
+
 std::string Halfedge_Mesh::from_mesh(const GL::Mesh& mesh) {
 	
 	std::vector<std::vector<Index>> poly;
@@ -421,6 +504,8 @@ Halfedge_Mesh::FaceCRef Halfedge_Mesh::face_by_idx(unsigned int idx) const {
 
 
 std::string Halfedge_Mesh::from_poly(const std::vector<std::vector<Index>>& polygons, const std::vector<GL::Mesh::Vert>& verts) {
+
+	PROF_ZONE("Build Mesh");
 	
 	// This method initializes the halfedge data structure from a raw list of
 	// polygons, where each input polygon is specified as a list of vertex indices.
@@ -776,3 +861,164 @@ std::string Halfedge_Mesh::from_poly(const std::vector<std::vector<Index>>& poly
 	}
 	return {};
 }
+
+namespace {
+struct Flat_Counts {
+	uint32_t vertices, edges, faces, boundaries, halfedges, pad;
+};
+struct Flat_Vertex {
+	Vec3 pos, norm;
+	uint32_t halfedge;
+};
+struct Flat_Halfedge {
+	uint32_t twin, next, vertex, edge, face;
+};
+static_assert(sizeof(Flat_Vertex) == 28 && sizeof(Flat_Halfedge) == 20, "Flat mesh layout changed");
+}
+
+void Halfedge_Mesh::write_flat(std::vector<unsigned char>& out) const {
+
+	PROF_ZONE("Write Flat Mesh");
+
+	// Number elements within each list (boundaries after faces). This runs
+	// on the journal writer while the mesh may be read elsewhere, so the
+	// numbering goes in side tables rather than the id field.
+	std::unordered_map<const Vertex*, uint32_t> vert_idx;
+	std::unordered_map<const Edge*, uint32_t> edge_idx;
+	std::unordered_map<const Face*, uint32_t> face_idx;
+	std::unordered_map<const Halfedge*, uint32_t> half_idx;
+
+	auto number = [&](const auto& list, auto& idx, uint32_t start) {
+		idx.reserve(idx.size() + list.size());
+		uint32_t i = start;
+		for(const auto& elem : list) idx[&elem] = i++;
+	};
+	number(vertices, vert_idx, 0);
+	number(edges, edge_idx, 0);
+	number(faces, face_idx, 0);
+	number(boundaries, face_idx, (uint32_t)faces.size());
+	number(halfedges, half_idx, 0);
+
+	Flat_Counts counts = {(uint32_t)vertices.size(), (uint32_t)edges.size(), (uint32_t)faces.size(),
+						  (uint32_t)boundaries.size(), (uint32_t)halfedges.size(), 0};
+
+	size_t start = out.size();
+	out.resize(start + sizeof(Flat_Counts) + counts.vertices * sizeof(Flat_Vertex) +
+			   (counts.edges + counts.faces + counts.boundaries) * sizeof(uint32_t) +
+			   counts.halfedges * sizeof(Flat_Halfedge));
+	unsigned char* dst = out.data() + start;
+
+	auto put = [&](const auto& value) {
+		std::memcpy(dst, &value, sizeof(value));
+		dst += sizeof(value);
+	};
+
+	put(counts);
+	for(const Vertex& v : vertices) put(Flat_Vertex{v.pos, v.norm, half_idx[&*v._halfedge]});
+	for(const Edge& e : edges) put(half_idx[&*e._halfedge]);
+	for(const Face& f : faces) put(half_idx[&*f._halfedge]);
+	for(const Face& b : boundaries) put(half_idx[&*b._halfedge]);
+	for(const Halfedge& h : halfedges) {
+		put(Flat_Halfedge{half_idx[&*h._twin], half_idx[&*h._next], vert_idx[&*h._vertex],
+						  edge_idx[&*h._edge], face_idx[&*h._face]});
+	}
+}
+
+std::string Halfedge_Mesh::read_flat(const unsigned char* data, size_t size, size_t& used) {
+
+	PROF_ZONE("Read Flat Mesh");
+
+	clear();
+	used = 0;
+
+	Flat_Counts counts;
+	if(size < sizeof(counts)) return "Mesh data is truncated.";
+	std::memcpy(&counts, data, sizeof(counts));
+
+	size_t bytes = sizeof(Flat_Counts) + (size_t)counts.vertices * sizeof(Flat_Vertex) +
+				   ((size_t)counts.edges + counts.faces + counts.boundaries) * sizeof(uint32_t) +
+				   (size_t)counts.halfedges * sizeof(Flat_Halfedge);
+	if(size < bytes) return "Mesh data is truncated.";
+
+	const unsigned char* src = data + sizeof(Flat_Counts);
+	const Flat_Vertex* flat_verts = reinterpret_cast<const Flat_Vertex*>(src);
+	src += counts.vertices * sizeof(Flat_Vertex);
+	const uint32_t* flat_edges = reinterpret_cast<const uint32_t*>(src);
+	const uint32_t* flat_faces = flat_edges + counts.edges; // Then the boundaries
+	src += ((size_t)counts.edges + counts.faces + counts.boundaries) * sizeof(uint32_t);
+	const Flat_Halfedge* flat_halfedges = reinterpret_cast<const Flat_Halfedge*>(src);
+
+	// Check the links before building anything, so that traversals can't
+	// run off or loop forever: next must be a permutation and twin an
+	// involution without fixed points (so every face and vertex walk is a
+	// cycle), each walk must stay on its element, and each element's
+	// halfedge must point back at it. This is linear, unlike validate(),
+	// which also checks the geometry and manifoldness.
+	std::string bad = "Mesh data has an out of range element index.";
+	std::string broken = "Mesh data has inconsistent element links.";
+	uint32_t n_faces = counts.faces + counts.boundaries;
+	std::vector<unsigned char> has_prev(counts.halfedges);
+	for(uint32_t i = 0; i < counts.halfedges; i++) {
+		const Flat_Halfedge& fh = flat_halfedges[i];
+		if(fh.twin >= counts.halfedges || fh.next >= counts.halfedges || fh.vertex >= counts.vertices ||
+		   fh.edge >= counts.edges || fh.face >= n_faces)
+			return bad;
+		const Flat_Halfedge& twin = flat_halfedges[fh.twin];
+		if(fh.twin == i || twin.twin != i || twin.edge != fh.edge || has_prev[fh.next]) return broken;
+		has_prev[fh.next] = 1;
+	}
+	for(uint32_t i = 0; i < counts.halfedges; i++) {
+		// Each face walk stays on one face, and each vertex walk around one vertex
+		const Flat_Halfedge& fh = flat_halfedges[i];
+		if(flat_halfedges[fh.next].face != fh.face ||
+		   flat_halfedges[flat_halfedges[fh.twin].next].vertex != fh.vertex)
+			return broken;
+	}
+	for(uint32_t i = 0; i < counts.vertices; i++) {
+		uint32_t h = flat_verts[i].halfedge;
+		if(h >= counts.halfedges) return bad;
+		if(flat_halfedges[h].vertex != i) return broken;
+	}
+	for(uint32_t i = 0; i < counts.edges; i++) {
+		if(flat_edges[i] >= counts.halfedges) return bad;
+		if(flat_halfedges[flat_edges[i]].edge != i) return broken;
+	}
+	for(uint32_t i = 0; i < n_faces; i++) {
+		if(flat_faces[i] >= counts.halfedges) return bad;
+		if(flat_halfedges[flat_faces[i]].face != i) return broken;
+	}
+
+	// Allocate every element up front so indices can be resolved directly
+	std::vector<HalfedgeRef> h_refs(counts.halfedges);
+	std::vector<VertexRef> v_refs(counts.vertices);
+	std::vector<EdgeRef> e_refs(counts.edges);
+	std::vector<FaceRef> f_refs(n_faces);
+
+	for(auto& h : h_refs) h = new_halfedge();
+	for(auto& v : v_refs) v = new_vertex();
+	for(auto& e : e_refs) e = new_edge();
+	for(uint32_t i = 0; i < counts.faces; i++) f_refs[i] = new_face();
+	for(uint32_t i = 0; i < counts.boundaries; i++) f_refs[counts.faces + i] = new_boundary();
+
+	for(uint32_t i = 0; i < counts.vertices; i++) {
+		const Flat_Vertex& fv = flat_verts[i];
+		v_refs[i]->pos = fv.pos;
+		v_refs[i]->norm = fv.norm;
+		v_refs[i]->_halfedge = h_refs[fv.halfedge];
+	}
+	for(uint32_t i = 0; i < counts.edges; i++) {
+		e_refs[i]->_halfedge = h_refs[flat_edges[i]];
+	}
+	// Boundaries follow the faces
+	for(uint32_t i = 0; i < n_faces; i++) {
+		f_refs[i]->_halfedge = h_refs[flat_faces[i]];
+	}
+	for(uint32_t i = 0; i < counts.halfedges; i++) {
+		const Flat_Halfedge& fh = flat_halfedges[i];
+		h_refs[i]->set_neighbors(h_refs[fh.next], h_refs[fh.twin], v_refs[fh.vertex], e_refs[fh.edge],
+								 f_refs[fh.face]);
+	}
+
+	used = bytes;
+	return {};
+}
@@ -348,11 +348,27 @@ public:
 	void index(unsigned int base);
 	/// Export to renderable vertex-index mesh. Indexes the mesh.
 	void to_mesh(GL::Mesh& mesh, bool face_normals) const;
+	/// The CPU half of to_mesh, which doesn't touch GL and so can run on any thread
+	void to_mesh(std::vector<GL::Mesh::Vert>& verts, std::vector<GL::Mesh::Index>& idxs, bool face_normals) const;
 	/// Create mesh from polygon list
 	std::string from_poly(const std::vector<std::vector<Index>>& polygons, const std::vector<GL::Mesh::Vert>& verts);
+	/// Export to shared vertices and polygon list (the inverse of from_poly).
+	/// With split_normals, a vertex is written once per distinct normal of its
+	/// corners, so hard edges stay hard; each corner uses the vertex normal
+	/// unless it is missing or far from the face's, and then the face normal.
+	void to_poly(std::vector<std::vector<Index>>& polygons, std::vector<GL::Mesh::Vert>& verts,
+				 bool split_normals = false) const;
 	/// Create mesh from renderable triangle mesh (beware of connectivity, does not de-duplicate vertices)
 	std::string from_mesh(const GL::Mesh& mesh);
 
+	/// Append the connectivity and geometry to out as flat index arrays, in list order
+	void write_flat(std::vector<unsigned char>& out) const;
+	/// Rebuild the mesh from data produced by write_flat (4-byte aligned).
+	/// Sets used to the number of bytes consumed. Indices and links are
+	/// checked, so the result is always safe to traverse; validate() still
+	/// catches bad geometry but is too slow to run on every load.
+	std::string read_flat(const unsigned char* data, size_t size, size_t& used);
+
 	/*
 		These methods delete a specified mesh element. One should think very, very carefully about
 		exactly when and how to delete mesh elements, since other elements will often still point
@@ -427,6 +443,8 @@ public:
 	Size n_edges() const {return edges.size();};
 	Size n_faces() const {return faces.size();};
 	Size n_halfedges() const {return halfedges.size();};
+	/// Approximate heap memory used by the element lists
+	Size bytes() const;
 
 	VertexCRef vert_by_idx(unsigned int idx) const;
 	EdgeCRef edge_by_idx(unsigned int idx) const;
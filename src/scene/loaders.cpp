@@ -0,0 +1,544 @@
+
+#include "loaders.h"
+#include "../platform/file.h"
+#include "../platform/prof.h"
+#include "../lib/jobs.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace Loaders {
+
+// Files smaller than this are parsed on one thread
+static const size_t min_chunk = 1 << 20;
+
+static size_t n_chunks(size_t size) {
+	size_t n = Jobs::n_threads();
+	return std::max((size_t)1, std::min(n * 4, size / min_chunk));
+}
+
+static bool has_extension(const std::string& file, const std::string& ext) {
+	if(file.size() < ext.size()) return false;
+	for(size_t i = 0; i < ext.size(); i++) {
+		if(tolower(file[file.size() - ext.size() + i]) != ext[i]) return false;
+	}
+	return true;
+}
+
+/// Area weighted vertex normals, for files that don't store any
+static void smooth_normals(Scene_Object::Polygons& polys) {
+
+	PROF_ZONE("Smooth Normals");
+
+	for(auto& v : polys.verts) v.norm = Vec3();
+
+	size_t start = 0;
+	for(unsigned int n : polys.sizes) {
+		const unsigned int* face = polys.indices.data() + start;
+		start += n;
+		Vec3 v0 = polys.verts[face[0]].pos;
+		for(unsigned int i = 1; i + 1 < n; i++) {
+			Vec3 v1 = polys.verts[face[i]].pos;
+			Vec3 v2 = polys.verts[face[i + 1]].pos;
+			Vec3 c = cross(v1 - v0, v2 - v0);
+			polys.verts[face[0]].norm += c;
+			polys.verts[face[i]].norm += c;
+			polys.verts[face[i + 1]].norm += c;
+		}
+	}
+
+	for(auto& v : polys.verts) {
+		if(v.norm.norm_squared() > 0.0f) v.norm = v.norm.unit();
+	}
+}
+
+static const char* skip_space(const char* p, const char* end) {
+	while(p < end && (*p == ' ' || *p == '\t')) p++;
+	return p;
+}
+
+static const char* skip_line(const char* p, const char* end) {
+	while(p < end && *p != '\n') p++;
+	return p < end ? p + 1 : end;
+}
+
+static bool is_digit(char c) {
+	return c >= '0' && c <= '9';
+}
+
+static bool parse_int(const char*& p, const char* end, long long& out) {
+	bool neg = false;
+	if(p < end && (*p == '-' || *p == '+')) neg = *p++ == '-';
+	if(p == end || !is_digit(*p)) return false;
+	long long v = 0;
+	while(p < end && is_digit(*p)) v = v * 10 + (*p++ - '0');
+	out = neg ? -v : v;
+	return true;
+}
+
+/// Plain decimal/exponent notation only, which is all OBJ exporters write.
+/// Works on the unterminated mapped file, unlike strtof.
+static bool parse_float(const char*& p, const char* end, float& out) {
+
+	static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+								   1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+	bool neg = false;
+	if(p < end && (*p == '-' || *p == '+')) neg = *p++ == '-';
+
+	unsigned long long mantissa = 0;
+	int digits = 0, exp = 0;
+	bool any = false;
+
+	for(; p < end && is_digit(*p); p++, any = true) {
+		if(digits < 19) { mantissa = mantissa * 10 + (*p - '0'); if(mantissa) digits++; }
+		else exp++;
+	}
+	if(p < end && *p == '.') {
+		p++;
+		for(; p < end && is_digit(*p); p++, any = true) {
+			if(digits < 19) { mantissa = mantissa * 10 + (*p - '0'); if(mantissa) digits++; exp--; }
+		}
+	}
+	if(!any) return false;
+
+	if(p < end && (*p == 'e' || *p == 'E')) {
+		p++;
+		long long e = 0;
+		if(!parse_int(p, end, e)) return false;
+		exp += (int)std::max(std::min(e, 1000ll), -1000ll);
+	}
+
+	double v = (double)mantissa;
+	if(exp < 0) v = exp >= -22 ? v / pow10[-exp] : v * std::pow(10.0, exp);
+	else if(exp > 0) v = exp <= 22 ? v * pow10[exp] : v * std::pow(10.0, exp);
+	out = (float)(neg ? -v : v);
+	return true;
+}
+
+// OBJ: each chunk of lines is parsed independently; chunks are stitched
+// together in file order afterwards. Indices are absolute, so they don't
+// depend on where a chunk starts.
+struct Obj_Chunk {
+	const char *begin, *end;
+	std::vector<Vec3> positions;
+	std::vector<long long> indices;
+	std::vector<unsigned int> sizes;
+	std::vector<std::pair<size_t, std::string>> objects; // first face, name
+	bool relative = false;
+	std::string error;
+};
+
+static void parse_obj_chunk(Obj_Chunk& chunk) {
+
+	PROF_ZONE("Parse OBJ Chunk");
+
+	const char* p = chunk.begin;
+	const char* end = chunk.end;
+
+	while(p < end) {
+
+		p = skip_space(p, end);
+		if(p + 1 >= end) break;
+
+		if(p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+			p += 2;
+			Vec3 v;
+			for(int i = 0; i < 3; i++) {
+				p = skip_space(p, end);
+				if(!parse_float(p, end, v[i])) {
+					chunk.error = "Malformed vertex.";
+					return;
+				}
+			}
+			chunk.positions.push_back(v);
+
+		} else if(p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+			p += 2;
+			unsigned int n = 0;
+			while(true) {
+				p = skip_space(p, end);
+				if(p == end || *p == '\n' || *p == '\r') break;
+				long long idx;
+				if(!parse_int(p, end, idx) || idx == 0) {
+					chunk.error = "Malformed face.";
+					return;
+				}
+				if(idx < 0) {
+					chunk.relative = true;
+					return;
+				}
+				// Skip texture coordinate and normal indices
+				while(p < end && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') p++;
+				chunk.indices.push_back(idx - 1);
+				n++;
+			}
+			chunk.sizes.push_back(n);
+
+		} else if(p[0] == 'o' && (p[1] == ' ' || p[1] == '\t')) {
+			const char* name = skip_space(p + 2, end);
+			const char* name_end = name;
+			while(name_end < end && *name_end != '\n' && *name_end != '\r') name_end++;
+			while(name_end > name && (name_end[-1] == ' ' || name_end[-1] == '\t')) name_end--;
+			chunk.objects.push_back({chunk.sizes.size(), std::string(name, name_end)});
+		}
+
+		p = skip_line(p, end);
+	}
+}
+
+static bool load_obj(const Mapped_File& map, std::vector<Mesh>& meshes, std::string& error) {
+
+	PROF_ZONE("Load OBJ");
+
+	const char* data = (const char*)map.data();
+	size_t size = map.size();
+
+	// Split at line boundaries
+	size_t n = n_chunks(size);
+	std::vector<Obj_Chunk> chunks(n);
+	const char* prev = data;
+	for(size_t i = 0; i < n; i++) {
+		const char* end = data + size;
+		if(i + 1 < n) {
+			end = std::max(prev, data + size * (i + 1) / n);
+			while(end < data + size && *end != '\n') end++;
+			if(end < data + size) end++;
+		}
+		chunks[i].begin = prev;
+		chunks[i].end = end;
+		prev = end;
+	}
+
+	Jobs::parallel_for(n, [&](size_t i) { parse_obj_chunk(chunks[i]); });
+
+	std::vector<GL::Mesh::Vert> verts;
+	std::vector<std::pair<size_t, std::string>> objects;
+	size_t n_faces = 0;
+	for(Obj_Chunk& c : chunks) {
+		if(c.relative) return false;
+		if(!c.error.empty()) {
+			error = c.error;
+			return true;
+		}
+		for(Vec3 v : c.positions) verts.push_back({v, {}, 0});
+		for(auto& o : c.objects) objects.push_back({n_faces + o.first, std::move(o.second)});
+		n_faces += c.sizes.size();
+	}
+	if(objects.empty() || objects[0].first != 0) objects.insert(objects.begin(), {0, std::string()});
+	objects.push_back({n_faces, std::string()});
+
+	// Each object gets its own compact vertex list
+	PROF_ZONE("Build Objects");
+	std::vector<unsigned int> remap(verts.size(), ~0u);
+	std::vector<size_t> used;
+	size_t chunk = 0, chunk_face = 0, chunk_idx = 0;
+
+	for(size_t o = 0; o + 1 < objects.size(); o++) {
+
+		size_t faces = objects[o + 1].first - objects[o].first;
+		if(!faces) continue;
+
+		Mesh mesh;
+		mesh.name = objects[o].second;
+		Scene_Object::Polygons& polys = mesh.polys;
+		polys.sizes.reserve(faces);
+
+		for(size_t f = 0; f < faces; f++) {
+			while(chunk_face == chunks[chunk].sizes.size()) {
+				chunk++;
+				chunk_face = chunk_idx = 0;
+			}
+			const Obj_Chunk& c = chunks[chunk];
+			unsigned int size = c.sizes[chunk_face++];
+			if(size < 3) {
+				error = "Each polygon must have at least three vertices.";
+				return true;
+			}
+			for(unsigned int i = 0; i < size; i++) {
+				long long idx = c.indices[chunk_idx++];
+				if(idx >= (long long)verts.size()) {
+					error = "Vertex index " + std::to_string(idx + 1) + " out of range.";
+					return true;
+				}
+				unsigned int& local = remap[idx];
+				if(local == ~0u) {
+					local = (unsigned int)polys.verts.size();
+					polys.verts.push_back(verts[idx]);
+					used.push_back((size_t)idx);
+				}
+				polys.indices.push_back(local);
+			}
+			polys.sizes.push_back(size);
+		}
+
+		for(size_t idx : used) remap[idx] = ~0u;
+		used.clear();
+
+		smooth_normals(polys);
+		meshes.push_back(std::move(mesh));
+	}
+	return true;
+}
+
+// Binary PLY: a text header describing elements, each a fixed list of
+// scalar or list properties, followed by the packed data.
+enum class Ply_Type { none, i8, u8, i16, u16, i32, u32, f32, f64 };
+
+struct Ply_Property {
+	std::string name;
+	Ply_Type type = Ply_Type::none;
+	Ply_Type count_type = Ply_Type::none; // Set for list properties
+};
+
+struct Ply_Element {
+	std::string name;
+	size_t count = 0;
+	std::vector<Ply_Property> props;
+};
+
+static Ply_Type ply_type(const std::string& name) {
+	if(name == "char" || name == "int8") return Ply_Type::i8;
+	if(name == "uchar" || name == "uint8") return Ply_Type::u8;
+	if(name == "short" || name == "int16") return Ply_Type::i16;
+	if(name == "ushort" || name == "uint16") return Ply_Type::u16;
+	if(name == "int" || name == "int32") return Ply_Type::i32;
+	if(name == "uint" || name == "uint32") return Ply_Type::u32;
+	if(name == "float" || name == "float32") return Ply_Type::f32;
+	if(name == "double" || name == "float64") return Ply_Type::f64;
+	return Ply_Type::none;
+}
+
+static size_t ply_size(Ply_Type type) {
+	switch(type) {
+	case Ply_Type::i8: case Ply_Type::u8: return 1;
+	case Ply_Type::i16: case Ply_Type::u16: return 2;
+	case Ply_Type::i32: case Ply_Type::u32: case Ply_Type::f32: return 4;
+	case Ply_Type::f64: return 8;
+	default: return 0;
+	}
+}
+
+template<typename T> static T ply_read(const unsigned char* p) {
+	T v;
+	std::memcpy(&v, p, sizeof(T));
+	return v;
+}
+
+static double ply_value(const unsigned char* p, Ply_Type type) {
+	switch(type) {
+	case Ply_Type::i8: return ply_read<int8_t>(p);
+	case Ply_Type::u8: return ply_read<uint8_t>(p);
+	case Ply_Type::i16: return ply_read<int16_t>(p);
+	case Ply_Type::u16: return ply_read<uint16_t>(p);
+	case Ply_Type::i32: return ply_read<int32_t>(p);
+	case Ply_Type::u32: return ply_read<uint32_t>(p);
+	case Ply_Type::f32: return ply_read<float>(p);
+	case Ply_Type::f64: return ply_read<double>(p);
+	default: return 0.0;
+	}
+}
+
+static bool load_ply(const Mapped_File& map, std::vector<Mesh>& meshes, std::string& error) {
+
+	PROF_ZONE("Load PLY");
+
+	// Only little endian hosts read the data in place
+	const uint16_t endian = 1;
+	if(*(const unsigned char*)&endian != 1) return false;
+
+	const char* data = (const char*)map.data();
+	const char* end = data + map.size();
+	const char* p = data;
+
+	auto next_line = [&]() {
+		const char* line = p;
+		p = skip_line(p, end);
+		const char* line_end = p;
+		while(line_end > line && (line_end[-1] == '\n' || line_end[-1] == '\r')) line_end--;
+		std::vector<std::string> words;
+		while(line < line_end) {
+			line = skip_space(line, line_end);
+			const char* word = line;
+			while(line < line_end && *line != ' ' && *line != '\t') line++;
+			if(line > word) words.emplace_back(word, line);
+		}
+		return words;
+	};
+
+	std::vector<std::string> words = next_line();
+	if(words.size() != 1 || words[0] != "ply") return false;
+
+	std::vector<Ply_Element> elements;
+	while(true) {
+		if(p == end) {
+			error = "Truncated PLY header.";
+			return true;
+		}
+		words = next_line();
+		if(words.empty() || words[0] == "comment" || words[0] == "obj_info") continue;
+		if(words[0] == "end_header") break;
+
+		if(words[0] == "format") {
+			// ASCII and big endian files go through Assimp
+			if(words.size() < 2 || words[1] != "binary_little_endian") return false;
+		} else if(words[0] == "element" && words.size() == 3) {
+			Ply_Element e;
+			e.name = words[1];
+			e.count = std::strtoull(words[2].c_str(), nullptr, 10);
+			elements.push_back(e);
+		} else if(words[0] == "property" && !elements.empty()) {
+			Ply_Property prop;
+			if(words.size() == 5 && words[1] == "list") {
+				prop.count_type = ply_type(words[2]);
+				prop.type = ply_type(words[3]);
+				prop.name = words[4];
+				if(prop.count_type == Ply_Type::none) return false;
+			} else if(words.size() == 3) {
+				prop.type = ply_type(words[1]);
+				prop.name = words[2];
+			}
+			if(prop.type == Ply_Type::none) return false;
+			elements.back().props.push_back(prop);
+		} else {
+			return false;
+		}
+	}
+
+	const unsigned char* body = (const unsigned char*)p;
+	const unsigned char* body_end = (const unsigned char*)end;
+
+	Mesh mesh;
+	Scene_Object::Polygons& polys = mesh.polys;
+	bool has_normals = false, has_faces = false;
+
+	for(const Ply_Element& e : elements) {
+
+		bool scalar = true;
+		size_t stride = 0;
+		for(const Ply_Property& prop : e.props) {
+			scalar = scalar && prop.count_type == Ply_Type::none;
+			stride += ply_size(prop.type);
+		}
+
+		if(e.name == "vertex") {
+
+			// Fixed size records, so every vertex can be read independently
+			if(!scalar) return false;
+			if((size_t)(body_end - body) / std::max(stride, (size_t)1) < e.count) {
+				error = "Truncated PLY vertex data.";
+				return true;
+			}
+
+			const char* names[6] = {"x", "y", "z", "nx", "ny", "nz"};
+			size_t offset[6];
+			Ply_Type type[6] = {};
+			for(int i = 0; i < 6; i++) {
+				size_t off = 0;
+				for(const Ply_Property& prop : e.props) {
+					if(prop.name == names[i]) {
+						offset[i] = off;
+						type[i] = prop.type;
+					}
+					off += ply_size(prop.type);
+				}
+			}
+			if(type[0] == Ply_Type::none || type[1] == Ply_Type::none || type[2] == Ply_Type::none) {
+				error = "PLY vertices have no position.";
+				return true;
+			}
+			has_normals = type[3] != Ply_Type::none && type[4] != Ply_Type::none && type[5] != Ply_Type::none;
+
+			polys.verts.resize(e.count);
+			size_t n = std::min(n_chunks(e.count * stride), e.count);
+			Jobs::parallel_for(n, [&](size_t c) {
+				PROF_ZONE("Parse PLY Vertices");
+				size_t begin = e.count * c / n, last = e.count * (c + 1) / n;
+				for(size_t i = begin; i < last; i++) {
+					const unsigned char* v = body + i * stride;
+					GL::Mesh::Vert& out = polys.verts[i];
+					for(int j = 0; j < 3; j++) {
+						out.pos[j] = (float)ply_value(v + offset[j], type[j]);
+					}
+					if(has_normals) {
+						for(int j = 0; j < 3; j++) {
+							out.norm[j] = (float)ply_value(v + offset[j + 3], type[j + 3]);
+						}
+					}
+					out.id = 0;
+				}
+			});
+			body += e.count * stride;
+			continue;
+		}
+
+		// Faces (and anything else) have to be walked one record at a time
+		bool faces = e.name == "face";
+		has_faces = has_faces || faces;
+		if(faces) polys.sizes.reserve(e.count);
+
+		for(size_t i = 0; i < e.count; i++) {
+			for(const Ply_Property& prop : e.props) {
+
+				size_t count = 1;
+				if(prop.count_type != Ply_Type::none) {
+					size_t cs = ply_size(prop.count_type);
+					if((size_t)(body_end - body) < cs) {
+						error = "Truncated PLY " + e.name + " data.";
+						return true;
+					}
+					count = (size_t)ply_value(body, prop.count_type);
+					body += cs;
+				}
+
+				size_t bytes = count * ply_size(prop.type);
+				if((size_t)(body_end - body) < bytes) {
+					error = "Truncated PLY " + e.name + " data.";
+					return true;
+				}
+
+				if(faces && (prop.name == "vertex_indices" || prop.name == "vertex_index")) {
+					if(count < 3) {
+						error = "Each polygon must have at least three vertices.";
+						return true;
+					}
+					for(size_t j = 0; j < count; j++) {
+						double idx = ply_value(body + j * ply_size(prop.type), prop.type);
+						if(idx < 0.0 || idx >= (double)polys.verts.size()) {
+							error = "Vertex index " + std::to_string((long long)idx) + " out of range.";
+							return true;
+						}
+						polys.indices.push_back((unsigned int)idx);
+					}
+					polys.sizes.push_back((unsigned int)count);
+				}
+				body += bytes;
+			}
+		}
+		if(faces) break;
+	}
+
+	// Point clouds have nothing to edit
+	if(!has_faces || polys.sizes.empty()) return false;
+
+	if(!has_normals) smooth_normals(polys);
+	meshes.push_back(std::move(mesh));
+	return true;
+}
+
+bool load(std::string file, std::vector<Mesh>& meshes, std::string& error) {
+
+	bool obj = has_extension(file, ".obj");
+	if(!obj && !has_extension(file, ".ply")) return false;
+
+	Mapped_File map;
+	error = map.open(file);
+	if(!error.empty()) return true;
+
+	bool handled = obj ? load_obj(map, meshes, error) : load_ply(map, meshes, error);
+	if(!handled) meshes.clear();
+	else if(!error.empty()) error = "Parsing scene " + file + ": " + error;
+	return handled;
+}
+}
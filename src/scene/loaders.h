@@ -0,0 +1,22 @@
+
+#pragma once
+
+#include "scene.h"
+
+#include <string>
+#include <vector>
+
+/// Dedicated importers for raw scan data, where Assimp's vertex joining and
+/// degenerate removal dominate load time. Both formats are already indexed,
+/// so the file is mapped and parsed in parallel straight into polygons.
+namespace Loaders {
+
+	struct Mesh {
+		std::string name;
+		Scene_Object::Polygons polys;
+	};
+
+	/// Handles .obj and binary .ply files. Returns false if the file should go
+	/// through Assimp instead; otherwise error is set if loading failed.
+	bool load(std::string file, std::vector<Mesh>& meshes, std::string& error);
+}
@@ -3,22 +3,52 @@
 #include "util.h"
 #include "../gui.h"
 #include "../lib/math.h"
+#include "../platform/prof.h"
+#include "../lib/jobs.h"
 
 #include <imgui/imgui.h>
 
 Renderer::Renderer(Vec2 dim) :
 	samples(4),
 	window_dim(dim),
-	id_buffer(new GLubyte[(int)dim.x * (int)dim.y * 4]),
-	framebuffer(2, dim, samples, true),
-	id_resolve(1, dim, 1, false),
-    mesh_shader(GL::Shaders::mesh_v, GL::Shaders::mesh_f),
-	line_shader(GL::Shaders::line_v, GL::Shaders::line_f),
-	inst_shader(GL::Shaders::inst_v, GL::Shaders::mesh_f),
+	id_buffer(new GLuint[(int)dim.x * (int)dim.y]),
+	framebuffer(2, dim, samples, true, 1),
+	id_resolve(1, dim, 1, false, 0),
+	mesh_shader(with_frame(GL::Shaders::mesh_v), with_frame(GL::Shaders::mesh_f)),
+	line_shader(with_frame(GL::Shaders::line_v), GL::Shaders::line_f),
+	inst_shader(with_frame(GL::Shaders::inst_v), with_frame(GL::Shaders::mesh_f)),
+	frame_block("Frame", 0, sizeof(Frame)),
 	spheres(Util::sphere_mesh(0.05f, 1)),
 	cylinders(Util::cyl_mesh(0.05f, 1.0f)),
 	arrows(Util::arrow_mesh(0.05f, 0.1f, 1.0f))
-{}
+{
+	mesh_shader.use_block(frame_block);
+	line_shader.use_block(frame_block);
+	inst_shader.use_block(frame_block);
+
+	mesh_u.use_v_id = mesh_shader.get<bool>("use_v_id");
+	mesh_u.solid = mesh_shader.get<bool>("solid");
+	mesh_u.id = mesh_shader.get<GLuint>("id");
+	mesh_u.sel_id = mesh_shader.get<GLuint>("sel_id");
+	mesh_u.hov_id = mesh_shader.get<GLuint>("hov_id");
+	mesh_u.modelview = mesh_shader.get<Mat4>("modelview");
+	mesh_u.normal = mesh_shader.get<Mat4>("normal");
+	mesh_u.color = mesh_shader.get<Vec3>("color");
+
+	inst_u.use_v_id = inst_shader.get<bool>("use_v_id");
+	inst_u.use_i_id = inst_shader.get<bool>("use_i_id");
+	inst_u.solid = inst_shader.get<bool>("solid");
+	inst_u.sel_id = inst_shader.get<GLuint>("sel_id");
+	inst_u.hov_id = inst_shader.get<GLuint>("hov_id");
+	inst_u.modelview = inst_shader.get<Mat4>("modelview");
+	inst_u.color = inst_shader.get<Vec3>("color");
+}
+
+std::string Renderer::with_frame(const std::string& src) {
+	// The block has to follow the #version line
+	size_t line = src.find('\n', src.find("#version")) + 1;
+	return src.substr(0, line) + frame_glsl + src.substr(line);
+}
 
 Renderer::~Renderer() {
 	delete[] id_buffer;
@@ -33,9 +63,28 @@ void Renderer::update_dim(Vec2 dim) {
 	assert(data);
 	data->window_dim = dim;
 	delete[] data->id_buffer;
-	data->id_buffer = new GLubyte[(int)dim.x * (int)dim.y * 4]();
+	data->id_buffer = new GLuint[(int)dim.x * (int)dim.y]();
 	data->framebuffer.resize(dim, data->samples);
 	data->id_resolve.resize(dim);
+	invalidate();
+}
+
+void Renderer::invalidate() {
+	assert(data);
+	data->redraw = true;
+}
+
+bool Renderer::check_redraw() {
+	assert(data);
+	bool ret = data->redraw;
+	data->redraw = false;
+	return ret;
+}
+
+bool Renderer::continuous() {
+	assert(data);
+	// Keep the profiler graphs live while it is recording
+	return data->redraw_continuous || Prof::enabled;
 }
 
 void Renderer::shutdown() {
@@ -43,13 +92,15 @@ void Renderer::shutdown() {
 	data = nullptr;
 }
 
-void Renderer::proj(Mat4 proj) {
+void Renderer::frame(Mat4 proj, Mat4 viewproj) {
 	assert(data);
-	data->_proj = proj;
+	Frame f = {proj, viewproj, Vec4(Gui::Color::outline, 1.0f), Vec4(Gui::Color::hover, 1.0f)};
+	data->frame_block.update(&f);
 }
 
 void Renderer::complete() {
 	assert(data);
+	PROF_GPU_ZONE("Resolve");
 	data->framebuffer.blit_to(1, data->id_resolve, false);
 	
 	if(!data->id_resolve.can_read_at())
@@ -60,48 +111,79 @@ void Renderer::complete() {
 
 void Renderer::begin() {
 	assert(data);
+	data->state_counts = GL::take_state_counts();
+	PROF_GPU_ZONE("Clear");
 	data->framebuffer.clear(0, Vec4(Gui::Color::background, 1.0f));
-	data->framebuffer.clear(1, {0.0f, 0.0f, 0.0f, 1.0f});
+	data->framebuffer.clear_id(1);
 	data->framebuffer.clear_d();
 	data->framebuffer.bind();
 }
 
-void Renderer::lines(const GL::Lines& lines, Mat4 viewproj, float alpha) {
+void Renderer::lines(const GL::Lines& lines, float alpha) {
 	assert(data);
 	data->line_shader.bind();
-	data->line_shader.uniform("viewproj", viewproj);
 	data->line_shader.uniform("alpha", alpha);
 	lines.render(data->framebuffer.is_multisampled());
 }
 
 void Renderer::mesh(const GL::Mesh& mesh, Renderer::MeshOpt opt) {
 	assert(data);
-    data->mesh_shader.bind();
-	data->mesh_shader.uniform("use_v_id", opt.per_vert_id);
-	data->mesh_shader.uniform("id", opt.id);
-	data->mesh_shader.uniform("mvp", data->_proj * opt.modelview);
-	data->mesh_shader.uniform("normal", Mat4::transpose(Mat4::inverse(opt.modelview)));
-	data->mesh_shader.uniform("solid", opt.solid_color);
-	data->mesh_shader.uniform("sel_color", opt.sel_color);
-	data->mesh_shader.uniform("sel_id", opt.sel_id);
-	data->mesh_shader.uniform("hov_color", opt.hov_color);
-	data->mesh_shader.uniform("hov_id", opt.hov_id);
+	const GL::Shader& shader = data->mesh_shader;
+	const Mesh_Uniforms& u = data->mesh_u;
+	shader.bind();
+	shader.uniform(u.use_v_id, opt.per_vert_id);
+	shader.uniform(u.id, opt.id);
+	shader.uniform(u.modelview, opt.modelview);
+	shader.uniform(u.normal, Mat4::transpose(Mat4::inverse_affine(opt.modelview)));
+	shader.uniform(u.solid, opt.solid_color);
+	shader.uniform(u.sel_id, opt.sel_id);
+	shader.uniform(u.hov_id, opt.hov_id);
 	
 	if(opt.depth_only) GL::color_mask(false);
 
 	if(opt.wireframe) {
-		data->mesh_shader.uniform("color", Vec3());
+		shader.uniform(u.color, Vec3());
 		GL::enable(GL::Opt::wireframe);
 		mesh.render();
 		GL::disable(GL::Opt::wireframe);
 	}
 
-	data->mesh_shader.uniform("color", opt.color);
+	shader.uniform(u.color, opt.color);
 	mesh.render();
 
 	if(opt.depth_only) GL::color_mask(true);
 }
 
+void Renderer::batch(const GL::Batch& batch, const std::vector<size_t>& entries, Mat4 view, Vec3 color) {
+	assert(data);
+	const GL::Shader& shader = data->mesh_shader;
+	const Mesh_Uniforms& u = data->mesh_u;
+	shader.bind();
+	shader.uniform(u.use_v_id, true);
+	shader.uniform(u.modelview, view);
+	shader.uniform(u.normal, Mat4::transpose(Mat4::inverse_rigid(view)));
+	shader.uniform(u.solid, false);
+	shader.uniform(u.sel_id, 0u);
+	shader.uniform(u.hov_id, 0u);
+	shader.uniform(u.color, color);
+	batch.render(entries);
+}
+
+void Renderer::instances(GL::Instances& inst, Mat4 view, Vec3 color) {
+	assert(data);
+	const GL::Shader& shader = data->inst_shader;
+	const Inst_Uniforms& u = data->inst_u;
+	shader.bind();
+	shader.uniform(u.use_v_id, true);
+	shader.uniform(u.use_i_id, true);
+	shader.uniform(u.solid, false);
+	shader.uniform(u.modelview, view);
+	shader.uniform(u.color, color);
+	shader.uniform(u.sel_id, 0u);
+	shader.uniform(u.hov_id, 0u);
+	inst.render();
+}
+
 void Renderer::settings_gui(bool* open) {
 	assert(data);
 	ImGui::Begin("Display Settings", open, ImGuiWindowFlags_AlwaysAutoResize | ImGuiWindowFlags_NoSavedSettings);
@@ -112,11 +194,18 @@ void Renderer::settings_gui(bool* open) {
 
 	if(ImGui::Button("Apply")) {
 		data->framebuffer.resize(data->window_dim, data->samples);
+		invalidate();
 	}
 
+	if(ImGui::Checkbox("Redraw Continuously", &data->redraw_continuous)) invalidate();
+
 	ImGui::Separator();
 	ImGui::Text("GPU: %s", GL::renderer().c_str());
 	ImGui::Text("OpenGL: %s", GL::version().c_str());
+	ImGui::Text("State changes: %zu issued, %zu skipped", data->state_counts.issued, data->state_counts.skipped);
+
+	ImGui::Separator();
+	Prof::gui();
 
 	ImGui::End();
 }
@@ -126,24 +215,19 @@ Scene_Object::ID Renderer::read_id(Vec2 pos) {
 	int x = (int)pos.x;
 	int y = (int)(data->window_dim.y - pos.y - 1);
 
+	int w = (int)data->window_dim.x, h = (int)data->window_dim.y;
+	if(x < 0 || y < 0 || x >= w || y >= h) return 0;
+
 	if(data->id_resolve.can_read_at()) {
 
-		GLubyte read[4] = {};
-		data->id_resolve.read_at(0, x, y, read);
-		return (int)read[0] | (int)read[1] << 8 | (int)read[2] << 16;
+		GLuint read = 0;
+		data->id_resolve.read_at(0, x, y, &read);
+		return read;
 
 	} else {
 		
-		int idx = y * (int)data->window_dim.x * 4 + x * 4;
-		assert(data && idx > 0 && idx <= data->window_dim.x * data->window_dim.y * 4);
-	
-		int a = data->id_buffer[idx];
-		int b = data->id_buffer[idx + 1];
-		int c = data->id_buffer[idx + 2];
-
-		return a | b << 8 | c << 16;
+		return data->id_buffer[y * w + x];
 	}
-	return 0;
 }
 
 void Renderer::set_he_select(Halfedge_Mesh::ElementRef elem) {
@@ -249,19 +333,16 @@ bool Renderer::apply_transform(Gui::Action action, Pose delta) {
 					h->vertex()->pos += off;
 					h = h->next();
 				} while(h != face->halfedge());
-			} else if(action == Gui::Action::rotate) {
-				Quat q = Quat::euler(delta.euler);
-				int i = 0;
-				do {
-					h->vertex()->pos = q.rotate(data->first_t.verts[i] - center) + center;
-					h = h->next();
-					i++;
-				} while(h != face->halfedge());
-			} else if(action == Gui::Action::scale) {
-				Mat4 s = Mat4::scale(delta.scale);
+			} else if(action == Gui::Action::rotate || action == Gui::Action::scale) {
+				// Transform every vertex of the face about its center in one batch
+				Mat4 t = action == Gui::Action::rotate ? Quat::euler(delta.euler).to_mat()
+													   : Mat4::scale(delta.scale);
+				t = Mat4::translate(center) * t * Mat4::translate(-center);
+				std::vector<Vec3> verts(data->first_t.verts.size());
+				t.transform_points(data->first_t.verts.data(), verts.data(), verts.size());
 				int i = 0;
 				do {
-					h->vertex()->pos = s * (data->first_t.verts[i] - center) + center;
+					h->vertex()->pos = verts[i];
 					h = h->next();
 					i++;
 				} while(h != face->halfedge());
@@ -283,6 +364,11 @@ void Renderer::dirty() {
 	assert(data);
 	assert(data->loaded_mesh);
 	data->loaded_mesh->render_dirty_flag = true;
+	invalidate();
+}
+
+void Renderer::forget(const Halfedge_Mesh& mesh) {
+	if(data && data->loaded_mesh == &mesh) data->loaded_mesh = nullptr;
 }
 
 void Renderer::set_he_hover(Vec2 mouse) {
@@ -297,6 +383,7 @@ void Renderer::reset_depth() {
 
 void Renderer::outline(Mat4 viewproj, Mat4 view, Scene_Object& obj) {
 	assert(data);
+	PROF_GPU_ZONE("Outline");
 	data->framebuffer.clear_d();
 	obj.render_mesh(view, false, true);
 
@@ -308,6 +395,20 @@ void Renderer::outline(Mat4 viewproj, Mat4 view, Scene_Object& obj) {
 						 max + Vec2(3.0f / data->window_dim.y));
 }
 
+// Same frame as Mat4::axes for an edge along dir, falling back to the identity
+// (and flipping the length) when dir is parallel to the y axis.
+static Mat4 align_y(Vec3 dir, float& l) {
+	Mat4 rot;
+	Vec3 x = cross(dir, {0.0f, 1.0f, 0.0f}).unit();
+	Vec3 z = cross(x, dir).unit();
+	if(x.valid()) {
+		rot = Mat4::axes(x, dir, z);
+	} else if(dir.y == -1.0f) {
+		l = -l;
+	}
+	return rot;
+}
+
 void Renderer::build_halfedge(Halfedge_Mesh& mesh) {
 
 	if(loaded_mesh != &mesh) {
@@ -315,25 +416,56 @@ void Renderer::build_halfedge(Halfedge_Mesh& mesh) {
 		hover_compo = 0;
 	} else if(!mesh.render_dirty_flag) return;
 	
+	PROF_ZONE("Build Halfedge");
 	mesh.render_dirty_flag = false;
 	loaded_mesh = &mesh;
 
-	mesh.index(Gui::num_ids());
-	mesh.to_mesh(face_mesh, true);
-
-	idx_to_elm.clear();
-	std::map<Halfedge_Mesh::VertexRef, float> size;
-
-	for(auto f = mesh.faces_begin(); f != mesh.faces_end(); f++) {
-		if(!f->is_boundary())
-			idx_to_elm[f->id()] = f;
+	// Ids are dense: faces, then vertices, edges and halfedges (see index())
+	const unsigned int base = Gui::num_ids();
+	mesh.index(base);
+
+	// The element lists aren't random access, so gather them once and run
+	// every pass below in parallel over the arrays.
+	std::vector<Halfedge_Mesh::FaceRef> faces;
+	std::vector<Halfedge_Mesh::VertexRef> verts;
+	std::vector<Halfedge_Mesh::EdgeRef> edges;
+	std::vector<Halfedge_Mesh::HalfedgeRef> halfedges;
+	{
+		PROF_ZONE("Gather Elements");
+		faces.reserve(mesh.n_faces());
+		verts.reserve(mesh.n_vertices());
+		edges.reserve(mesh.n_edges());
+		halfedges.reserve(mesh.n_halfedges());
+		for(auto f = mesh.faces_begin(); f != mesh.faces_end(); f++) faces.push_back(f);
+		for(auto v = mesh.vertices_begin(); v != mesh.vertices_end(); v++) verts.push_back(v);
+		for(auto e = mesh.edges_begin(); e != mesh.edges_end(); e++) edges.push_back(e);
+		for(auto h = mesh.halfedges_begin(); h != mesh.halfedges_end(); h++) halfedges.push_back(h);
 	}
-
-	// Create sphere for each vertex
-	spheres.clear();
-	for(auto v = mesh.vertices_begin(); v != mesh.vertices_end(); v++) {
-		
-		// Sphere size ~ 0.05 * min incident edge length
+	const unsigned int vert_base = base + (unsigned int)faces.size();
+
+	// The face mesh doesn't depend on anything below
+	std::vector<GL::Mesh::Vert> face_verts;
+	std::vector<GL::Mesh::Index> face_idxs;
+	Jobs::Group face_task;
+	face_task.run([&]() {
+		mesh.to_mesh(face_verts, face_idxs, true);
+	});
+
+	idx_to_elm.assign(mesh.n_faces() + mesh.n_vertices() + mesh.n_edges() + mesh.n_halfedges(), {});
+	const size_t grain = 1024;
+
+	Jobs::parallel_for(faces.size(), [&](size_t i) {
+		if(!faces[i]->is_boundary())
+			idx_to_elm[faces[i]->id() - base] = faces[i];
+	}, grain);
+
+	// Sphere size ~ 0.05 * min incident edge length, which also sets the
+	// width of the edges and halfedges around it
+	std::vector<float> size(verts.size());
+	spheres.resize(verts.size());
+	Jobs::parallel_for(verts.size(), [&](size_t i) {
+
+		auto v = verts[i];
 		float d = FLT_MAX;
 		auto he = v->halfedge();
 		do {
@@ -343,15 +475,20 @@ void Renderer::build_halfedge(Halfedge_Mesh& mesh) {
 			he = he->twin()->next();
 		} while(he != v->halfedge());
 
-		size[v] = d;
-		idx_to_elm[v->id()] = v;
-		spheres.add(Mat4::translate(v->pos) * Mat4::scale(d), v->id());
-	}
+		size[i] = d;
+		idx_to_elm[v->id() - base] = v;
+		spheres.set(i, Mat4::translate(v->pos) * Mat4::scale(d), v->id());
+	}, grain);
 
-	// Create cylinder for each edge
-	cylinders.clear();
-	for(auto e = mesh.edges_begin(); e != mesh.edges_end(); e++) {
-		
+	auto vert_size = [&](Halfedge_Mesh::VertexRef v) {
+		return size[v->id() - vert_base];
+	};
+
+	// Cylinder for each edge
+	cylinders.resize(edges.size());
+	Jobs::parallel_for(edges.size(), [&](size_t i) {
+
+		auto e = edges[i];
 		auto v_0 = e->halfedge()->vertex();
 		auto v_1 = e->halfedge()->twin()->vertex();
 		Vec3 v0 = v_0->pos;
@@ -361,27 +498,27 @@ void Renderer::build_halfedge(Halfedge_Mesh& mesh) {
 		float l = dir.norm();
 			  dir /= l;
 		// Cylinder width; 0.5 * min vertex scale
-		float s = 0.5f * std::min(size[v_0], size[v_1]);
-
-		// Create rotated coordinate frame to align edge
-		Mat4 rot;
-		Vec3 x = cross(dir, {0.0f, 1.0f, 0.0f}).unit();
-		Vec3 z = cross(x, dir).unit();
-		if(x.valid()) {
-			rot = Mat4::axes(x, dir, z);
-		} else if(dir.y == -1.0f) {
-			l = -l;
-		}
-
-		idx_to_elm[e->id()] = e;
-		cylinders.add(Mat4::translate(v0) * rot * Mat4::scale({s, l, s}), e->id());
+		float s = 0.5f * std::min(vert_size(v_0), vert_size(v_1));
+
+		Mat4 rot = align_y(dir, l);
+		idx_to_elm[e->id() - base] = e;
+		cylinders.set(i, Mat4::translate(v0) * rot * Mat4::scale({s, l, s}), e->id());
+	}, grain);
+
+	// Arrow for each non-boundary halfedge. Their slots are found with a
+	// prefix count so the arrows stay in list order.
+	std::vector<size_t> slot(halfedges.size());
+	size_t n_arrows = 0;
+	for(size_t i = 0; i < halfedges.size(); i++) {
+		slot[i] = n_arrows;
+		if(!halfedges[i]->is_boundary()) n_arrows++;
 	}
 
-	// Create arrow for each halfedge
-	arrows.clear();
-	for(auto h = mesh.halfedges_begin(); h != mesh.halfedges_end(); h++) {
+	arrows.resize(n_arrows);
+	Jobs::parallel_for(halfedges.size(), [&](size_t i) {
 
-		if(h->is_boundary()) continue;
+		auto h = halfedges[i];
+		if(h->is_boundary()) return;
 
 		auto v_0 = h->vertex();
 		auto v_1 = h->twin()->vertex();
@@ -392,7 +529,7 @@ void Renderer::build_halfedge(Halfedge_Mesh& mesh) {
 		float l = dir.norm();
 			  dir /= l;
 		// Same width as edge
-		float s = 0.5f * std::min(size[v_0], size[v_1]);
+		float s = 0.5f * std::min(vert_size(v_0), vert_size(v_1));
 
 		// Move to center of edge and towards center of face
 		Vec3 offset = (v1 - v0) * 0.2f;
@@ -400,19 +537,13 @@ void Renderer::build_halfedge(Halfedge_Mesh& mesh) {
 		Vec3 avg = 0.5f * (v0 + v1);
 		offset += (face - avg).unit() * s * 0.125f;
 
-		// Align edge
-		Mat4 rot;
-		Vec3 x = cross(dir, {0.0f, 1.0f, 0.0f}).unit();
-		Vec3 z = cross(x, dir).unit();
-		if(x.valid()) {
-			rot = Mat4::axes(x, dir, z);
-		} else if(dir.y == -1.0f) {
-			l = -l;
-		}
+		Mat4 rot = align_y(dir, l);
+		idx_to_elm[h->id() - base] = h;
+		arrows.set(slot[i], Mat4::translate(v0 + offset) * rot * Mat4::scale({0.6f * s, 0.6f * l, 0.6f * s}), h->id());
+	}, grain);
 
-		idx_to_elm[h->id()] = h;
-		arrows.add(Mat4::translate(v0 + offset) * rot * Mat4::scale({0.6f * s, 0.6f * l, 0.6f * s}), h->id());
-	}
+	face_task.wait();
+	face_mesh.update(std::move(face_verts), std::move(face_idxs));
 }
 
 void Renderer::set_he_select(unsigned int id) {
@@ -430,8 +561,8 @@ std::optional<Halfedge_Mesh::ElementRef> Renderer::he_selected() {
 	assert(data);
 	if(!data->loaded_mesh) return std::nullopt;
 
-	unsigned int id = data->selected_compo;
-	if(id == 0) return std::nullopt;
+	unsigned int id = data->selected_compo - Gui::num_ids();
+	if(data->selected_compo == 0 || id >= data->idx_to_elm.size()) return std::nullopt;
 	return data->idx_to_elm[id];
 }
 
@@ -439,28 +570,25 @@ void Renderer::halfedge(Halfedge_Mesh& mesh, Renderer::HalfedgeOpt opt) {
 
 	assert(data);
 	data->build_halfedge(mesh);
+	PROF_GPU_ZONE("Halfedge");
 
 	MeshOpt fopt;
 	fopt.modelview = opt.modelview;
 	fopt.color = opt.color;
 	fopt.per_vert_id = true;
-	fopt.sel_color = Gui::Color::outline;
 	fopt.sel_id = data->selected_compo;
-	fopt.hov_color = Gui::Color::hover;
 	fopt.hov_id = data->hover_compo;
 	Renderer::mesh(data->face_mesh, fopt);
 
+	const Inst_Uniforms& u = data->inst_u;
 	data->inst_shader.bind();
-	data->inst_shader.uniform("use_v_id", true);
-	data->inst_shader.uniform("use_i_id", true);
-	data->inst_shader.uniform("solid", false);
-	data->inst_shader.uniform("proj", data->_proj);
-	data->inst_shader.uniform("modelview", opt.modelview);
-	data->inst_shader.uniform("color", opt.color);
-	data->inst_shader.uniform("sel_color", Gui::Color::outline);
-	data->inst_shader.uniform("hov_color", Gui::Color::hover);
-	data->inst_shader.uniform("sel_id", data->selected_compo);
-	data->inst_shader.uniform("hov_id", data->hover_compo);
+	data->inst_shader.uniform(u.use_v_id, true);
+	data->inst_shader.uniform(u.use_i_id, true);
+	data->inst_shader.uniform(u.solid, false);
+	data->inst_shader.uniform(u.modelview, opt.modelview);
+	data->inst_shader.uniform(u.color, opt.color);
+	data->inst_shader.uniform(u.sel_id, data->selected_compo);
+	data->inst_shader.uniform(u.hov_id, data->hover_compo);
 
 	data->spheres.render();
 	data->cylinders.render();
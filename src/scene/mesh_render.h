@@ -17,15 +17,21 @@ public:
     static void complete();
     static void reset_depth();
     
-    static void proj(Mat4 proj);
+    /// Upload the per-frame uniforms shared by every shader
+    static void frame(Mat4 proj, Mat4 viewproj);
     static void update_dim(Vec2 dim);
     static void settings_gui(bool* open);
+
+    // Redraw
+    static void invalidate();
+    static bool check_redraw();
+    static bool continuous();
     static Scene_Object::ID read_id(Vec2 pos);
 
     struct MeshOpt {
         Scene_Object::ID id;
         Mat4 modelview;
-        Vec3 color, sel_color, hov_color;
+        Vec3 color;
         unsigned int sel_id = 0, hov_id = 0;
         bool wireframe = false;
         bool solid_color = false;
@@ -51,10 +57,16 @@ public:
     static bool apply_transform(Gui::Action action, Pose delta);
 
     static void mesh(const GL::Mesh& mesh, MeshOpt opt);
-    static void lines(const GL::Lines& lines, Mat4 viewproj, float alpha);
+    /// Draw batch entries holding world space vertices tagged with their object ids
+    static void batch(const GL::Batch& batch, const std::vector<size_t>& entries, Mat4 view, Vec3 color);
+    /// Draw instances whose transforms are model matrices, tagged with object ids
+    static void instances(GL::Instances& inst, Mat4 view, Vec3 color);
+    static void lines(const GL::Lines& lines, float alpha);
     static void outline(Mat4 viewproj, Mat4 view, Scene_Object& obj);
 
     static void dirty();
+    /// Stop referring to mesh, which is about to move or be destroyed
+    static void forget(const Halfedge_Mesh& mesh);
 
 private:
     void build_halfedge(Halfedge_Mesh& mesh);
@@ -69,24 +81,58 @@ private:
     };
 
     int samples;
+    bool redraw = false;
+    bool redraw_continuous = false;
     Vec2 window_dim;
-    GLubyte* id_buffer;
+    GLuint* id_buffer;
+    GL::State_Counts state_counts; // Last frame's
     transform_data first_t;
 	GL::Framebuffer framebuffer, id_resolve;
     GL::Shader mesh_shader, line_shader, inst_shader; 
+
+    // Per-frame uniforms; frame_glsl is the matching std140 block, inserted
+    // into every shader source by with_frame
+    struct Frame {
+        Mat4 proj, viewproj;
+        Vec4 sel_color, hov_color;
+    };
+    static_assert(sizeof(Frame) == 160, "Frame must match the std140 layout of frame_glsl");
+    static constexpr const char* frame_glsl = R"(
+layout (std140) uniform Frame {
+	mat4 proj, viewproj;
+	vec4 sel_color, hov_color;
+};
+)";
+    static std::string with_frame(const std::string& src);
+    GL::Uniform_Block frame_block;
+
+    // Set for every mesh drawn, so they are looked up once
+    struct Mesh_Uniforms {
+        GL::Shader::Uniform<bool> use_v_id, solid;
+        GL::Shader::Uniform<GLuint> id, sel_id, hov_id;
+        GL::Shader::Uniform<Mat4> modelview, normal;
+        GL::Shader::Uniform<Vec3> color;
+    } mesh_u;
+
+    // Same for instances
+    struct Inst_Uniforms {
+        GL::Shader::Uniform<bool> use_v_id, use_i_id, solid;
+        GL::Shader::Uniform<GLuint> sel_id, hov_id;
+        GL::Shader::Uniform<Mat4> modelview;
+        GL::Shader::Uniform<Vec3> color;
+    } inst_u;
+
     GL::Instances spheres, cylinders, arrows;
     GL::Mesh face_mesh;
     
-    Mat4 _proj;
     Halfedge_Mesh* loaded_mesh = nullptr;
     
     // This all needs to be updated when the mesh connectivity changes
     unsigned int selected_compo = -1, hover_compo = -1;
 
-    // TODO(max): this is a kind of bad design and would be un-necessary if we used
-    // a halfedge implementation with contiguous iterators. For now this map must
-    // be updated (along with the instance data) by build_halfedge whenever
-    // the mesh changes its connectivity. Note that build_halfedge also
-    // re-indexes the mesh elements in the provided half-edge mesh.
-    std::map<unsigned int, Halfedge_Mesh::ElementRef> idx_to_elm;
+    // Element of each id, indexed by id - Gui::num_ids(). This must be updated
+    // (along with the instance data) by build_halfedge whenever the mesh
+    // changes its connectivity. Note that build_halfedge also re-indexes the
+    // mesh elements in the provided half-edge mesh.
+    std::vector<Halfedge_Mesh::ElementRef> idx_to_elm;
 };
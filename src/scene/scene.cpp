@@ -1,26 +1,37 @@
 
 #include "scene.h"
 #include "mesh_render.h"
+#include "loaders.h"
 #include "../lib/log.h"
 #include "../undo.h"
 #include "../gui.h"
+#include "../platform/prof.h"
+#include "../platform/file.h"
 
 #include <assimp/Importer.hpp>
 #include <assimp/Exporter.hpp>
 #include <assimp/postprocess.h>
+#include <assimp/ProgressHandler.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
 #include <sstream>
+#include <thread>
 
 Mat4 Pose::transform() const {
-	return Mat4::translate(pos) * 
-		   rotation_mat() *
-		   Mat4::scale(scale);
+	cache.set(pos, euler, scale);
+	return cache.matrix();
+}
+
+Mat4 Pose::inverse() const {
+	cache.set(pos, euler, scale);
+	return cache.inverse();
 }
 
 Mat4 Pose::rotation_mat() const {
-	return Mat4::rotate(euler.z, {0.0f, 0.0f, 1.0f}) *
-		   Mat4::rotate(euler.y, {0.0f, 1.0f, 0.0f}) *  
-		   Mat4::rotate(euler.x, {1.0f, 0.0f, 0.0f});
+	return Transform::rotation(euler);
 }
 
 Quat Pose::rotation_quat() const {
@@ -62,8 +73,8 @@ Scene_Object::Scene_Object() {
 }
 
 Scene_Object::Scene_Object(Scene_Object&& src) :
-	_mesh(std::move(src._mesh)),
-	halfedge(std::move(src.halfedge)) {
+	halfedge(std::move(src.halfedge)),
+	_mesh(std::move(src._mesh)) {
 
 	opt.name = std::move(src.opt.name);
 	opt.wireframe = src.opt.wireframe; src.opt.wireframe = false;
@@ -71,6 +82,14 @@ Scene_Object::Scene_Object(Scene_Object&& src) :
 	color = src.color; src.color = {};
 	pose = src.pose; src.pose = {};
 	mesh_dirty = src.mesh_dirty; src.mesh_dirty = false;
+	editable = src.editable; src.editable = true;
+	mesh_error = std::move(src.mesh_error);
+	lazy = std::move(src.lazy);
+	shared = std::move(src.shared);
+	frozen = std::move(src.frozen);
+	thawed = src.thawed; src.thawed = true;
+	// Workers only touch the Rebuild itself, so it can change hands
+	rebuild = std::move(src.rebuild);
 }
 
 Scene_Object::Scene_Object(ID id, Pose p, GL::Mesh&& m, Vec3 c) :
@@ -89,7 +108,8 @@ Scene_Object::Scene_Object(ID id, Pose p, Halfedge_Mesh&& m, Vec3 c) :
 	pose(p),
 	color(c),
 	_id(id),
-	halfedge(std::move(m)) {
+	frozen(std::make_shared<Halfedge_Mesh>(std::move(m))),
+	thawed(false) {
 	
 	mesh_dirty = true;
 	editable = true;
@@ -97,19 +117,76 @@ Scene_Object::Scene_Object(ID id, Pose p, Halfedge_Mesh&& m, Vec3 c) :
 	snprintf(opt.name.data(), opt.name.capacity(), "Object %d", id);
 }
 
+Scene_Object::Scene_Object(ID id, Pose p, Polygons&& polys, Vec3 c) :
+	pose(p),
+	color(c),
+	_id(id),
+	lazy(std::make_unique<Lazy>()) {
+
+	lazy->polys = std::make_shared<const Polygons>(std::move(polys));
+	mesh_dirty = true;
+	editable = true;
+	opt.name.reserve(max_name_len);
+	snprintf(opt.name.data(), opt.name.capacity(), "Object %d", id);
+}
+
+Scene_Object::Scene_Object(ID id, Pose p, Polygons&& polys, GL::Mesh&& m, Vec3 c) :
+	pose(p),
+	color(c),
+	_id(id),
+	lazy(std::make_unique<Lazy>()),
+	_mesh(std::move(m)) {
+
+	lazy->polys = std::make_shared<const Polygons>(std::move(polys));
+	mesh_dirty = false;
+	editable = true;
+	opt.name.reserve(max_name_len);
+	snprintf(opt.name.data(), opt.name.capacity(), "Object %d", id);
+}
+
+Scene_Object::Scene_Object(ID id, Pose p, std::shared_ptr<Shared> s, Vec3 c) :
+	pose(p),
+	color(c),
+	_id(id),
+	shared(std::move(s)) {
+
+	mesh_dirty = false;
+	editable = true;
+	opt.name.reserve(max_name_len);
+	snprintf(opt.name.data(), opt.name.capacity(), "Object %d", id);
+}
+
 Scene_Object::~Scene_Object() {
 
 }
 
 void Scene_Object::copy_mesh(Halfedge_Mesh& out) {
-	halfedge.copy_to(out);
+	build_mesh();
+	current_mesh().copy_to(out);
 }
 
 void Scene_Object::set_mesh(const Halfedge_Mesh& in) {
+	lazy.reset();
+	shared.reset();
+	mesh_error.clear();
+	editable = true;
 	in.copy_to(halfedge);
+	thawed = true;
 	set_mesh_dirty();
 }
 
+void Scene_Object::set_mesh(std::shared_ptr<const Halfedge_Mesh> in) {
+	lazy.reset();
+	shared.reset();
+	mesh_error.clear();
+	editable = true;
+	// The renderer may be showing the mesh being edited, so that is kept
+	// current; otherwise the copy waits for the next edit
+	if(thawed) in->copy_to(halfedge);
+	frozen = std::move(in);
+	mesh_dirty = true;
+}
+
 void Scene_Object::operator=(Scene_Object&& src) {
 	_mesh = std::move(src._mesh);
 	halfedge = std::move(src.halfedge);
@@ -119,29 +196,226 @@ void Scene_Object::operator=(Scene_Object&& src) {
 	color = src.color; src.color = {};
 	pose = src.pose; src.pose = {};
 	mesh_dirty = src.mesh_dirty; src.mesh_dirty = false;
+	editable = src.editable; src.editable = true;
+	mesh_error = std::move(src.mesh_error);
+	lazy = std::move(src.lazy);
+	shared = std::move(src.shared);
+	frozen = std::move(src.frozen);
+	thawed = src.thawed; src.thawed = true;
+	rebuild = std::move(src.rebuild);
 }
 
 Halfedge_Mesh& Scene_Object::get_mesh() {
+	build_mesh();
+	if(!thawed) {
+		// Nobody else can be reading it if we hold the only reference (frozen
+		// meshes are never created const, so moving from one is fine). The
+		// fence orders this after the last reader dropped its reference.
+		if(frozen.use_count() == 1) {
+			std::atomic_thread_fence(std::memory_order_acquire);
+			halfedge = std::move(const_cast<Halfedge_Mesh&>(*frozen));
+			frozen.reset();
+		} else {
+			frozen->copy_to(halfedge);
+		}
+		// Any renderer state refers to what halfedge held before
+		halfedge.render_dirty_flag = true;
+		thawed = true;
+	}
 	return halfedge;
 }
 
+std::shared_ptr<const Halfedge_Mesh> Scene_Object::frozen_mesh() {
+	build_mesh();
+	if(!editable) return nullptr;
+	if(!frozen) {
+		auto copy = std::make_shared<Halfedge_Mesh>();
+		halfedge.copy_to(*copy);
+		frozen = std::move(copy);
+	}
+	return frozen;
+}
+
+void Scene_Object::prepare_mesh() {
+	unshare();
+	if(!lazy || lazy->started) return;
+	Lazy* l = lazy.get();
+	l->started = true;
+	l->build.run([l]() {
+		l->error = l->polys->build(l->mesh);
+	});
+}
+
+std::string Scene_Object::build_mesh() {
+
+	unshare();
+	if(!lazy) return mesh_error;
+
+	// If the polygons turn out to be invalid we keep showing them as-is
+	sync_mesh();
+
+	if(lazy->started) lazy->build.wait();
+	else lazy->error = lazy->polys->build(lazy->mesh);
+
+	if(lazy->error.empty()) {
+		frozen = std::make_shared<Halfedge_Mesh>(std::move(lazy->mesh));
+		thawed = false;
+		mesh_dirty = true;
+	} else {
+		warn("Building mesh for %s: %s", opt.name.c_str(), lazy->error.c_str());
+		mesh_error = lazy->error;
+		editable = false;
+	}
+	lazy.reset();
+	return mesh_error;
+}
+
+/// Same triangulation and flat normals as Halfedge_Mesh::to_mesh
+static void polys_to_tris(const Scene_Object::Polygons& polys, std::vector<GL::Mesh::Vert>& verts,
+						  std::vector<GL::Mesh::Index>& idxs) {
+
+	verts.clear();
+	idxs.clear();
+
+	size_t start = 0;
+	for(unsigned int n : polys.sizes) {
+		const unsigned int* face = polys.indices.data() + start;
+		start += n;
+		for(unsigned int i = 1; i + 1 < n; i++) {
+			Vec3 v0 = polys.verts[face[0]].pos;
+			Vec3 v1 = polys.verts[face[i]].pos;
+			Vec3 v2 = polys.verts[face[i + 1]].pos;
+			Vec3 norm = cross(v1 - v0, v2 - v0).unit();
+			idxs.push_back((GL::Mesh::Index)verts.size());
+			verts.push_back({v0, norm, 0});
+			idxs.push_back((GL::Mesh::Index)verts.size());
+			verts.push_back({v1, norm, 0});
+			idxs.push_back((GL::Mesh::Index)verts.size());
+			verts.push_back({v2, norm, 0});
+		}
+	}
+}
+
+static void polys_to_mesh(const Scene_Object::Polygons& polys, GL::Mesh& mesh) {
+	std::vector<GL::Mesh::Vert> verts;
+	std::vector<GL::Mesh::Index> idxs;
+	polys_to_tris(polys, verts, idxs);
+	mesh.update(std::move(verts), std::move(idxs));
+}
+
+Scene_Object::Shared::Shared(Polygons&& p, GL::Mesh&& mesh) :
+	polys(std::make_shared<const Polygons>(std::move(p))), instances(std::move(mesh)) {}
+
+void Scene_Object::unshare() {
+	if(!shared) return;
+	lazy = std::make_unique<Lazy>();
+	lazy->polys = shared->polys;
+	shared.reset();
+	mesh_dirty = true;
+}
+
+std::shared_ptr<const Scene_Object::Polygons> Scene_Object::polygons() const {
+	if(shared) return shared->polys;
+	if(lazy) return lazy->polys;
+	return nullptr;
+}
+
 void Scene_Object::sync_mesh() {
+	finish_rebuild();
 	if(editable && mesh_dirty) {
-		halfedge.to_mesh(_mesh, true);
+		if(lazy) polys_to_mesh(*lazy->polys, _mesh);
+		else current_mesh().to_mesh(_mesh, true);
 		mesh_dirty = false;
 	}
 }
 
+void Scene_Object::finish_rebuild() {
+	if(!rebuild) return;
+	rebuild->task.wait();
+	_mesh.update(std::move(rebuild->verts), std::move(rebuild->idxs), rebuild->box);
+	rebuild.reset();
+}
+
+void Scene_Object::refresh_mesh() {
+
+	// Imported polygons are only converted once, see Scene::update_load
+	if(lazy) {
+		sync_mesh();
+		return;
+	}
+
+	if(rebuild) {
+		if(!rebuild->task.done()) return;
+		finish_rebuild();
+	}
+	if(!editable || !mesh_dirty) return;
+	mesh_dirty = false;
+
+	// The mesh may be edited meanwhile, so the worker gets its own copy
+	rebuild = std::make_unique<Rebuild>();
+	Rebuild* r = rebuild.get();
+	r->mesh = frozen_mesh();
+	Jobs::async([r]() {
+		r->mesh->to_mesh(r->verts, r->idxs, true);
+		for(auto& v : r->verts) r->box.enclose(v.pos);
+	}, []() {
+		// Nothing to do, but it wakes the main loop to draw the new mesh
+	}, &r->task);
+}
+
+void Scene_Object::Polygons::expand(std::vector<std::vector<Halfedge_Mesh::Index>>& polygons) const {
+	polygons.clear();
+	polygons.reserve(sizes.size());
+	size_t start = 0;
+	for(unsigned int n : sizes) {
+		polygons.emplace_back(indices.begin() + start, indices.begin() + start + n);
+		start += n;
+	}
+}
+
+std::string Scene_Object::Polygons::build(Halfedge_Mesh& mesh) const {
+	std::vector<std::vector<Halfedge_Mesh::Index>> polygons;
+	expand(polygons);
+	return mesh.from_poly(polygons, verts);
+}
+
+size_t Scene_Object::Polygons::bytes() const {
+	return verts.size() * sizeof(GL::Mesh::Vert) + (indices.size() + sizes.size()) * sizeof(unsigned int);
+}
+
 void Scene_Object::set_mesh_dirty() {
 	mesh_dirty = true;
+	if(thawed) frozen.reset();
+}
+
+size_t Scene_Object::bytes() const {
+	// The GL mesh keeps a CPU copy of what it uploaded
+	size_t gl = _mesh.verts().size() * sizeof(GL::Mesh::Vert) +
+				_mesh.indices().size() * sizeof(GL::Mesh::Index);
+	size_t ret = halfedge.bytes() + 2 * gl;
+	// Shared data is split evenly between its owners
+	if(frozen) {
+		ret += frozen->bytes() / frozen.use_count();
+	}
+	if(lazy) {
+		ret += lazy->polys->bytes() / lazy->polys.use_count() + lazy->mesh.bytes();
+	}
+	if(shared) {
+		const GL::Mesh& m = shared->instances.mesh();
+		size_t total = shared->polys->bytes() + 2 * (m.verts().size() * sizeof(GL::Mesh::Vert) +
+													 m.indices().size() * sizeof(GL::Mesh::Index));
+		ret += total / shared.use_count();
+	}
+	return ret;
 }
 
 BBox Scene_Object::bbox() const {
 
 	Mat4 t = pose.transform();
 	BBox ret;
-	std::vector<Vec3> c = _mesh.bbox().corners();
-	for(auto& v : c) ret.enclose(t * v);
+	std::vector<Vec3> c = mesh().bbox().corners();
+	t.transform_points(c.data(), c.data(), c.size());
+	for(auto& v : c) ret.enclose(v);
 	return ret;
 }
 
@@ -150,12 +424,12 @@ void Scene_Object::render_halfedge(Mat4 view) {
 	Renderer::HalfedgeOpt opt;
 	opt.modelview = view * pose.transform();
 	opt.color = color;
-	Renderer::halfedge(halfedge, opt);
+	Renderer::halfedge(get_mesh(), opt);
 }
 
 void Scene_Object::render_mesh(Mat4 view, bool solid, bool depth_only) {
 
-	sync_mesh();
+	refresh_mesh();
 	
 	Renderer::MeshOpt opt;
 	opt.modelview = view * pose.transform();
@@ -163,7 +437,7 @@ void Scene_Object::render_mesh(Mat4 view, bool solid, bool depth_only) {
 	opt.solid_color = solid;
 	opt.depth_only = depth_only;
 	opt.color = color;
-	Renderer::mesh(_mesh, opt);
+	Renderer::mesh(mesh(), opt);
 }
 
 Scene::Scene(Scene_Object::ID start) :
@@ -171,54 +445,181 @@ Scene::Scene(Scene_Object::ID start) :
 	first_id(start) {
 }
 
-Scene::~Scene() {
-
-}
-
 Scene_Object::ID Scene::reserve_id() {
 	return next_id++;
 }
 
 Scene_Object::ID Scene::add(Pose pose, GL::Mesh&& mesh, Scene_Object::ID id) {
 	if(!id) id = next_id++;
-	assert(objs.find(id) == objs.end());
-	objs.emplace(std::make_pair(id, Scene_Object(id, pose, std::move(mesh), Gui::Color::obj)));
-	return id;
+	return add(Scene_Object(id, pose, std::move(mesh), Gui::Color::obj));
 }
 
 Scene_Object::ID Scene::add(Scene_Object&& obj) {
-	assert(objs.find(obj.id()) == objs.end());
-	objs.emplace(std::make_pair(obj.id(), std::move(obj)));
-	return obj.id();
+	Scene_Object::ID id = obj.id();
+	assert(slots.find(id) == slots.end());
+	slots[id] = objs.size();
+	objs.push_back(std::make_unique<Scene_Object>(std::move(obj)));
+	ids_dirty = true;
+	return id;
 }
 
-void Scene::restore(Scene_Object::ID id) {
-	if(objs.find(id) != objs.end()) return;
-	assert(erased.find(id) != erased.end());
+Scene_Object Scene::erase(Scene_Object::ID id) {
+	auto entry = slots.find(id);
+	assert(entry != slots.end());
+
+	size_t slot = entry->second;
+	slots.erase(entry);
+	// The object leaves its box, so the renderer can't keep editing it
+	Renderer::forget(objs[slot]->halfedge);
+	Scene_Object obj = std::move(*objs[slot]);
 
-	objs.insert({id, std::move(erased[id])});
-	erased.erase(id);
+	if(slot + 1 < objs.size()) {
+		objs[slot] = std::move(objs.back());
+		slots[objs[slot]->id()] = slot;
+	}
+	objs.pop_back();
+	ids_dirty = true;
+	return obj;
 }
 
-void Scene::erase(Scene_Object::ID id) {
-	assert(erased.find(id) == erased.end());
-	assert(objs.find(id) != objs.end());
+void Scene::update_batch(Scene_Object::ID selected) {
+
+	PROF_ZONE("Update Batch");
+	if(batch_dead > batch_live && batch_dead > (1 << 16)) {
+		batch.clear();
+		batched.clear();
+		batch_live = batch_dead = 0;
+	}
+
+	std::vector<GL::Mesh::Vert> world;
+	std::vector<Scene_Object*> members;
+	instanced.clear();
+	for(auto& ptr : objs) {
+
+		Scene_Object& obj = *ptr;
+		obj.refresh_mesh();
+		Batched& b = batched[obj.id()];
+		b.seen = true;
+		b.color = obj.color;
+
+		// The selected object is drawn on its own, and likely moving
+		if(obj.id() == selected) {
+			b.instanced = false;
+			continue;
+		}
+
+		const Pose& pose = obj.pose;
+		bool moved = b.pos != pose.pos || b.euler != pose.euler || b.scale != pose.scale;
+
+		if(obj.shared) {
+			Scene_Object::Shared& s = *obj.shared;
+			if(!s.count) instanced.push_back({&s, obj.color});
+			s.count++;
+			if(moved || !b.instanced) s.dirty = true;
+			members.push_back(&obj);
+			b.instanced = true;
+			b.pos = pose.pos;
+			b.euler = pose.euler;
+			b.scale = pose.scale;
+			continue;
+		}
+
+		const GL::Mesh& mesh = obj._mesh;
+		bool remesh = !b.in_batch || b.revision != mesh.revision();
+		if(!remesh && !moved) continue;
+
+		Mat4 T = pose.transform();
+		Mat4 N = Mat4::transpose(pose.inverse());
+		const auto& verts = mesh.verts();
+		world.resize(verts.size());
+		Jobs::parallel_for(verts.size(), [&](size_t i) {
+			world[i].pos = T * verts[i].pos;
+			world[i].norm = (N * Vec4(verts[i].norm, 0.0f)).xyz().unit();
+			world[i].id = obj.id();
+		}, 4096);
+
+		if(remesh) {
+			if(b.in_batch) {
+				batch_live -= b.verts;
+				batch_dead += b.verts;
+			}
+			b.entry = batch.add(world, mesh.indices());
+			b.verts = world.size();
+			b.revision = mesh.revision();
+			b.in_batch = true;
+			batch_live += b.verts;
+		} else {
+			batch.update(b.entry, world);
+		}
+		b.pos = pose.pos;
+		b.euler = pose.euler;
+		b.scale = pose.scale;
+	}
+
+	// A group is rewritten whole; count is reused as the write cursor
+	for(auto& [s, color] : instanced) {
+		if(s->count != s->drawn) s->dirty = true;
+		if(s->dirty) s->instances.resize(s->count);
+		s->drawn = s->count;
+		s->count = 0;
+	}
+	for(Scene_Object* obj : members) {
+		Scene_Object::Shared& s = *obj->shared;
+		if(s.dirty) s.instances.set(s.count, obj->pose.transform(), obj->id());
+		s.count++;
+	}
+	for(auto& [s, color] : instanced) {
+		s->count = 0;
+		s->dirty = false;
+	}
 
-	erased.insert({id, std::move(objs[id])});
-	objs.erase(id);
+	// Entries of objects that are gone stay in the batch unused
+	for(auto it = batched.begin(); it != batched.end();) {
+		if(!it->second.seen) {
+			batch_live -= it->second.verts;
+			batch_dead += it->second.verts;
+			it = batched.erase(it);
+		} else {
+			it->second.seen = false;
+			it++;
+		}
+	}
 }
 
 void Scene::render_objs(Mat4 view, Scene_Object::ID selected) {
-	for(auto& obj : objs) {
-		if(obj.first != selected) 
-			obj.second.render_mesh(view);
+	PROF_ZONE("Scene Objects");
+	PROF_GPU_ZONE("Scene Objects");
+
+	update_batch(selected);
+
+	// One draw per object color, which nearly all objects share
+	std::vector<std::pair<Vec3, std::vector<size_t>>> draws;
+	for(auto& [id, b] : batched) {
+		if(id == selected || !b.in_batch) continue;
+		size_t i = 0;
+		while(i < draws.size() && draws[i].first != b.color) i++;
+		if(i == draws.size()) draws.push_back({b.color, {}});
+		draws[i].second.push_back(b.entry);
+	}
+	for(auto& [color, entries] : draws) {
+		Renderer::batch(batch, entries, view, color);
+	}
+
+	// Groups take the color of their first member
+	for(auto& [s, color] : instanced) {
+		Renderer::instances(s->instances, view, color);
 	}
 }
 
-void Scene::for_objs(std::function<void(Scene_Object&)> func) {
-	for(auto& obj : objs) {
-		func(obj.second);
+const std::vector<Scene_Object::ID>& Scene::ids() {
+	if(ids_dirty) {
+		sorted_ids.clear();
+		sorted_ids.reserve(objs.size());
+		for(auto& obj : objs) sorted_ids.push_back(obj->id());
+		std::sort(sorted_ids.begin(), sorted_ids.end());
+		ids_dirty = false;
 	}
+	return sorted_ids;
 }
 
 size_t Scene::size() {
@@ -230,104 +631,428 @@ bool Scene::empty() {
 }
 
 std::optional<std::reference_wrapper<Scene_Object>> Scene::get(Scene_Object::ID id) {
-	auto entry = objs.find(id);
-	if(entry == objs.end()) return std::nullopt;
-	return entry->second;
+	auto entry = slots.find(id);
+	if(entry == slots.end()) return std::nullopt;
+	return *objs[entry->second];
 }
 
 void Scene::clear(Undo& undo) {
 	next_id = first_id;
+	for(auto& obj : objs) Renderer::forget(obj->halfedge);
 	objs.clear();
-	erased.clear();
+	slots.clear();
+	ids_dirty = true;
 	undo.reset();
 }
 
-void Scene::load_node(std::vector<std::string>& errors, const aiScene* scene, aiNode* node, aiMatrix4x4 transform) {
+namespace {
+// One aiMesh instance to convert, and the result of converting it. Only
+// the first job referencing an aiMesh converts it; later ones point back
+// to it as their source, and all of them share its polygons.
+struct Load_Job {
+	const aiMesh* mesh = nullptr;
+	aiMatrix4x4 transform;
+	Pose pose;
+	Scene_Object::Polygons polys;
+	// The GL mesh data for polys, so the main thread only has to upload it
+	std::vector<GL::Mesh::Vert> tri_verts;
+	std::vector<GL::Mesh::Index> tri_idxs;
+	std::string name, error;
+
+	size_t source = 0, users = 1;
+	std::shared_ptr<Scene_Object::Shared> shared; // Created by the source's commit
+};
+
+const unsigned int import_flags = aiProcess_GenSmoothNormals |
+								  aiProcess_ValidateDataStructure |
+								  aiProcess_OptimizeMeshes |
+								  aiProcess_FindInstances |
+								  aiProcess_FindDegenerates |
+								  aiProcess_JoinIdenticalVertices |
+								  aiProcess_FindInvalidData;
+}
+
+static void flatten_node(std::vector<Load_Job>& jobs, const aiScene* scene, aiNode* node, aiMatrix4x4 transform) {
 
 	transform = transform * node->mTransformation;
 
-	for (unsigned int i = 0; i < node->mNumMeshes; i++) {
-		const aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-		
-		if(!mesh->HasNormals()) {
-			errors.push_back("Mesh has no normals.");
-			continue;
-		}
+	for(unsigned int i = 0; i < node->mNumMeshes; i++) {
+		Load_Job job;
+		job.mesh = scene->mMeshes[node->mMeshes[i]];
+		job.transform = transform;
+		jobs.push_back(std::move(job));
+	}
 
-		std::vector<GL::Mesh::Vert> verts;
+	for(unsigned int i = 0; i < node->mNumChildren; i++) {
+		flatten_node(jobs, scene, node->mChildren[i], transform);
+	}
+}
 
-		for (unsigned int i = 0; i < mesh->mNumVertices; i++) {
-			const aiVector3D& pos = mesh->mVertices[i];
-			const aiVector3D& norm = mesh->mNormals[i];
-			verts.push_back({Vec3(pos.x, pos.y, pos.z), Vec3(norm.x, norm.y, norm.z)});
-		}
+/// Point jobs at the first job with the same aiMesh
+static void find_sources(std::vector<Load_Job>& jobs) {
+	std::unordered_map<const aiMesh*, size_t> first;
+	for(size_t i = 0; i < jobs.size(); i++) {
+		auto [entry, added] = first.insert({jobs[i].mesh, i});
+		jobs[i].source = entry->second;
+		if(!added) jobs[entry->second].users++;
+	}
+}
 
-		std::vector<std::vector<Halfedge_Mesh::Index>> polys;
-		for (unsigned int i = 0; i < mesh->mNumFaces; i++) {
-			const aiFace& face = mesh->mFaces[i];
-			
-			std::vector<Halfedge_Mesh::Index> poly;
-			for(unsigned int j = 0; j < face.mNumIndices; j++) {
-				poly.push_back(face.mIndices[j]);
-			}
-			polys.push_back(poly);
-		}
+/// Build the polygons for a job, unless its source does; only touches the
+/// job, so jobs may run in parallel
+static void convert_mesh(Load_Job& job, bool is_source) {
 
-		aiVector3D ascale, arot, apos;
-		transform.Decompose(ascale, arot, apos);
-		Vec3 pos(apos.x, apos.y, apos.z);
-		Vec3 rot(arot.x, arot.y, arot.z);
-		Vec3 scale(ascale.x, ascale.y, ascale.z);
-		Pose p = {pos, Degrees(rot).range(0.0f, 360.0f), scale};
+	const aiMesh* mesh = job.mesh;
+	job.name = std::string(mesh->mName.C_Str());
 
-		Halfedge_Mesh hemesh;
-		std::string err = hemesh.from_poly(polys, verts);
-		if(!err.empty()) {
-			errors.push_back(err);
-		} else {
-			Scene_Object obj(reserve_id(), p, std::move(hemesh), Gui::Color::obj);
-			if(mesh->mName.length) {
-				obj.opt.name = std::string(mesh->mName.C_Str());
-			}
-			add(std::move(obj));
+	aiVector3D ascale, arot, apos;
+	job.transform.Decompose(ascale, arot, apos);
+	Vec3 pos(apos.x, apos.y, apos.z);
+	Vec3 rot(arot.x, arot.y, arot.z);
+	Vec3 scale(ascale.x, ascale.y, ascale.z);
+	job.pose = {pos, Degrees(rot).range(0.0f, 360.0f), scale};
+
+	if(!is_source) return;
+
+	if(!mesh->HasNormals()) {
+		job.error = "Mesh has no normals.";
+		return;
+	}
+
+	// The halfedge mesh is only built once the object is edited
+	Scene_Object::Polygons& polys = job.polys;
+	polys.verts.reserve(mesh->mNumVertices);
+
+	for (unsigned int i = 0; i < mesh->mNumVertices; i++) {
+		const aiVector3D& pos = mesh->mVertices[i];
+		const aiVector3D& norm = mesh->mNormals[i];
+		polys.verts.push_back({Vec3(pos.x, pos.y, pos.z), Vec3(norm.x, norm.y, norm.z)});
+	}
+
+	polys.sizes.reserve(mesh->mNumFaces);
+	for (unsigned int i = 0; i < mesh->mNumFaces; i++) {
+		const aiFace& face = mesh->mFaces[i];
+		if(face.mNumIndices < 3) {
+			job.error = "Each polygon must have at least three vertices.";
+			return;
 		}
+		polys.sizes.push_back(face.mNumIndices);
+		polys.indices.insert(polys.indices.end(), face.mIndices, face.mIndices + face.mNumIndices);
 	}
 
-	for(unsigned int i = 0; i < node->mNumChildren; i++) {
-		load_node(errors, scene, node->mChildren[i], transform);
+	polys_to_tris(polys, job.tri_verts, job.tri_idxs);
+}
+
+/// Run every job, spread over the available cores. If given, done[i] is
+/// set once job i is complete, and remaining jobs are skipped once cancel is set.
+static void convert_meshes(std::vector<Load_Job>& jobs, std::atomic<bool>* done = nullptr,
+						   const std::atomic<bool>* cancel = nullptr) {
+
+	PROF_ZONE("Convert Meshes");
+
+	Jobs::parallel_for(jobs.size(), [&](size_t i) {
+		if(cancel && *cancel) return;
+		convert_mesh(jobs[i], jobs[i].source == i);
+		if(done) done[i].store(true, std::memory_order_release);
+	});
+}
+
+static bool has_extension(const std::string& file, const std::string& ext) {
+	if(file.size() < ext.size()) return false;
+	for(size_t i = 0; i < ext.size(); i++) {
+		if(tolower(file[file.size() - ext.size() + i]) != ext[i]) return false;
+	}
+	return true;
+}
+
+/// Raw scan formats skip Assimp when possible, see loaders.h
+static bool fast_load(const std::string& file, std::vector<Load_Job>& jobs, std::string& error) {
+
+	std::vector<Loaders::Mesh> meshes;
+	if(!Loaders::load(file, meshes, error)) return false;
+
+	size_t first = jobs.size();
+	for(Loaders::Mesh& mesh : meshes) {
+		Load_Job job;
+		job.pose = Pose::id();
+		job.name = std::move(mesh.name);
+		job.polys = std::move(mesh.polys);
+		job.source = jobs.size();
+		jobs.push_back(std::move(job));
+	}
+	Jobs::parallel_for(jobs.size() - first, [&](size_t i) {
+		Load_Job& job = jobs[first + i];
+		polys_to_tris(job.polys, job.tri_verts, job.tri_idxs);
+	});
+	return true;
+}
+
+/// Turn job i into an object, or return its error. Jobs are committed in
+/// order, so a job's source (which comes first) has already been.
+static std::string commit_job(Scene& scene, std::vector<Load_Job>& jobs, size_t i, Scene_Object& obj) {
+
+	Load_Job& job = jobs[i];
+	Load_Job& source = jobs[job.source];
+	if(!source.error.empty()) return source.error;
+
+	// Only uploads; the triangles were built along with the polygons
+	GL::Mesh mesh;
+	if(job.source == i) mesh = GL::Mesh(std::move(job.tri_verts), std::move(job.tri_idxs));
+
+	if(source.users == 1) {
+		obj = Scene_Object(scene.reserve_id(), job.pose, std::move(job.polys), std::move(mesh), Gui::Color::obj);
+	} else {
+		if(!source.shared) {
+			source.shared = std::make_shared<Scene_Object::Shared>(std::move(source.polys), std::move(mesh));
+		}
+		obj = Scene_Object(scene.reserve_id(), job.pose, source.shared, Gui::Color::obj);
 	}
+	if(!job.name.empty()) {
+		obj.opt.name = job.name;
+	}
+	return {};
 }
 
 std::string Scene::load(bool clear_first, Undo& undo, std::string file) {
 
+	PROF_ZONE("Load Scene");
+
+	if(has_extension(file, ".s4d")) return load_s4d(clear_first, undo, file);
+
 	if(clear_first) clear(undo);
+
+	std::vector<Load_Job> jobs;
+	std::string error;
 	Assimp::Importer importer;
-	const aiScene* scene = importer.ReadFile(file.c_str(), 
-		aiProcess_GenSmoothNormals |
-		aiProcess_ValidateDataStructure |
-		aiProcess_OptimizeMeshes |
-		aiProcess_FindInstances |
-		aiProcess_FindDegenerates |
-		aiProcess_JoinIdenticalVertices |
-        aiProcess_FindInvalidData);
 
-	if (!scene) {
-		return "Parsing scene " + file + ": " + std::string(importer.GetErrorString());
+	if(fast_load(file, jobs, error)) {
+		if(!error.empty()) return error;
+	} else {
+		const aiScene* scene = nullptr;
+		{
+			PROF_ZONE("Import");
+			scene = importer.ReadFile(file.c_str(), import_flags);
+		}
+
+		if (!scene) {
+			return "Parsing scene " + file + ": " + std::string(importer.GetErrorString());
+		}
+
+		scene->mRootNode->mTransformation = aiMatrix4x4();
+		flatten_node(jobs, scene, scene->mRootNode, aiMatrix4x4());
+		find_sources(jobs);
+		convert_meshes(jobs);
 	}
 
+	// Objects need GL resources, so create them here, in file order
 	std::vector<std::string> errors;
-	scene->mRootNode->mTransformation = aiMatrix4x4();
-	load_node(errors, scene, scene->mRootNode, aiMatrix4x4());
+	for(size_t i = 0; i < jobs.size(); i++) {
+		Scene_Object obj;
+		std::string err = commit_job(*this, jobs, i, obj);
+		if(!err.empty()) {
+			errors.push_back(err);
+			continue;
+		}
+		add(std::move(obj));
+	}
 	
 	std::stringstream stream;
 	for(int i = 0; i < errors.size(); i++) {
 		stream << "Loading mesh " << i << ": " << errors[i] << std::endl;
 	}
+	undo.scene_changed();
 	return stream.str();
 }
 
+// Background import. The loader thread parses the file and converts meshes;
+// the main thread creates objects from finished jobs in file order, a few
+// per frame, so GL uploads are spread out and the UI stays responsive.
+struct Scene_Load {
+	std::thread thread;
+	std::string file;
+	bool clear_first = false;
+
+	std::atomic<bool> cancel = false;
+	std::atomic<bool> finished = false;
+	std::atomic<float> import_progress = 0.0f;
+
+	// Written by the loader thread before jobs_ready is set
+	std::atomic<bool> jobs_ready = false;
+	std::vector<Load_Job> jobs;
+	std::unique_ptr<std::atomic<bool>[]> done;
+	std::string error;
+
+	// Main thread only
+	size_t next_commit = 0;
+	std::vector<std::string> errors;
+	// When replacing the scene, finished objects wait here until the whole
+	// load is committed, so cancelling it leaves the old scene untouched
+	std::vector<Scene_Object> pending;
+};
+
+namespace {
+class Load_Progress : public Assimp::ProgressHandler {
+public:
+	Load_Progress(Scene_Load& load) : load(load) {}
+	bool Update(float percentage) override {
+		if(percentage >= 0.0f) load.import_progress = std::min(percentage, 1.0f);
+		return !load.cancel;
+	}
+private:
+	Scene_Load& load;
+};
+}
+
+static void run_load(Scene_Load& load) {
+
+	if(Prof::tracing) Prof::name_thread("Scene Loader");
+	PROF_ZONE("Load Scene");
+
+	if(fast_load(load.file, load.jobs, load.error)) {
+		if(load.error.empty()) {
+			load.done = std::make_unique<std::atomic<bool>[]>(load.jobs.size());
+			for(size_t i = 0; i < load.jobs.size(); i++) load.done[i] = true;
+			load.jobs_ready = true;
+		}
+		load.finished = true;
+		return;
+	}
+
+	Assimp::Importer importer;
+	importer.SetProgressHandler(new Load_Progress(load));
+
+	const aiScene* scene = nullptr;
+	{
+		PROF_ZONE("Import");
+		scene = importer.ReadFile(load.file.c_str(), import_flags);
+	}
+
+	if(!scene) {
+		if(!load.cancel) {
+			load.error = "Parsing scene " + load.file + ": " + std::string(importer.GetErrorString());
+		}
+		load.finished = true;
+		return;
+	}
+
+	scene->mRootNode->mTransformation = aiMatrix4x4();
+	flatten_node(load.jobs, scene, scene->mRootNode, aiMatrix4x4());
+	find_sources(load.jobs);
+	load.done = std::make_unique<std::atomic<bool>[]>(load.jobs.size());
+	for(size_t i = 0; i < load.jobs.size(); i++) load.done[i] = false;
+	load.jobs_ready = true;
+
+	convert_meshes(load.jobs, load.done.get(), &load.cancel);
+	load.finished = true;
+}
+
+std::string Scene::begin_load(bool clear_first, Undo& undo, std::string file) {
+
+	if(has_extension(file, ".s4d")) return load(clear_first, undo, file);
+
+	if(load_state) {
+		load_state->cancel = true;
+		load_state->thread.join();
+	}
+
+	load_state = std::make_unique<Scene_Load>();
+	load_state->file = file;
+	load_state->clear_first = clear_first;
+	load_state->thread = std::thread(run_load, std::ref(*load_state));
+	return {};
+}
+
+bool Scene::update_load(Undo& undo, std::string& errors) {
+
+	if(!load_state) return false;
+	Scene_Load& load = *load_state;
+
+	if(!load.cancel && load.jobs_ready) {
+
+		PROF_ZONE("Commit Objects");
+
+		// Always make progress, but don't spend more than a few ms per frame
+		auto start = std::chrono::steady_clock::now();
+		auto budget = std::chrono::milliseconds(4);
+
+		while(load.next_commit < load.jobs.size() &&
+			  load.done[load.next_commit].load(std::memory_order_acquire)) {
+
+			Scene_Object obj;
+			std::string err = commit_job(*this, load.jobs, load.next_commit++, obj);
+			if(!err.empty()) {
+				load.errors.push_back(err);
+			} else if(load.clear_first) {
+				load.pending.push_back(std::move(obj));
+			} else {
+				add(std::move(obj));
+			}
+
+			if(std::chrono::steady_clock::now() - start > budget) break;
+		}
+	}
+
+	bool committed = load.jobs_ready && load.next_commit == load.jobs.size();
+	if(!load.finished || !(committed || load.cancel || !load.jobs_ready)) return false;
+
+	load.thread.join();
+
+	if(load.clear_first && committed && !load.cancel) {
+		// The new objects' ids were reserved past the old ones
+		Scene_Object::ID next = next_id;
+		clear(undo);
+		next_id = next;
+		for(Scene_Object& obj : load.pending) add(std::move(obj));
+	}
+
+	std::stringstream stream;
+	if(!load.error.empty()) stream << load.error << std::endl;
+	for(size_t i = 0; i < load.errors.size(); i++) {
+		stream << "Loading mesh " << i << ": " << load.errors[i] << std::endl;
+	}
+	errors = stream.str();
+
+	undo.scene_changed();
+	load_state.reset();
+	return true;
+}
+
+Scene::~Scene() {
+	cancel_load();
+	if(load_state) load_state->thread.join();
+}
+
+void Scene::cancel_load() {
+	if(load_state) load_state->cancel = true;
+}
+
+bool Scene::loading() const {
+	return load_state != nullptr;
+}
+
+float Scene::load_progress(std::string& stage) const {
+
+	if(!load_state) return 1.0f;
+	const Scene_Load& load = *load_state;
+
+	if(load.cancel) {
+		stage = "Cancelling...";
+		return 1.0f;
+	}
+	if(!load.jobs_ready) {
+		stage = "Reading " + load.file;
+		return 0.5f * load.import_progress;
+	}
+
+	size_t n = load.jobs.size();
+	if(n == 0) return 1.0f;
+	stage = "Building meshes (" + std::to_string(load.next_commit) + "/" + std::to_string(n) + ")";
+	return 0.5f + 0.5f * load.next_commit / n;
+}
+
 std::string Scene::write(std::string file) {
 	
+	if(has_extension(file, ".s4d")) return write_s4d(file);
 	if(objs.empty()) return {};
 
 	aiScene scene;
@@ -356,13 +1081,25 @@ std::string Scene::write(std::string file) {
 	}
 
 	size_t mesh_idx = 0;
-	for(auto& entry : objs) {
+	for(Scene_Object::ID id : ids()) {
 
-		Scene_Object& obj = entry.second;
+		Scene_Object& obj = *objs[slots[id]];
 		aiMesh* ai_mesh = scene.mMeshes[mesh_idx];
 		aiNode* ai_node = scene.mRootNode->mChildren[mesh_idx];
 
-		const std::vector<GL::Mesh::Vert>& verts = obj.mesh().verts();
+		// Editable objects export their polygons with shared vertices;
+		// others only have the indexed triangle mesh.
+		std::vector<std::vector<Halfedge_Mesh::Index>> polys;
+		std::vector<GL::Mesh::Vert> poly_verts;
+		if(auto p = obj.polygons()) {
+			p->expand(polys);
+			poly_verts = p->verts;
+		} else if(obj.editable) {
+			obj.current_mesh().to_poly(polys, poly_verts, true);
+		}
+
+		const std::vector<GL::Mesh::Vert>& verts = obj.editable ? poly_verts : obj.mesh().verts();
+		const std::vector<GL::Mesh::Index>& idxs = obj.mesh().indices();
 
 		ai_mesh->mVertices = new aiVector3D[verts.size()];
 		ai_mesh->mNormals = new aiVector3D[verts.size()];
@@ -375,18 +1112,27 @@ std::string Scene::write(std::string file) {
 			j++;
 		}
 
-		ai_mesh->mFaces = new aiFace[verts.size() / 3];
-		ai_mesh->mNumFaces = (unsigned int)(verts.size() / 3);
+		size_t n_faces = obj.editable ? polys.size() : idxs.size() / 3;
+		ai_mesh->mFaces = new aiFace[n_faces];
+		ai_mesh->mNumFaces = (unsigned int)n_faces;
+		ai_mesh->mPrimitiveTypes = 0;
 
-		int k = 0;
-		for(size_t i = 0; i < (verts.size() / 3); i++) {
+		for(size_t i = 0; i < n_faces; i++) {
 			aiFace &face = ai_mesh->mFaces[i];
-			face.mIndices = new unsigned int[3];
-			face.mNumIndices = 3;
-			face.mIndices[0] = k;
-			face.mIndices[1] = k+1;
-			face.mIndices[2] = k+2;
-			k = k + 3;
+			if(obj.editable) {
+				face.mNumIndices = (unsigned int)polys[i].size();
+				face.mIndices = new unsigned int[face.mNumIndices];
+				for(unsigned int k = 0; k < face.mNumIndices; k++) {
+					face.mIndices[k] = (unsigned int)polys[i][k];
+				}
+			} else {
+				face.mNumIndices = 3;
+				face.mIndices = new unsigned int[3];
+				face.mIndices[0] = idxs[3 * i];
+				face.mIndices[1] = idxs[3 * i + 1];
+				face.mIndices[2] = idxs[3 * i + 2];
+			}
+			ai_mesh->mPrimitiveTypes |= AI_PRIMITIVE_TYPE_FOR_N_INDICES(face.mNumIndices);
 		}
 
 		ai_mesh->mName = aiString(obj.opt.name);
@@ -406,3 +1152,286 @@ std::string Scene::write(std::string file) {
 	}
 	return {};
 }
+
+// The .s4d format is a header followed by one record per object. Every
+// block is padded to 8 bytes so the whole file can be mapped and the
+// halfedge arrays read in place (see Halfedge_Mesh::read_flat).
+namespace {
+const char s4d_magic[4] = {'S', '4', 'D', '\0'};
+const uint32_t s4d_version = 2; // Version 1 files have no polygon records
+
+struct S4D_Header {
+	char magic[4];
+	uint32_t version;
+	uint32_t n_objects;
+	uint32_t next_id; // Zero if unknown
+};
+
+enum : uint32_t {
+	s4d_halfedge = 1 << 0,
+	s4d_wireframe = 1 << 1,
+	s4d_polygons = 1 << 2, // Imported and never edited, see Scene_Object::Polygons
+};
+
+struct S4D_Object {
+	uint32_t id, flags;
+	Vec3 pos, euler, scale, color;
+	uint32_t name_len, pad;
+	uint64_t size; // bytes following this header, including the name
+};
+
+void pad8(std::vector<unsigned char>& out) {
+	out.resize((out.size() + 7) & ~(size_t)7);
+}
+
+size_t padded8(size_t size) {
+	return (size + 7) & ~(size_t)7;
+}
+}
+
+std::string Scene::write_s4d(std::string file) {
+
+	PROF_ZONE("Write S4D");
+
+	std::vector<unsigned char> out;
+	snapshot().write(out);
+
+	FILE* f = fopen(file.c_str(), "wb");
+	if(!f) return "Failed to open " + file + " for writing.";
+	size_t written = fwrite(out.data(), 1, out.size(), f);
+	bool failed = fclose(f) != 0 || written != out.size();
+	if(failed) return "Failed to write " + file + ".";
+	return {};
+}
+
+Scene::Snapshot Scene::snapshot() {
+
+	PROF_ZONE("Snapshot");
+
+	Snapshot ret;
+	ret.next_id = next_id;
+	ret.objs.reserve(objs.size());
+	for(Scene_Object::ID id : ids()) {
+		ret.objs.push_back(objs[slots[id]]->image());
+	}
+	return ret;
+}
+
+void Scene::Snapshot::write(std::vector<unsigned char>& out) const {
+
+	PROF_ZONE("Write Snapshot");
+
+	out.clear();
+	S4D_Header header = {};
+	std::memcpy(header.magic, s4d_magic, sizeof(s4d_magic));
+	header.version = s4d_version;
+	header.n_objects = (uint32_t)objs.size();
+	header.next_id = next_id;
+	out.resize(sizeof(header));
+	std::memcpy(out.data(), &header, sizeof(header));
+
+	for(const Scene_Object::Image& obj : objs) {
+		obj.write(out);
+	}
+}
+
+Scene_Object::Image Scene_Object::image() {
+
+	Image ret;
+	ret.id = _id;
+	ret.pose = pose;
+	ret.color = color;
+	ret.opt = opt;
+
+	// Objects that have not been edited yet store their polygons as
+	// imported; building the halfedge mesh waits until they are opened.
+	ret.polys = polygons();
+	if(!ret.polys && editable) {
+		ret.halfedge = frozen_mesh();
+	} else if(!ret.polys) {
+		ret.verts = mesh().verts();
+		ret.idxs = mesh().indices();
+	}
+	return ret;
+}
+
+void Scene_Object::Image::write(std::vector<unsigned char>& out) const {
+
+	size_t start = out.size();
+	out.resize(start + sizeof(S4D_Object));
+
+	const char* name = opt.name.c_str();
+	size_t name_len = strlen(name);
+	out.insert(out.end(), name, name + name_len);
+	pad8(out);
+
+	bool has_halfedge = halfedge != nullptr;
+
+	if(polys) {
+		uint32_t counts[4] = {(uint32_t)polys->verts.size(), (uint32_t)polys->indices.size(),
+							  (uint32_t)polys->sizes.size(), 0};
+		const unsigned char* c = (const unsigned char*)counts;
+		const unsigned char* v = (const unsigned char*)polys->verts.data();
+		const unsigned char* i = (const unsigned char*)polys->indices.data();
+		const unsigned char* n = (const unsigned char*)polys->sizes.data();
+		out.insert(out.end(), c, c + sizeof(counts));
+		out.insert(out.end(), v, v + polys->verts.size() * sizeof(GL::Mesh::Vert));
+		out.insert(out.end(), i, i + polys->indices.size() * sizeof(unsigned int));
+		out.insert(out.end(), n, n + polys->sizes.size() * sizeof(unsigned int));
+	} else if(has_halfedge) {
+		halfedge->write_flat(out);
+	} else {
+		uint32_t counts[2] = {(uint32_t)verts.size(), (uint32_t)idxs.size()};
+		const unsigned char* c = (const unsigned char*)counts;
+		const unsigned char* v = (const unsigned char*)verts.data();
+		const unsigned char* i = (const unsigned char*)idxs.data();
+		out.insert(out.end(), c, c + sizeof(counts));
+		out.insert(out.end(), v, v + verts.size() * sizeof(GL::Mesh::Vert));
+		out.insert(out.end(), i, i + idxs.size() * sizeof(GL::Mesh::Index));
+	}
+	pad8(out);
+
+	S4D_Object rec = {};
+	rec.id = id;
+	rec.flags = (has_halfedge ? s4d_halfedge : 0) | (polys ? s4d_polygons : 0) |
+				(opt.wireframe ? s4d_wireframe : 0);
+	rec.pos = pose.pos;
+	rec.euler = pose.euler;
+	rec.scale = pose.scale;
+	rec.color = color;
+	rec.name_len = (uint32_t)name_len;
+	rec.size = out.size() - start - sizeof(S4D_Object);
+	std::memcpy(out.data() + start, &rec, sizeof(rec));
+}
+
+std::string Scene_Object::read(const unsigned char* data, size_t size, size_t& used, Scene_Object& obj) {
+
+	used = 0;
+	S4D_Object rec;
+	if(size < sizeof(rec)) return "File is truncated.";
+	std::memcpy((void*)&rec, data, sizeof(rec));
+	if(size - sizeof(rec) < rec.size || rec.size < padded8(rec.name_len)) {
+		return "File is truncated.";
+	}
+	used = sizeof(rec) + rec.size;
+
+	const unsigned char* body = data + sizeof(rec);
+	size_t body_size = rec.size - padded8(rec.name_len);
+	const unsigned char* mesh = body + padded8(rec.name_len);
+	Pose p = {rec.pos, rec.euler, rec.scale};
+
+	if(rec.flags & s4d_halfedge) {
+
+		Halfedge_Mesh hemesh;
+		size_t mesh_used = 0;
+		std::string err = hemesh.read_flat(mesh, body_size, mesh_used);
+		if(!err.empty()) return err;
+		obj = Scene_Object(rec.id, p, std::move(hemesh), rec.color);
+
+	} else if(rec.flags & s4d_polygons) {
+
+		uint32_t counts[4];
+		if(body_size < sizeof(counts)) return "Mesh data is truncated.";
+		std::memcpy(counts, mesh, sizeof(counts));
+		size_t v_bytes = (size_t)counts[0] * sizeof(GL::Mesh::Vert);
+		size_t i_bytes = (size_t)counts[1] * sizeof(unsigned int);
+		size_t n_bytes = (size_t)counts[2] * sizeof(unsigned int);
+		if(body_size - sizeof(counts) < v_bytes + i_bytes + n_bytes) return "Mesh data is truncated.";
+
+		Polygons polys;
+		polys.verts.resize(counts[0]);
+		polys.indices.resize(counts[1]);
+		polys.sizes.resize(counts[2]);
+		const unsigned char* src = mesh + sizeof(counts);
+		std::memcpy((void*)polys.verts.data(), src, v_bytes);
+		std::memcpy(polys.indices.data(), src + v_bytes, i_bytes);
+		std::memcpy(polys.sizes.data(), src + v_bytes + i_bytes, n_bytes);
+
+		// Checked here since the triangulation walks them before any build
+		size_t total = 0;
+		for(unsigned int n : polys.sizes) {
+			if(n < 3) return "Each polygon must have at least three vertices.";
+			total += n;
+		}
+		if(total != polys.indices.size()) return "Polygon sizes don't match the indices.";
+		for(unsigned int i : polys.indices) {
+			if(i >= polys.verts.size()) return "Mesh data has an out of range vertex index.";
+		}
+		obj = Scene_Object(rec.id, p, std::move(polys), rec.color);
+
+	} else {
+
+		uint32_t counts[2];
+		if(body_size < sizeof(counts)) return "Mesh data is truncated.";
+		std::memcpy(counts, mesh, sizeof(counts));
+		size_t v_bytes = (size_t)counts[0] * sizeof(GL::Mesh::Vert);
+		size_t i_bytes = (size_t)counts[1] * sizeof(GL::Mesh::Index);
+		if(body_size - sizeof(counts) < v_bytes + i_bytes) return "Mesh data is truncated.";
+		std::vector<GL::Mesh::Vert> verts(counts[0]);
+		std::vector<GL::Mesh::Index> idxs(counts[1]);
+		std::memcpy((void*)verts.data(), mesh + sizeof(counts), v_bytes);
+		std::memcpy(idxs.data(), mesh + sizeof(counts) + v_bytes, i_bytes);
+		obj = Scene_Object(rec.id, p, GL::Mesh(std::move(verts), std::move(idxs)), rec.color);
+	}
+
+	obj.opt.name = std::string((const char*)body, rec.name_len);
+	obj.opt.name.reserve(max_name_len);
+	obj.opt.wireframe = (rec.flags & s4d_wireframe) != 0;
+	return {};
+}
+
+std::string Scene::load_s4d(bool clear_first, Undo& undo, std::string file) {
+
+	Mapped_File map;
+	std::string err = map.open(file);
+	if(!err.empty()) return err;
+
+	const unsigned char* data = map.data();
+	size_t size = map.size();
+
+	S4D_Header header;
+	if(size < sizeof(header)) return "Parsing scene " + file + ": file is truncated.";
+	std::memcpy(&header, data, sizeof(header));
+	if(std::memcmp(header.magic, s4d_magic, sizeof(s4d_magic))) {
+		return "Parsing scene " + file + ": not an s4d file.";
+	}
+	if(header.version != s4d_version && header.version != 1) {
+		return "Parsing scene " + file + ": unsupported version " + std::to_string(header.version) + ".";
+	}
+
+	if(clear_first) clear(undo);
+	if(clear_first) next_id = std::max(next_id, (Scene_Object::ID)header.next_id);
+
+	std::vector<std::string> errors;
+	size_t offset = sizeof(header);
+
+	for(uint32_t i = 0; i < header.n_objects; i++) {
+
+		Scene_Object obj;
+		size_t used = 0;
+		std::string err = Scene_Object::read(data + offset, size - offset, used, obj);
+		offset += used;
+		if(!err.empty()) {
+			errors.push_back(err);
+			if(!used) break;
+			continue;
+		}
+
+		// Replacing the scene keeps the saved ids, so a session journal
+		// recorded against them still applies (see journal.h).
+		Scene_Object::ID id = obj.id();
+		if(clear_first && id >= first_id && slots.find(id) == slots.end()) {
+			next_id = std::max(next_id, id + 1);
+		} else {
+			obj._id = reserve_id();
+		}
+		add(std::move(obj));
+	}
+
+	std::stringstream stream;
+	for(size_t i = 0; i < errors.size(); i++) {
+		stream << "Loading mesh " << i << ": " << errors[i] << std::endl;
+	}
+	undo.scene_changed();
+	return stream.str();
+}
@@ -2,23 +2,29 @@
 #pragma once
 
 #include "../lib/math.h"
+#include "../lib/jobs.h"
 #include "../platform/gl.h"
 #include "halfedge.h"
 
 #include <map>
+#include <memory>
 #include <optional>
 #include <functional>
+#include <unordered_map>
 
 #include <assimp/scene.h>
 
 class Undo;
+struct Scene_Load;
 
 struct Pose {
 	Vec3 pos;
 	Vec3 euler;
 	Vec3 scale = {1.0f};
 
+	/// Cached, so calling these every frame is cheap while the pose is still
 	Mat4 transform() const;
+	Mat4 inverse() const;
 	Mat4 rotation_mat() const;
 	Quat rotation_quat() const;
 
@@ -29,15 +35,50 @@ struct Pose {
 	static Pose moved(Vec3 t);
 	static Pose scaled(Vec3 s);
 	static Pose id();
+
+	/// Matrices for the last pos/euler/scale they were asked for with.
+	/// Not part of the pose itself: journal and file records store only the
+	/// three fields above.
+	mutable Transform cache;
 };
 
 class Scene_Object {
 public:
 	using ID = unsigned int;
 
+	/// Compact indexed polygon mesh. Imported objects keep only this (and
+	/// their GL mesh) until they are first edited, see build_mesh().
+	struct Polygons {
+		std::vector<GL::Mesh::Vert> verts;
+		std::vector<unsigned int> indices; ///< All faces back to back
+		std::vector<unsigned int> sizes;   ///< Vertices per face
+
+		std::string build(Halfedge_Mesh& mesh) const;
+		void expand(std::vector<std::vector<Halfedge_Mesh::Index>>& polygons) const;
+		size_t bytes() const;
+	};
+
+	/// Polygons imported once for every node that references them, and the
+	/// GL mesh they all draw with as instances (see Scene::update_batch).
+	/// Objects hold on to it until they are first edited.
+	struct Shared {
+		Shared(Polygons&& polys, GL::Mesh&& mesh);
+
+		std::shared_ptr<const Polygons> polys;
+		GL::Instances instances;
+
+		// Scene::update_batch bookkeeping
+		size_t count = 0, drawn = 0;
+		bool dirty = false;
+	};
+
 	Scene_Object();
 	Scene_Object(ID id, Pose pose, GL::Mesh&& mesh, Vec3 color);
 	Scene_Object(ID id, Pose pose, Halfedge_Mesh&& mesh, Vec3 color);
+	Scene_Object(ID id, Pose pose, Polygons&& polys, Vec3 color);
+	/// With mesh already built from polys
+	Scene_Object(ID id, Pose pose, Polygons&& polys, GL::Mesh&& mesh, Vec3 color);
+	Scene_Object(ID id, Pose pose, std::shared_ptr<Shared> shared, Vec3 color);
 	Scene_Object(const Scene_Object& src) = delete;
 	Scene_Object(Scene_Object&& src);
 	~Scene_Object();
@@ -45,19 +86,37 @@ public:
 	void operator=(const Scene_Object& src) = delete;
 	void operator=(Scene_Object&& src);
 
+	/// Bring the GL mesh up to date now, waiting on any background rebuild
 	void sync_mesh();
 	void render_mesh(Mat4 view, bool solid = false, bool depth_only = false);
 	void render_halfedge(Mat4 view);
 	void copy_mesh(Halfedge_Mesh& out);
 	void set_mesh(const Halfedge_Mesh& in);
+	/// Share in as the new mesh; it is only copied once edited (see get_mesh)
+	void set_mesh(std::shared_ptr<const Halfedge_Mesh> in);
+	/// The mesh for editing, which the caller must follow with set_mesh_dirty()
 	Halfedge_Mesh& get_mesh();
+	/// The current mesh as an immutable copy other threads may read (a
+	/// background rebuild, the journal). Only copies if the mesh was edited
+	/// since the last call; null if the object isn't editable.
+	std::shared_ptr<const Halfedge_Mesh> frozen_mesh();
+
+	/// Start building the halfedge mesh of an imported object on a background
+	/// thread, when it is about to be opened in model mode
+	void prepare_mesh();
+	/// Build the halfedge mesh now, if it wasn't already. Returns an error
+	/// message if the polygons don't form a valid mesh (the object then stays view-only).
+	std::string build_mesh();
 
 	ID id() const {return _id;}
-	const GL::Mesh& mesh() const {return _mesh;}
+	const GL::Mesh& mesh() const {return shared ? shared->instances.mesh() : _mesh;}
 	
 	BBox bbox() const;
 	void set_mesh_dirty();
-	
+
+	/// Approximate heap memory held by this object's mesh data
+	size_t bytes() const;
+
 	struct Options {
 		std::string name;
 		bool wireframe = false;
@@ -65,16 +124,82 @@ public:
 	Options opt;
 	Pose pose;
 
+	/// What an .s4d object record stores. Mesh data is shared rather than
+	/// copied (except for plain GL meshes), so images are cheap to take and
+	/// can be written out on another thread.
+	struct Image {
+		ID id = 0;
+		Pose pose;
+		Vec3 color;
+		Options opt;
+		std::shared_ptr<const Polygons> polys;
+		std::shared_ptr<const Halfedge_Mesh> halfedge;
+		std::vector<GL::Mesh::Vert> verts; ///< Neither of the above: not editable
+		std::vector<GL::Mesh::Index> idxs;
+
+		/// Append as one .s4d object record
+		void write(std::vector<unsigned char>& out) const;
+	};
+	Image image();
+	/// Parse one .s4d object record into obj, keeping its saved id. used is
+	/// set to the record's size, or zero if the record itself is cut off.
+	static std::string read(const unsigned char* data, size_t size, size_t& used, Scene_Object& obj);
+
 private:
 	static const int max_name_len = 256;
 
 	Vec3 color;
 	ID _id = 0;
 	bool editable = true;
+	std::string mesh_error;
+
+	// The mesh is edited in place, but other threads only ever see frozen
+	// copies. Objects built or read from a file start out with only the
+	// frozen mesh, which get_mesh() moves or copies into halfedge.
 	Halfedge_Mesh halfedge;
+	std::shared_ptr<const Halfedge_Mesh> frozen; ///< Null if out of date
+	bool thawed = true;                          ///< Whether halfedge is current
+	const Halfedge_Mesh& current_mesh() const {return thawed ? halfedge : *frozen;}
+
+	// Set until the halfedge mesh is built
+	struct Lazy {
+		std::shared_ptr<const Polygons> polys;
+		Halfedge_Mesh mesh;
+		std::string error;
+		bool started = false;
+		// Declared last so it is destroyed (and waited on) first
+		Jobs::Group build;
+	};
+	std::unique_ptr<Lazy> lazy;
+
+	// Set until the object is edited; lazy and _mesh are unused meanwhile
+	std::shared_ptr<Shared> shared;
+	/// Stop drawing as part of the shared group, as if imported on its own
+	void unshare();
+	/// Polygons the object was imported with, if it wasn't edited since
+	std::shared_ptr<const Polygons> polygons() const;
 	
 	GL::Mesh _mesh;
 	bool mesh_dirty = false;
+
+	// Set while the GL mesh is being rebuilt from a frozen copy of the mesh
+	// on a worker. The old GL mesh is drawn until the new data is uploaded.
+	struct Rebuild {
+		std::shared_ptr<const Halfedge_Mesh> mesh;
+		std::vector<GL::Mesh::Vert> verts;
+		std::vector<GL::Mesh::Index> idxs;
+		BBox box;
+		// Declared last so it is destroyed (and waited on) first
+		Jobs::Group task;
+	};
+	std::unique_ptr<Rebuild> rebuild;
+
+	/// Start or finish a background rebuild; never blocks
+	void refresh_mesh();
+	/// Wait for the background rebuild, if any, and upload its result
+	void finish_rebuild();
+
+	friend class Scene;
 };
 
 class Scene {
@@ -86,24 +211,85 @@ public:
 	std::string load(bool clear_first, Undo& undo, std::string file);
 	void clear(Undo& undo);
 
+	/// The whole scene as stored in the native .s4d format
+	struct Snapshot {
+		std::vector<Scene_Object::Image> objs; ///< Ascending ids
+		Scene_Object::ID next_id = 0;
+
+		/// Serialize; safe on any thread
+		void write(std::vector<unsigned char>& out) const;
+	};
+	/// Cheap, see Scene_Object::Image
+	Snapshot snapshot();
+
+	/// Start importing file on a background thread. Objects are added to the
+	/// scene by update_load() as they finish. Native .s4d files load immediately.
+	std::string begin_load(bool clear_first, Undo& undo, std::string file);
+	/// Add finished objects to the scene; call once per frame. Returns true
+	/// when a load completed (or was cancelled) during this call, in which
+	/// case errors holds any error messages.
+	bool update_load(Undo& undo, std::string& errors);
+	void cancel_load();
+	bool loading() const;
+	/// Fraction of the current load completed, and what it is doing
+	float load_progress(std::string& stage) const;
+
     bool empty();
     size_t size();
 	Scene_Object::ID add(Scene_Object&& obj);
     Scene_Object::ID add(Pose pose, GL::Mesh&& mesh, Scene_Object::ID id = 0);
 	Scene_Object::ID reserve_id();
     
-	void erase(Scene_Object::ID id);
-	void restore(Scene_Object::ID id);
+	/// Remove an object from the scene, handing it to the caller (the undo
+	/// history parks it until the erase is undone; see Undo::del_obj).
+	Scene_Object erase(Scene_Object::ID id);
 
     void render_objs(Mat4 view, Scene_Object::ID selected);
-    void for_objs(std::function<void(Scene_Object&)> func);
+
+	/// Visit every object, in storage order (which changes when objects are erased)
+	template<typename F> void for_objs(F&& func) {
+		for(auto& obj : objs) func(*obj);
+	}
+	/// Object ids in ascending order, for lists that shouldn't reshuffle
+	const std::vector<Scene_Object::ID>& ids();
 
     std::optional<std::reference_wrapper<Scene_Object>> get(Scene_Object::ID id);
 
 private:
-	void load_node(std::vector<std::string>& errors, const aiScene* scene, aiNode* node, aiMatrix4x4 transform);
+	/// Native binary format (.s4d), see scene.cpp
+	std::string write_s4d(std::string file);
+	std::string load_s4d(bool clear_first, Undo& undo, std::string file);
+	/// Bring the batch and the instanced groups up to date with every
+	/// object except selected
+	void update_batch(Scene_Object::ID selected);
 
-	std::map<Scene_Object::ID, Scene_Object> objs;
-	std::map<Scene_Object::ID, Scene_Object> erased;
+	// Packed so traversal is a linear walk; erase moves the last object into
+	// the hole. Objects are boxed so they never move while in the scene: the
+	// renderer keeps a pointer to the halfedge mesh being edited.
+	std::vector<std::unique_ptr<Scene_Object>> objs;
+	std::unordered_map<Scene_Object::ID, size_t> slots;
+
+	std::vector<Scene_Object::ID> sorted_ids;
+	bool ids_dirty = false;
 	Scene_Object::ID next_id, first_id;
+
+	std::unique_ptr<Scene_Load> load_state;
+
+	// Unselected objects are drawn together from one batch holding world
+	// space copies of their GL meshes. An entry is rewritten when its object
+	// moves, and added again (leaving the old one unused) when its mesh
+	// changes. The whole batch is rebuilt once most of it is unused.
+	// Objects still sharing imported geometry are instead drawn with one
+	// instanced draw per group, whose transforms are rewritten when any
+	// member moves, joins, or leaves.
+	struct Batched {
+		size_t entry = 0, verts = 0;
+		unsigned int revision = 0;
+		Vec3 pos, euler, scale, color;
+		bool in_batch = false, instanced = false, seen = false;
+	};
+	GL::Batch batch;
+	std::unordered_map<Scene_Object::ID, Batched> batched;
+	size_t batch_live = 0, batch_dead = 0; // Vertices
+	std::vector<std::pair<Scene_Object::Shared*, Vec3>> instanced; // This frame's groups and colors
 };
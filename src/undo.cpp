@@ -1,57 +1,196 @@
 
 #include "undo.h"
+#include "journal.h"
 
 #include "scene/mesh_render.h"
 #include "lib/log.h"
+#include "platform/prof.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+namespace {
+// Hand freed pages back to the OS; glibc otherwise keeps them for reuse
+void release_memory() {
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
+
+std::string spill_path() {
+    static const std::string prefix = "s4d-undo-" + std::to_string(std::random_device()()) + "-";
+    static std::atomic<unsigned int> count = 0;
+    return (std::filesystem::temp_directory_path() / (prefix + std::to_string(count++) + ".s4d")).string();
+}
+}
+
+Parked_Object::Parked_Object() {}
+
+Parked_Object::~Parked_Object() {
+    if(!file.empty()) {
+        std::error_code err;
+        std::filesystem::remove(file, err);
+    }
+}
+
+void Parked_Object::put(Scene_Object&& o) {
+    held = o.bytes();
+    obj.emplace(std::move(o));
+    parked = true;
+}
+
+std::optional<Scene_Object> Parked_Object::take() {
+
+    assert(parked);
+
+    if(obj) {
+        parked = false;
+        Scene_Object ret = std::move(*obj);
+        obj.reset();
+        return ret;
+    }
+
+    PROF_ZONE("Unspill Object");
+
+    std::ifstream in(file, std::ios::binary);
+    std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    // Copy into 8-byte aligned storage for read_flat
+    std::vector<uint64_t> storage((bytes.size() + 7) / 8);
+    std::memcpy(storage.data(), bytes.data(), bytes.size());
+
+    Scene_Object ret;
+    size_t used = 0;
+    std::string error = in.is_open() ? Scene_Object::read((const unsigned char*)storage.data(), bytes.size(), used, ret)
+                                     : "Can't read " + file;
+    if(!error.empty()) {
+        warn("Failed to reload erased object: %s", error.c_str());
+        return std::nullopt;
+    }
+
+    std::error_code err;
+    std::filesystem::remove(file, err);
+    file.clear();
+    parked = false;
+    return ret;
+}
+
+bool Parked_Object::spill() {
+
+    if(!parked || !obj) return false;
+
+    PROF_ZONE("Spill Object");
+
+    std::vector<unsigned char> data;
+    obj->image().write(data);
+
+    std::string path = spill_path();
+    std::ofstream out(path, std::ios::binary);
+    out.write((const char*)data.data(), data.size());
+    out.close();
+    if(!out) {
+        warn("Failed to spill erased object to %s", path.c_str());
+        std::error_code err;
+        std::filesystem::remove(path, err);
+        return false;
+    }
+
+    file = path;
+    obj.reset();
+    return true;
+}
 
 Undo::Undo() {}
 Undo::~Undo() {}
 
 void Undo::reset() {
-    undos = {};
-    redos = {};
+    undos.clear();
+    redos.clear();
+    journal_undos = journal_redos = 0;
+    release_memory();
+}
+
+void Undo::set_budget(size_t bytes, bool s) {
+    budget = bytes;
+    spill = s;
+    enforce_budget();
+}
+
+void Undo::set_journal(Journal* j) {
+    journal = j;
+}
+
+void Undo::scene_changed() {
+    if(journal) journal->scene_changed();
+}
+
+void Undo::checkpointed() {
+    journal_undos = undos.size();
+    journal_redos = redos.size();
 }
 
 void Undo::update_mesh(Scene& scene, Scene_Object::ID id, Halfedge_Mesh&& old_mesh, unsigned int old_id) {
     Scene_Object& obj = *scene.get(id);
     
-    Halfedge_Mesh new_mesh;
-    obj.copy_mesh(new_mesh);
+    // Shared with the object and the journal until either is edited again
+    std::shared_ptr<const Halfedge_Mesh> new_mesh = obj.frozen_mesh();
+    std::shared_ptr<const Halfedge_Mesh> prev_mesh = std::make_shared<Halfedge_Mesh>(std::move(old_mesh));
+    if(journal) journal->mesh(id, new_mesh);
 
+    size_t bytes = new_mesh->bytes() + prev_mesh->bytes();
     action([id, &scene, nm=std::move(new_mesh), old_id]() {
         Scene_Object& obj = *scene.get(id);
         obj.set_mesh(nm);
         Renderer::set_he_select(old_id);
-    }, [id, &scene, om=std::move(old_mesh), new_id=Renderer::get_he_select()]() {
+    }, [id, &scene, om=std::move(prev_mesh), new_id=Renderer::get_he_select()]() {
         Scene_Object& obj = *scene.get(id);
         obj.set_mesh(om);
         Renderer::set_he_select(new_id);
-    });
+    }, bytes);
 }
 
 void Undo::del_obj(Scene& scene, Scene_Object::ID id) {
-    scene.erase(id);
-    action([id, &scene](){
-        scene.erase(id);
-    }, [id, &scene](){
-        scene.restore(id);
-    });
+    if(journal) journal->erase(id);
+    // The action owns the parked object, the lambdas just point at it
+    auto parked = std::make_unique<Parked_Object>();
+    Parked_Object* p = parked.get();
+    p->put(scene.erase(id));
+    action([id, &scene, p](){
+        p->put(scene.erase(id));
+    }, [&scene, p](){
+        auto obj = p->take();
+        if(obj) scene.add(std::move(*obj));
+        return obj.has_value();
+    }, 0, std::move(parked));
 }
 
 void Undo::add_obj(Scene& scene, GL::Mesh&& mesh) {
     Scene_Object::ID id = scene.add({}, std::move(mesh));
-    scene.restore(id);
-    action([id, &scene](){
-        scene.restore(id);
-    }, [id, &scene](){
-        scene.erase(id);
-    });
+    if(journal) journal->add(id, scene.get(id)->get().mesh());
+    auto parked = std::make_unique<Parked_Object>();
+    Parked_Object* p = parked.get();
+    action([&scene, p](){
+        auto obj = p->take();
+        if(obj) scene.add(std::move(*obj));
+        return obj.has_value();
+    }, [id, &scene, p](){
+        p->put(scene.erase(id));
+    }, 0, std::move(parked));
 };
 
 void Undo::update_obj(Scene& scene, Scene_Object::ID id, Pose new_pos) {
     Scene_Object& obj = *scene.get(id);
     Pose old_pos = obj.pose;
     obj.pose = new_pos;
+    if(journal) journal->pose(id, new_pos);
     action([id, &scene, new_pos](){
         Scene_Object& obj = *scene.get(id);
         obj.pose = new_pos;
@@ -62,20 +201,97 @@ void Undo::update_obj(Scene& scene, Scene_Object::ID id, Pose new_pos) {
 }
 
 void Undo::action(std::unique_ptr<Action_Base>&& action) {
-    redos = {};
-    undos.push(std::move(action));
+    bool freed = !redos.empty();
+    redos.clear();
+    journal_redos = 0;
+    undos.push_back(std::move(action));
+    enforce_budget();
+    if(freed) release_memory();
+}
+
+void Undo::enforce_budget() {
+
+    auto total = [this]() {
+        size_t bytes = 0;
+        for(auto& a : undos) bytes += a->bytes();
+        for(auto& a : redos) bytes += a->bytes();
+        return bytes;
+    };
+
+    size_t used = total();
+    if(used <= budget) return;
+
+    PROF_ZONE("Undo Budget");
+
+    // Spill the entries least likely to be needed first: the oldest undos,
+    // then the furthest redos.
+    if(spill) {
+        for(auto* list : {&undos, &redos}) {
+            for(auto& a : *list) {
+                if(used <= budget) break;
+                if(!a->parked) continue;
+                size_t before = a->parked->bytes();
+                if(a->parked->spill()) used -= before;
+            }
+        }
+    }
+
+    // Then forget history, always keeping the latest action undoable
+    bool evicted = false;
+    while(used > budget && undos.size() > 1) {
+        used -= undos.front()->bytes();
+        undos.pop_front();
+        if(journal_undos) journal_undos--;
+        evicted = true;
+    }
+    while(used > budget && !redos.empty()) {
+        used -= redos.front()->bytes();
+        redos.pop_front();
+        if(journal_redos) journal_redos--;
+        evicted = true;
+    }
+    if(evicted) release_memory();
 }
 
 void Undo::undo() {
     if (undos.empty()) return;
-    undos.top()->undo();
-    redos.push(std::move(undos.top()));
-    undos.pop();
+    PROF_ZONE("Undo");
+    if(!undos.back()->undo()) {
+        // Older entries may refer to what couldn't be restored; what is
+        // left to redo still applies to the unchanged scene.
+        warn("Undo failed, dropping the rest of the undo history");
+        undos.clear();
+        journal_undos = 0;
+        if(journal) journal->scene_changed();
+        release_memory();
+        return;
+    }
+    if(journal) {
+        if(undos.size() > journal_undos) journal->undo();
+        else journal->scene_changed();
+    }
+    redos.push_back(std::move(undos.back()));
+    undos.pop_back();
+    enforce_budget();
 }
 
 void Undo::redo() {
     if(redos.empty()) return;
-    redos.top()->redo();
-    undos.push(std::move(redos.top()));
-    redos.pop();
+    PROF_ZONE("Redo");
+    if(!redos.back()->redo()) {
+        // Later entries build on the one that failed
+        warn("Redo failed, dropping the rest of the redo history");
+        redos.clear();
+        journal_redos = 0;
+        if(journal) journal->scene_changed();
+        release_memory();
+        return;
+    }
+    if(journal) {
+        if(redos.size() > journal_redos) journal->redo();
+        else journal->scene_changed();
+    }
+    undos.push_back(std::move(redos.back()));
+    redos.pop_back();
+    enforce_budget();
 }
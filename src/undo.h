@@ -1,17 +1,53 @@
 
 #pragma once
 
+#include <deque>
 #include <memory>
-#include <stack>
+#include <type_traits>
 
 #include "scene/scene.h"
 
+class Journal;
+
+/// An object taken out of the scene by an erase that may still be undone.
+/// It lives as long as the history entries that refer to it, and can be
+/// spilled to a temporary file while it waits.
+class Parked_Object {
+public:
+    Parked_Object();
+    ~Parked_Object();
+
+    Parked_Object(const Parked_Object& src) = delete;
+    void operator=(const Parked_Object& src) = delete;
+
+    void put(Scene_Object&& obj);
+    /// Empty if the object was spilled and can't be read back
+    std::optional<Scene_Object> take();
+
+    /// Memory held while parked (zero once spilled, or while in the scene)
+    size_t bytes() const {return parked ? held : 0;}
+    /// Move the object out to disk; returns false if it stays in memory
+    bool spill();
+
+private:
+    std::optional<Scene_Object> obj;
+    std::string file;
+    bool parked = false;
+    size_t held = 0;
+};
+
 class Action_Base {
-    virtual void undo() = 0;
-    virtual void redo() = 0;
+    /// False if the action could not be applied, leaving the scene as it was
+    virtual bool undo() = 0;
+    virtual bool redo() = 0;
     friend class Undo;
 public:
     virtual ~Action_Base() {}
+
+private:
+    size_t bytes() const {return _bytes + (parked ? parked->bytes() : 0);}
+    size_t _bytes = 0;
+    std::unique_ptr<Parked_Object> parked;
 };
 
 template<typename R, typename U>
@@ -23,8 +59,17 @@ public:
 private:
     U _undo;
     R _redo;
-    void undo() {_undo();}
-    void redo() {_redo();}
+    bool undo() {return run(_undo);}
+    bool redo() {return run(_redo);}
+
+    // Only actions that can fail return whether they succeeded
+    template<typename F> static bool run(F& f) {
+        if constexpr(std::is_same_v<decltype(f()), bool>) return f();
+        else {
+            f();
+            return true;
+        }
+    }
 };
 
 class Undo {
@@ -42,13 +87,35 @@ public:
     void redo();
     void reset();
 
+    /// Record every action to journal (nullptr to stop)
+    void set_journal(Journal* journal);
+    /// The scene was changed outside of the undo history, e.g. by loading
+    void scene_changed();
+    /// The journal took a snapshot; only later actions can be replayed
+    void checkpointed();
+
+    /// Cap the memory held by the history. Parked objects are spilled to
+    /// disk first (if allowed), then the oldest entries are dropped.
+    void set_budget(size_t bytes, bool spill);
+
 private:
     template<typename R, typename U> 
-    void action(R&& redo, U&& undo) {
-        action(std::make_unique<Action<R,U>>(std::move(redo), std::move(undo)));
+    void action(R&& redo, U&& undo, size_t bytes = 0, std::unique_ptr<Parked_Object> parked = nullptr) {
+        auto a = std::make_unique<Action<R,U>>(std::move(redo), std::move(undo));
+        a->_bytes = bytes;
+        a->parked = std::move(parked);
+        action(std::move(a));
     }
     void action(std::unique_ptr<Action_Base>&& action);
-    
-    std::stack<std::unique_ptr<Action_Base>> undos;
-    std::stack<std::unique_ptr<Action_Base>> redos;
+    void enforce_budget();
+
+    // Most recent entries at the back
+    std::deque<std::unique_ptr<Action_Base>> undos;
+    std::deque<std::unique_ptr<Action_Base>> redos;
+    size_t budget = 512ull << 20;
+    bool spill = true;
+    Journal* journal = nullptr;
+    // History depth already covered by the journal's last snapshot. Undoing
+    // or redoing past it can't be replayed, so it forces a new snapshot.
+    size_t journal_undos = 0, journal_redos = 0;
 };